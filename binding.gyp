@@ -22,6 +22,19 @@
           }
         }]
       ]
+    },
+    {
+      "target_name": "irf-cli",
+      "type": "executable",
+      "sources": [
+        "irf/cli.cpp",
+        "irf/randomForest.h",
+        "irf/randomForest.cpp",
+        "irf/MurmurHash3.h",
+        "irf/MurmurHash3.cpp"
+      ],
+      'cflags': [ '<!@(pkg-config --cflags libsparsehash)' ],
+      'libraries': [ '-lpthread' ]
     }
   ]
 }
\ No newline at end of file
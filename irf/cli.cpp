@@ -0,0 +1,114 @@
+/* Copyright 2010-2011 Carlos Guerreiro
+ * Licensed under the MIT license */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "randomForest.h"
+
+using namespace std;
+using namespace IncrementalRandomForest;
+
+static int usage(void) {
+  fprintf(stderr,
+          "usage: irf-cli train [--prefix <id prefix>] <forest file> <libsvm file> <negative label> [number of trees]\n"
+          "       irf-cli classify [--prefix <id prefix>] <forest file> <libsvm file> <negative label>\n"
+          "train adds the samples to the forest (created if the file doesn't exist yet), commits and saves it\n"
+          "classify prints the classification of each sample, and counts against their labels\n"
+          "sample ids are the line numbers after the prefix, by default the libsvm file name and ':',\n"
+          "so training again on the same file replaces its samples, and other files add to them\n");
+  return 2;
+}
+
+// file name without its directory, and ':'
+static string defaultPrefix(const char* dataName) {
+  const char* base = strrchr(dataName, '/');
+  return string(base ? base + 1 : dataName) + ":";
+}
+
+static int train(const char* forestName, const char* dataName, const char* idPrefix, float negativeLabel, int nTrees) {
+  Forest* rf;
+  ifstream inF(forestName);
+  if(inF.is_open())
+    rf = load(inF, LOAD_PARALLEL);
+  else
+    rf = create(nTrees);
+  inF.close();
+
+  int added = addFromFile(rf, dataName, idPrefix, negativeLabel, 0);
+  if(added < 0) {
+    fprintf(stderr, "could not read %s\n", dataName);
+    destroy(rf);
+    return 1;
+  }
+  fprintf(stderr, "added %d samples\n", added);
+
+  commit(rf);
+
+  ofstream outF(forestName);
+  bool saved = outF.is_open() && save(rf, outF);
+  destroy(rf);
+  if(!saved) {
+    fprintf(stderr, "could not save %s\n", forestName);
+    return 1;
+  }
+  return 0;
+}
+
+static int classify(const char* forestName, const char* dataName, const char* idPrefix, float negativeLabel) {
+  ifstream inF(forestName);
+  if(!inF.is_open()) {
+    fprintf(stderr, "could not open %s\n", forestName);
+    return 1;
+  }
+  Forest* rf = load(inF, LOAD_PARALLEL);
+
+  ifstream dataF(dataName);
+  vector<Sample*> samples;
+  if(!dataF.is_open() || !readLibsvm(dataF, idPrefix, negativeLabel, samples)) {
+    fprintf(stderr, "could not read %s\n", dataName);
+    destroy(rf);
+    return 1;
+  }
+
+  int counts[2][2] = { { 0, 0 }, { 0, 0 } };
+  for(vector<Sample*>::iterator it = samples.begin(); it != samples.end(); ++it) {
+    float y = IncrementalRandomForest::classify(rf, *it);
+    printf("%s %f\n", (*it)->suid.c_str(), y);
+    ++counts[y >= 0.5][(*it)->y >= 0.5];
+    delete *it;
+  }
+  destroy(rf);
+
+  fprintf(stderr, "correct negatives: %d\n", counts[0][0]);
+  fprintf(stderr, "false   negatives: %d\n", counts[0][1]);
+  fprintf(stderr, "correct positives: %d\n", counts[1][1]);
+  fprintf(stderr, "false   positives: %d\n", counts[1][0]);
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if(argc < 2)
+    return usage();
+  const char* command = argv[1];
+  const char* idPrefix = 0;
+  argv += 2;
+  argc -= 2;
+  if(argc >= 2 && strcmp(argv[0], "--prefix") == 0) {
+    idPrefix = argv[1];
+    argv += 2;
+    argc -= 2;
+  }
+  if(argc < 3)
+    return usage();
+  string prefix = idPrefix ? string(idPrefix) : defaultPrefix(argv[1]);
+  if(argc <= 4 && strcmp(command, "train") == 0)
+    return train(argv[0], argv[1], prefix.c_str(), atof(argv[2]), argc == 4 ? atoi(argv[3]) : 99);
+  if(argc == 3 && strcmp(command, "classify") == 0)
+    return classify(argv[0], argv[1], prefix.c_str(), atof(argv[2]));
+  return usage();
+}
@@ -3,6 +3,7 @@
 
 #include <Python.h>
 #include "structmember.h"
+#include "pythread.h"
 
 #include "randomForest.h"
 #include <iostream>
@@ -14,6 +15,8 @@
 #include <map>
 
 #include <cstdlib>
+#include <cstring>
+#include <stdint.h>
 #include "MurmurHash3.h"
 
 using namespace std;
@@ -22,33 +25,143 @@ using namespace IncrementalRandomForest;
 struct IRF {
   PyObject_HEAD
   Forest* forest;
+  ofstream* log;
+  // held whenever the forest is used, as that is sometimes done without the GIL
+  PyThread_type_lock lock;
 
   IRF(void) {
     forest = 0;
+    log = 0;
+    lock = PyThread_allocate_lock();
   }
   ~IRF(void) {
     if(forest)
       destroy(forest);
+    delete log;
+    if(lock)
+      PyThread_free_lock(lock);
   }
 };
 
+// called with the GIL, which is released only while waiting for the lock
+static void lockForest(IRF* self) {
+  if(!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+  }
+}
+
+static void unlockForest(IRF* self) {
+  PyThread_release_lock(self->lock);
+}
+
 static void IRF_dealloc(IRF* self) {
   self->~IRF();
   self->ob_type->tp_free((PyObject*)self);
 }
 
+// chunked save to / load from Python file-like objects
+class FileObjectSink : public Sink {
+private:
+  PyObject* file;
+public:
+  FileObjectSink(PyObject* withFile) : file(withFile) {
+  }
+  virtual bool write(const char* data, size_t size) {
+    PyObject* ret = PyObject_CallMethod(file, (char*)"write", (char*)"s#", data, (Py_ssize_t)size);
+    if(!ret)
+      return false;
+    Py_DECREF(ret);
+    return true;
+  }
+};
+
+class FileObjectSource : public Source {
+private:
+  PyObject* file;
+public:
+  FileObjectSource(PyObject* withFile) : file(withFile) {
+  }
+  virtual size_t read(char* data, size_t size) {
+    PyObject* chunk = PyObject_CallMethod(file, (char*)"read", (char*)"n", (Py_ssize_t)size);
+    if(!chunk)
+      return 0;
+    char* chunkData;
+    Py_ssize_t chunkSize;
+    if(PyString_AsStringAndSize(chunk, &chunkData, &chunkSize) != 0 || (size_t)chunkSize > size) {
+      Py_DECREF(chunk);
+      return 0;
+    }
+    memcpy(data, chunkData, chunkSize);
+    Py_DECREF(chunk);
+    return chunkSize;
+  }
+};
+
+static bool parseLoadMode(const char* modeName, LoadMode& mode) {
+  if(!modeName || strcmp(modeName, "eager") == 0)
+    mode = LOAD_EAGER;
+  else if(strcmp(modeName, "parallel") == 0)
+    mode = LOAD_PARALLEL;
+  else if(strcmp(modeName, "lazy") == 0)
+    mode = LOAD_LAZY;
+  else {
+    PyErr_SetString(PyExc_ValueError, "load mode must be 'eager', 'parallel' or 'lazy'");
+    return false;
+  }
+  return true;
+}
+
 static PyObject* IRF_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
   IRF *self;
 
-  PyObject* firstArg = PyTuple_GetItem(args, 0);
+  PyObject* firstArg = PyTuple_Size(args) > 0 ? PyTuple_GET_ITEM(args, 0) : 0;
 
   bool fromFile = firstArg && PyString_Check(firstArg);
+  bool fromFileObject = firstArg && !fromFile && PyObject_HasAttrString(firstArg, "read");
 
   char* fname;
+  char* modeName = 0;
+  char* sampleFileName = 0; // features go straight into this file, if given, as they are read
+
+  if(fromFileObject) {
+    PyObject* file;
+    if(!PyArg_ParseTuple(args, "O|zs",
+                         &file,
+                         &modeName,
+                         &sampleFileName))
+      return 0;
+
+    LoadMode mode;
+    if(!parseLoadMode(modeName, mode))
+      return 0;
 
-  if(fromFile) {
-    if(!PyArg_ParseTuple(args, "s",
-                         &fname))
+    FileObjectSource source(file);
+    Forest* forest = sampleFileName ? load(source, mode, sampleFileName) : load(source, mode);
+    if(!forest) {
+      PyErr_Format(PyExc_IOError, "could not create sample file %s", sampleFileName);
+      return 0;
+    }
+    if(PyErr_Occurred()) {
+      destroy(forest);
+      return 0;
+    }
+
+    self = new (type->tp_alloc(type, 0)) IRF();
+    if(self)
+      self->forest = forest;
+    else
+      destroy(forest);
+  } else if(fromFile) {
+    if(!PyArg_ParseTuple(args, "s|zs",
+                         &fname,
+                         &modeName,
+                         &sampleFileName))
+      return 0;
+
+    LoadMode mode;
+    if(!parseLoadMode(modeName, mode))
       return 0;
 
     ifstream inF(fname);
@@ -57,18 +170,41 @@ static PyObject* IRF_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
       return 0;
     }
 
-    self = new (type->tp_alloc(type, 0)) IRF();
-    if(self) {
-      self->forest = load(inF);
+    Forest* forest = sampleFileName ? load(inF, mode, sampleFileName) : load(inF, mode);
+    if(!forest) {
+      PyErr_Format(PyExc_IOError, "could not create sample file %s", sampleFileName);
+      return 0;
     }
+    self = new (type->tp_alloc(type, 0)) IRF();
+    if(self)
+      self->forest = forest;
+    else
+      destroy(forest);
   } else {
+    static const char* kwlist[] = { "nTrees", "maxCodesToConsider", "maxCodesToKeep", "minEvidence", "minEntropyGain",
+                                    "maxDepth", "minSamplesLeaf", "maxUnsplit", "splitMargin", "splitPatience",
+                                    "windowSize", "windowAge", "maxCounts", 0 };
     int nTrees;
-    if(!PyArg_ParseTuple(args, "i", &nTrees))
+    ForestConfig config;
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "i|IIIfIIIfIIdk", (char**) kwlist,
+                                    &nTrees,
+                                    &config.maxCodesToConsider,
+                                    &config.maxCodesToKeep,
+                                    &config.minEvidence,
+                                    &config.minEntropyGain,
+                                    &config.maxDepth,
+                                    &config.minSamplesLeaf,
+                                    &config.maxUnsplit,
+                                    &config.splitMargin,
+                                    &config.splitPatience,
+                                    &config.windowSize,
+                                    &config.windowAge,
+                                    &config.maxCounts))
       return 0;
 
     self = new (type->tp_alloc(type, 0)) IRF();
     if(self) {
-      self->forest = create(nTrees);
+      self->forest = create(nTrees, config);
     }
   }
 
@@ -84,29 +220,103 @@ static PyMemberDef IRF_members[] = {
 };
 
 static PyObject* IRF_commit(IRF* self) {
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
   commit(self->forest);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
   return Py_BuildValue("");
 }
 
 static PyObject* IRF_validate(IRF* self) {
-  return PyBool_FromLong(validate(self->forest));
+  bool valid;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  valid = validate(self->forest);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return PyBool_FromLong(valid);
 }
 
 static PyObject* IRF_asJSON(IRF* self) {
   stringstream ss;
+  lockForest(self);
   asJSON(self->forest, ss);
+  unlockForest(self);
   ss.flush();
   return Py_BuildValue("s", ss.str().c_str());
 }
 
 static PyObject* IRF_statsJSON(IRF* self) {
   stringstream ss;
+  lockForest(self);
   statsJSON(self->forest, ss);
+  unlockForest(self);
+  ss.flush();
+  return Py_BuildValue("s", ss.str().c_str());
+}
+
+static PyObject* IRF_countersJSON(IRF* self) {
+  stringstream ss;
+  lockForest(self);
+  countersJSON(self->forest, ss);
+  unlockForest(self);
   ss.flush();
   return Py_BuildValue("s", ss.str().c_str());
 }
 
+static PyObject* IRF_config(IRF* self) {
+  lockForest(self);
+  ForestConfig config = getConfig(self->forest);
+  unlockForest(self);
+  return Py_BuildValue("{s:I,s:I,s:I,s:f,s:I,s:I,s:I,s:f,s:I,s:I,s:d,s:k}",
+                       "maxCodesToConsider", config.maxCodesToConsider,
+                       "maxCodesToKeep", config.maxCodesToKeep,
+                       "minEvidence", config.minEvidence,
+                       "minEntropyGain", config.minEntropyGain,
+                       "maxDepth", config.maxDepth,
+                       "minSamplesLeaf", config.minSamplesLeaf,
+                       "maxUnsplit", config.maxUnsplit,
+                       "splitMargin", config.splitMargin,
+                       "splitPatience", config.splitPatience,
+                       "windowSize", config.windowSize,
+                       "windowAge", config.windowAge,
+                       "maxCounts", config.maxCounts);
+}
+
 static PyObject* IRF_save(IRF* self, PyObject* args) {
+  PyObject* file;
+
+  if(!PyArg_ParseTuple(args, "O",
+                       &file)) {
+    return 0;
+  }
+
+  bool ok;
+
+  if(!PyString_Check(file)) {
+    FileObjectSink sink(file);
+    lockForest(self);
+    ok = save(self->forest, sink);
+    unlockForest(self);
+    if(PyErr_Occurred())
+      return 0;
+    return PyBool_FromLong(ok);
+  }
+
+  ofstream outS(PyString_AsString(file));
+  if(!outS.is_open())
+    return PyBool_FromLong(false);
+
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  ok = save(self->forest, outS);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return PyBool_FromLong(ok);
+}
+
+static PyObject* IRF_saveDelta(IRF* self, PyObject* args) {
   char* fname;
 
   if(!PyArg_ParseTuple(args, "s",
@@ -118,7 +328,129 @@ static PyObject* IRF_save(IRF* self, PyObject* args) {
   if(!outS.is_open())
     return PyBool_FromLong(false);
 
-  return PyBool_FromLong(save(self->forest, outS));
+  bool ok;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  ok = saveDelta(self->forest, outS);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return PyBool_FromLong(ok);
+}
+
+static PyObject* IRF_applyDelta(IRF* self, PyObject* args) {
+  char* fname;
+
+  if(!PyArg_ParseTuple(args, "s",
+                       &fname)) {
+    return 0;
+  }
+
+  ifstream inS(fname);
+  if(!inS.is_open())
+    return PyBool_FromLong(false);
+
+  bool ok;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  ok = applyDelta(self->forest, inS);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return PyBool_FromLong(ok);
+}
+
+static PyObject* IRF_setLog(IRF* self, PyObject* args) {
+  PyObject* fileName;
+
+  if(!PyArg_ParseTuple(args, "O",
+                       &fileName)) {
+    return 0;
+  }
+
+  char* fname = 0;
+  if(fileName != Py_None) {
+    fname = PyString_AsString(fileName);
+    if(!fname)
+      return 0;
+  }
+
+  lockForest(self);
+  setLog(self->forest, 0);
+  delete self->log;
+  self->log = 0;
+
+  bool ok = true;
+  if(fname) {
+    self->log = new ofstream(fname, ios::out | ios::app);
+    if(self->log->is_open()) {
+      setLog(self->forest, self->log);
+    } else {
+      delete self->log;
+      self->log = 0;
+      ok = false;
+    }
+  }
+  unlockForest(self);
+
+  return PyBool_FromLong(ok);
+}
+
+static PyObject* IRF_replayLog(IRF* self, PyObject* args) {
+  char* fname;
+
+  if(!PyArg_ParseTuple(args, "s",
+                       &fname)) {
+    return 0;
+  }
+
+  ifstream inS(fname);
+  if(!inS.is_open())
+    return PyBool_FromLong(false);
+
+  bool ok;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  ok = replayLog(self->forest, inS);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return PyBool_FromLong(ok);
+}
+
+static PyObject* IRF_setSampleFile(IRF* self, PyObject* args) {
+  char* fname;
+
+  if(!PyArg_ParseTuple(args, "s",
+                       &fname)) {
+    return 0;
+  }
+
+  bool ok;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  ok = setSampleFile(self->forest, fname);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return PyBool_FromLong(ok);
+}
+
+static PyObject* IRF_saveModel(IRF* self, PyObject* args) {
+  char* fname;
+
+  if(!PyArg_ParseTuple(args, "s",
+                       &fname)) {
+    return 0;
+  }
+
+  ofstream outS(fname, ios::out | ios::binary);
+  if(!outS.is_open())
+    return PyBool_FromLong(false);
+
+  bool ok;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  ok = saveModel(self->forest, outS);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return PyBool_FromLong(ok);
 }
 
 static PyObject* packFeatures(Sample* s) {
@@ -160,7 +492,13 @@ static PyObject* IRF_classify(IRF* self, PyObject* args) {
   Sample s;
   extractFeatures(features, &s);
 
-  return Py_BuildValue("f", classify(self->forest, &s));
+  float y;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  y = classify(self->forest, &s);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return Py_BuildValue("f", y);
 }
 
 static PyObject* IRF_classifyPartial(IRF* self, PyObject* args) {
@@ -174,7 +512,13 @@ static PyObject* IRF_classifyPartial(IRF* self, PyObject* args) {
   Sample s;
   extractFeatures(features, &s);
 
-  return Py_BuildValue("f", classifyPartial(self->forest, &s, nTrees));
+  float y;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  y = classifyPartial(self->forest, &s, nTrees);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return Py_BuildValue("f", y);
 }
 
 static PyObject* IRF_remove(IRF* self, PyObject* args) {
@@ -182,37 +526,487 @@ static PyObject* IRF_remove(IRF* self, PyObject* args) {
   if(!PyArg_ParseTuple(args, "s",
                        &sampleId))
     return 0;
-  return PyBool_FromLong(remove(self->forest, sampleId));
+  lockForest(self);
+  bool removed = remove(self->forest, sampleId);
+  unlockForest(self);
+  return PyBool_FromLong(removed);
+}
+
+static PyObject* IRF_relabel(IRF* self, PyObject* args) {
+  char* sampleId;
+  float target;
+  if(!PyArg_ParseTuple(args, "sf",
+                       &sampleId,
+                       &target))
+    return 0;
+  bool relabeled;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  relabeled = relabel(self->forest, sampleId, target);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return PyBool_FromLong(relabeled);
+}
+
+static PyObject* IRF_relabelUid(IRF* self, PyObject* args) {
+  unsigned long long uid;
+  float target;
+  if(!PyArg_ParseTuple(args, "Kf",
+                       &uid,
+                       &target))
+    return 0;
+  bool relabeled;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  relabeled = relabelUid(self->forest, uid, target);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return PyBool_FromLong(relabeled);
+}
+
+// codes to set from a dict, and codes to drop from any sequence
+static bool extractPatch(PyObject* addedObj, PyObject* removedObj, map<int, float>& added, vector<int>& removed) {
+  Sample s;
+  if(!extractFeatures(addedObj, &s))
+    return false;
+  added.swap(s.xCodes);
+  if(!removedObj)
+    return true;
+  PyObject* seq = PySequence_Fast(removedObj, "codes to remove must be a sequence");
+  if(!seq)
+    return false;
+  Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+  for(Py_ssize_t i = 0; i < n; ++i) {
+    long code = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+    if(code == -1 && PyErr_Occurred() != 0) {
+      Py_DECREF(seq);
+      return false;
+    }
+    removed.push_back(code);
+  }
+  Py_DECREF(seq);
+  return true;
+}
+
+static PyObject* IRF_patch(IRF* self, PyObject* args) {
+  char* sampleId;
+  PyObject* addedObj;
+  PyObject* removedObj = 0;
+  if(!PyArg_ParseTuple(args, "sO|O",
+                       &sampleId,
+                       &addedObj,
+                       &removedObj))
+    return 0;
+  map<int, float> added;
+  vector<int> removed;
+  if(!extractPatch(addedObj, removedObj, added, removed))
+    return 0;
+  bool patched;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  patched = patch(self->forest, sampleId, added, removed);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return PyBool_FromLong(patched);
+}
+
+static PyObject* IRF_patchUid(IRF* self, PyObject* args) {
+  unsigned long long uid;
+  PyObject* addedObj;
+  PyObject* removedObj = 0;
+  if(!PyArg_ParseTuple(args, "KO|O",
+                       &uid,
+                       &addedObj,
+                       &removedObj))
+    return 0;
+  map<int, float> added;
+  vector<int> removed;
+  if(!extractPatch(addedObj, removedObj, added, removed))
+    return 0;
+  bool patched;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  patched = patchUid(self->forest, uid, added, removed);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+  return PyBool_FromLong(patched);
+}
+
+static PyObject* IRF_removeUid(IRF* self, PyObject* args) {
+  unsigned long long uid;
+  if(!PyArg_ParseTuple(args, "K",
+                       &uid))
+    return 0;
+  lockForest(self);
+  bool removed = removeUid(self->forest, uid);
+  unlockForest(self);
+  return PyBool_FromLong(removed);
+}
+
+// given the sample with its id and label, which is deleted on failure
+static PyObject* addSample(IRF* self, Sample* s, PyObject* features, PyObject* timestamp) {
+  double t = 0;
+  if(timestamp) {
+    t = PyFloat_AsDouble(timestamp);
+    if(t == -1 && PyErr_Occurred()) {
+      delete s;
+      return 0;
+    }
+  }
+
+  if(!extractFeatures(features, s)) {
+    cerr << "failed to extract features!" << endl;
+    delete s;
+    return 0;
+  }
+
+  lockForest(self);
+  bool added = timestamp ? add(self->forest, s, t) : add(self->forest, s);
+  unlockForest(self);
+  return PyBool_FromLong(added);
 }
 
 static PyObject* IRF_add(IRF* self, PyObject* args) {
   char* sampleId;
   PyObject* features;
   float target;
+  PyObject* timestamp = 0;
 
-  if(!PyArg_ParseTuple(args, "sOf",
+  if(!PyArg_ParseTuple(args, "sOf|O",
                        &sampleId,
                        &features,
-                       &target)) {
+                       &target,
+                       &timestamp)) {
+    return 0;
+  }
+  // an empty suid would stand for a uid
+  if(!*sampleId) {
+    PyErr_SetString(PyExc_ValueError, "sample id must not be empty");
     return 0;
   }
-
   Sample* s = new Sample();
-
   s->suid = sampleId;
   s->y = target;
+  return addSample(self, s, features, timestamp);
+}
 
-  if(!extractFeatures(features, s)) {
-    cerr << "failed to extract features!" << endl;
-    delete s;
+static PyObject* IRF_addUid(IRF* self, PyObject* args) {
+  unsigned long long uid;
+  PyObject* features;
+  float target;
+  PyObject* timestamp = 0;
+
+  if(!PyArg_ParseTuple(args, "KOf|O",
+                       &uid,
+                       &features,
+                       &target,
+                       &timestamp)) {
     return 0;
   }
+  Sample* s = new Sample();
+  s->uid = uid;
+  s->y = target;
+  return addSample(self, s, features, timestamp);
+}
+
+// contiguous buffer (e.g. a NumPy array) of ints or floats, used in place when
+// the element type matches and converted otherwise
+template<typename T> class BufferArray {
+private:
+  Py_buffer view;
+  bool hasView;
+  vector<T> converted;
+  T* data;
+  Py_ssize_t n;
+
+  template<typename U> void convert(void) {
+    const U* from = (const U*) view.buf;
+    converted.assign(from, from + n);
+    data = converted.empty() ? 0 : &converted[0];
+  }
+public:
+  BufferArray(void) : hasView(false), data(0), n(0) {
+  }
+  ~BufferArray(void) {
+    if(hasView)
+      PyBuffer_Release(&view);
+  }
 
-  return PyBool_FromLong(add(self->forest, s));
+  // sets a Python exception and returns false when obj can't be used
+  bool get(PyObject* obj, const char* name, bool writable = false) {
+    int flags = PyBUF_FORMAT | PyBUF_C_CONTIGUOUS | (writable ? PyBUF_WRITABLE : 0);
+    if(PyObject_GetBuffer(obj, &view, flags) != 0)
+      return false;
+    hasView = true;
+
+    const char* format = view.format ? view.format : "B";
+    if(*format == '@' || *format == '=' || *format == '<')
+      ++format;
+    char type = format[1] == '\0' ? format[0] : '?';
+
+    n = view.len / view.itemsize;
+    bool wantFloat = (T) 0.5 != 0;
+    bool isFloat = type == 'f' || type == 'd';
+    bool isInt = (type == 'h' || type == 'i' || type == 'l' || type == 'q' || type == 'I' || type == 'L' || type == 'Q') &&
+      (view.itemsize == 2 || view.itemsize == 4 || view.itemsize == 8);
+    if(!(isInt || (isFloat && wantFloat)) || (writable && type != 'f')) {
+      PyErr_Format(PyExc_TypeError, "%s must be a contiguous buffer of %s", name,
+                   writable ? "float32" : (wantFloat ? "numbers" : "integers"));
+      return false;
+    }
+
+    if(wantFloat ? type == 'f' : view.itemsize == sizeof(T))
+      data = (T*) view.buf;
+    else if(type == 'f')
+      convert<float>();
+    else if(type == 'd')
+      convert<double>();
+    else if(view.itemsize == 2)
+      convert<int16_t>();
+    else if(view.itemsize == 4)
+      convert<int32_t>();
+    else
+      convert<int64_t>();
+    return true;
+  }
+
+  T* get(void) const {
+    return data;
+  }
+  int size(void) const {
+    return (int) n;
+  }
+};
+
+static bool checkOffsets(const int* offsets, int nOffsets, int nValues) {
+  if(nOffsets < 1 || offsets[0] != 0)
+    return false;
+  for(int i = 1; i < nOffsets; ++i) {
+    if(offsets[i] < offsets[i - 1])
+      return false;
+  }
+  return offsets[nOffsets - 1] <= nValues;
+}
+
+// CSR-style features: row i has indices[indptr[i]:indptr[i+1]] and the matching data
+static bool getBatchFeatures(PyObject* indptrObj, PyObject* indicesObj, PyObject* dataObj,
+                             BufferArray<int>& indptr, BufferArray<int>& indices, BufferArray<float>& data) {
+  if(!indptr.get(indptrObj, "indptr") || !indices.get(indicesObj, "indices") || !data.get(dataObj, "data"))
+    return false;
+  if(indices.size() != data.size()) {
+    PyErr_SetString(PyExc_ValueError, "indices and data must have the same length");
+    return false;
+  }
+  if(!checkOffsets(indptr.get(), indptr.size(), indices.size())) {
+    PyErr_SetString(PyExc_ValueError, "indptr must go from 0 to at most the number of indices, without decreasing");
+    return false;
+  }
+  return true;
+}
+
+static PyObject* IRF_addBatch(IRF* self, PyObject* args) {
+  PyObject* idsObj;
+  PyObject* indptrObj;
+  PyObject* indicesObj;
+  PyObject* dataObj;
+  PyObject* yObj;
+  if(!PyArg_ParseTuple(args, "OOOOO",
+                       &idsObj,
+                       &indptrObj,
+                       &indicesObj,
+                       &dataObj,
+                       &yObj))
+    return 0;
+
+  BufferArray<int> indptr;
+  BufferArray<int> indices;
+  BufferArray<float> data;
+  BufferArray<float> ys;
+  if(!getBatchFeatures(indptrObj, indicesObj, dataObj, indptr, indices, data) || !ys.get(yObj, "y"))
+    return 0;
+
+  int n = indptr.size() - 1;
+  if(ys.size() != n) {
+    PyErr_SetString(PyExc_ValueError, "y must have one element per sample");
+    return 0;
+  }
+
+  PyObject* seq = PySequence_Fast(idsObj, "ids must be a sequence");
+  if(!seq)
+    return 0;
+  if(PySequence_Fast_GET_SIZE(seq) != n) {
+    Py_DECREF(seq);
+    PyErr_SetString(PyExc_ValueError, "ids must have one element per sample");
+    return 0;
+  }
+
+  vector<string> ids(n);
+  for(int i = 0; i < n; ++i) {
+    PyObject* id = PyObject_Str(PySequence_Fast_GET_ITEM(seq, i));
+    if(!id) {
+      Py_DECREF(seq);
+      return 0;
+    }
+    ids[i] = PyString_AsString(id);
+    Py_DECREF(id);
+  }
+  Py_DECREF(seq);
+
+  vector<const char*> idPtrs(n);
+  for(int i = 0; i < n; ++i)
+    idPtrs[i] = ids[i].c_str();
+
+  int added;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  added = addBatch(self->forest, n, n ? &idPtrs[0] : 0, indptr.get(), indices.get(), data.get(), ys.get());
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+
+  return PyInt_FromLong(added);
+}
+
+// as addBatch, with uids in a buffer of 64 bit integers
+static PyObject* IRF_addBatchUids(IRF* self, PyObject* args) {
+  PyObject* uidsObj;
+  PyObject* indptrObj;
+  PyObject* indicesObj;
+  PyObject* dataObj;
+  PyObject* yObj;
+  if(!PyArg_ParseTuple(args, "OOOOO",
+                       &uidsObj,
+                       &indptrObj,
+                       &indicesObj,
+                       &dataObj,
+                       &yObj))
+    return 0;
+
+  BufferArray<uint64_t> uids;
+  BufferArray<int> indptr;
+  BufferArray<int> indices;
+  BufferArray<float> data;
+  BufferArray<float> ys;
+  if(!uids.get(uidsObj, "uids") || !getBatchFeatures(indptrObj, indicesObj, dataObj, indptr, indices, data) || !ys.get(yObj, "y"))
+    return 0;
+
+  int n = indptr.size() - 1;
+  if(ys.size() != n || uids.size() != n) {
+    PyErr_SetString(PyExc_ValueError, "uids and y must have one element per sample");
+    return 0;
+  }
+
+  int added;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  added = addBatch(self->forest, n, uids.get(), indptr.get(), indices.get(), data.get(), ys.get());
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+
+  return PyInt_FromLong(added);
+}
+
+// libsvm text, given the label of negative samples and an optional id prefix
+static PyObject* IRF_addFromFile(IRF* self, PyObject* args) {
+  char* fname;
+  float negativeLabel;
+  char* idPrefix = (char*) "";
+  if(!PyArg_ParseTuple(args, "sf|s",
+                       &fname,
+                       &negativeLabel,
+                       &idPrefix))
+    return 0;
+
+  int added;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  added = addFromFile(self->forest, fname, idPrefix, negativeLabel, 0);
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+
+  if(added < 0) {
+    PyErr_Format(PyExc_IOError, "could not read libsvm samples from %s", fname);
+    return 0;
+  }
+  return PyInt_FromLong(added);
+}
+
+static PyObject* IRF_classifyBatch(IRF* self, PyObject* args) {
+  PyObject* indptrObj;
+  PyObject* indicesObj;
+  PyObject* dataObj;
+  PyObject* outObj;
+  if(!PyArg_ParseTuple(args, "OOOO",
+                       &indptrObj,
+                       &indicesObj,
+                       &dataObj,
+                       &outObj))
+    return 0;
+
+  BufferArray<int> indptr;
+  BufferArray<int> indices;
+  BufferArray<float> data;
+  BufferArray<float> out;
+  if(!getBatchFeatures(indptrObj, indicesObj, dataObj, indptr, indices, data) || !out.get(outObj, "out", true))
+    return 0;
+
+  int n = indptr.size() - 1;
+  if(out.size() != n) {
+    PyErr_SetString(PyExc_ValueError, "out must have one element per sample");
+    return 0;
+  }
+
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  classifyBatch(self->forest, n, indptr.get(), indices.get(), data.get(), out.get());
+  Py_END_ALLOW_THREADS
+  unlockForest(self);
+
+  return Py_BuildValue("");
 }
 
 static PyObject* IRF_samples(IRF* self, PyObject* args);
 
+// (ids, uids, indptr, indices, data, y), all but ids as bytearrays of native uint64/int32/float32
+// filled in place, to be viewed with e.g. numpy.frombuffer(indptr, numpy.int32). ids are empty
+// for samples with a uid, and uids 0 for samples with an id
+static PyObject* IRF_exportSamples(IRF* self) {
+  int n;
+  int nCodes;
+  lockForest(self);
+  Py_BEGIN_ALLOW_THREADS
+  countSamples(self->forest, n, nCodes);
+  Py_END_ALLOW_THREADS
+
+  PyObject* ids = PyList_New(n);
+  PyObject* uids = PyByteArray_FromStringAndSize(0, n * sizeof(uint64_t));
+  PyObject* indptr = PyByteArray_FromStringAndSize(0, (n + 1) * sizeof(int));
+  PyObject* indices = PyByteArray_FromStringAndSize(0, nCodes * sizeof(int));
+  PyObject* data = PyByteArray_FromStringAndSize(0, nCodes * sizeof(float));
+  PyObject* y = PyByteArray_FromStringAndSize(0, n * sizeof(float));
+  if(!ids || !uids || !indptr || !indices || !data || !y) {
+    unlockForest(self);
+    Py_XDECREF(ids);
+    Py_XDECREF(uids);
+    Py_XDECREF(indptr);
+    Py_XDECREF(indices);
+    Py_XDECREF(data);
+    Py_XDECREF(y);
+    return 0;
+  }
+
+  vector<const char*> idPtrs(n);
+  Py_BEGIN_ALLOW_THREADS
+  exportSamples(self->forest, n ? &idPtrs[0] : 0, (uint64_t*) PyByteArray_AS_STRING(uids),
+                (int*) PyByteArray_AS_STRING(indptr), (int*) PyByteArray_AS_STRING(indices),
+                (float*) PyByteArray_AS_STRING(data), (float*) PyByteArray_AS_STRING(y));
+  Py_END_ALLOW_THREADS
+  for(int i = 0; i < n; ++i)
+    PyList_SET_ITEM(ids, i, PyString_FromString(idPtrs[i]));
+  unlockForest(self);
+
+  return Py_BuildValue("(NNNNNN)", ids, uids, indptr, indices, data, y);
+}
+
 static PyMethodDef IRF_methods[] = {
   {"commit", (PyCFunction)IRF_commit, METH_NOARGS,
    "Commit pending changes"
@@ -223,12 +1017,36 @@ static PyMethodDef IRF_methods[] = {
   {"statsJSON", (PyCFunction)IRF_statsJSON, METH_NOARGS,
    "Encode stats as JSON"
   },
+  {"countersJSON", (PyCFunction)IRF_countersJSON, METH_NOARGS,
+   "Encode counters of limits, resplits, evictions and expiry as JSON"
+  },
   {"save", (PyCFunction)IRF_save, METH_VARARGS,
-   "Save forest to file"
+   "Save forest to file, given its name or a file object"
+  },
+  {"saveDelta", (PyCFunction)IRF_saveDelta, METH_VARARGS,
+   "Save samples and trees changed since the last save to file"
+  },
+  {"applyDelta", (PyCFunction)IRF_applyDelta, METH_VARARGS,
+   "Apply changes saved with saveDelta"
+  },
+  {"setLog", (PyCFunction)IRF_setLog, METH_VARARGS,
+   "Append add/remove/commit operations to log file (None to stop)"
+  },
+  {"replayLog", (PyCFunction)IRF_replayLog, METH_VARARGS,
+   "Replay operations from log file"
+  },
+  {"setSampleFile", (PyCFunction)IRF_setSampleFile, METH_VARARGS,
+   "Keep the features of committed samples in a memory-mapped file rather than in RAM"
+  },
+  {"saveModel", (PyCFunction)IRF_saveModel, METH_VARARGS,
+   "Save classification-only model to file, to be loaded with loadModel"
   },
   {"validate", (PyCFunction)IRF_validate, METH_NOARGS,
    "Validate forest"
   },
+  {"config", (PyCFunction)IRF_config, METH_NOARGS,
+   "Get the configuration the forest was created with, as a dict"
+  },
   {"classify", (PyCFunction)IRF_classify, METH_VARARGS,
    "Classify according to features"
   },
@@ -236,14 +1054,47 @@ static PyMethodDef IRF_methods[] = {
    "Classify according to features, using only N trees"
   },
   {"add", (PyCFunction)IRF_add, METH_VARARGS,
-   "Add a sample"
+   "Add a sample, optionally with a timestamp for the sliding window"
   },
   {"remove", (PyCFunction)IRF_remove, METH_VARARGS,
    "Remove a sample"
   },
+  {"relabel", (PyCFunction)IRF_relabel, METH_VARARGS,
+   "Change the label of a sample, updating only its path in each tree"
+  },
+  {"relabelUid", (PyCFunction)IRF_relabelUid, METH_VARARGS,
+   "Change the label of a sample identified by a 64 bit integer"
+  },
+  {"patch", (PyCFunction)IRF_patch, METH_VARARGS,
+   "Set some features of a sample from a dict and drop others, moving it only where its path changes"
+  },
+  {"patchUid", (PyCFunction)IRF_patchUid, METH_VARARGS,
+   "Patch the features of a sample identified by a 64 bit integer"
+  },
+  {"addUid", (PyCFunction)IRF_addUid, METH_VARARGS,
+   "Add a sample identified by a 64 bit integer rather than a string, optionally with a timestamp"
+  },
+  {"removeUid", (PyCFunction)IRF_removeUid, METH_VARARGS,
+   "Remove a sample identified by a 64 bit integer"
+  },
+  {"addBatch", (PyCFunction)IRF_addBatch, METH_VARARGS,
+   "Add samples given ids, CSR features (indptr, indices, data) and labels as buffers"
+  },
+  {"addBatchUids", (PyCFunction)IRF_addBatchUids, METH_VARARGS,
+   "Add samples given 64 bit integer ids, CSR features (indptr, indices, data) and labels as buffers"
+  },
+  {"addFromFile", (PyCFunction)IRF_addFromFile, METH_VARARGS,
+   "Add samples from libsvm file, given the label of negative samples and an optional id prefix"
+  },
+  {"classifyBatch", (PyCFunction)IRF_classifyBatch, METH_VARARGS,
+   "Classify CSR features (indptr, indices, data) into a float32 buffer"
+  },
   {"samples", (PyCFunction)IRF_samples, METH_NOARGS,
    "Get stored samples"
   },
+  {"exportSamples", (PyCFunction)IRF_exportSamples, METH_NOARGS,
+   "Get all samples as (ids, uids, indptr, indices, data, y), in CSR layout"
+  },
   {NULL}  /* Sentinel */
 };
 
@@ -289,25 +1140,146 @@ static PyTypeObject IRFType = {
   IRF_new,                 /* tp_new */
 };
 
-struct SampleIter {
+struct IRFModel {
   PyObject_HEAD
-  SampleWalker* walker;
+  Model* model;
 
-  void setRange(SampleWalker* w) {
-    delete walker;
-    walker = w;
+  IRFModel(void) {
+    model = 0;
+  }
+  ~IRFModel(void) {
+    if(model)
+      destroy(model);
   }
+};
+
+static void IRFModel_dealloc(IRFModel* self) {
+  self->~IRFModel();
+  self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject* IRFModel_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+  IRFModel *self;
 
-  SampleIter(SampleWalker* w) {
-    walker = w;
+  char* fname;
+  if(!PyArg_ParseTuple(args, "s",
+                       &fname))
+    return 0;
+
+  Model* m = loadModel(fname);
+  if(!m) {
+    PyErr_SetString(PyExc_IOError, "could not map model file");
+    return 0;
+  }
+
+  self = new (type->tp_alloc(type, 0)) IRFModel();
+  if(self)
+    self->model = m;
+  else
+    destroy(m);
+
+  return (PyObject *)self;
+}
+
+static PyObject* IRFModel_classify(IRFModel* self, PyObject* args) {
+  PyObject* features;
+  if(!PyArg_ParseTuple(args, "O",
+                       &features
+                       ))
+    return 0;
+
+  Sample s;
+  extractFeatures(features, &s);
+
+  return Py_BuildValue("f", classify(self->model, &s));
+}
+
+static PyObject* IRFModel_classifyPartial(IRFModel* self, PyObject* args) {
+  PyObject* features;
+  int nTrees;
+  if(!PyArg_ParseTuple(args, "Oi",
+                       &features,
+                       &nTrees))
+    return 0;
+
+  Sample s;
+  extractFeatures(features, &s);
+
+  return Py_BuildValue("f", classifyPartial(self->model, &s, nTrees));
+}
+
+static PyMethodDef IRFModel_methods[] = {
+  {"classify", (PyCFunction)IRFModel_classify, METH_VARARGS,
+   "Classify according to features"
+  },
+  {"classifyPartial", (PyCFunction)IRFModel_classifyPartial, METH_VARARGS,
+   "Classify according to features, using only N trees"
+  },
+  {NULL}  /* Sentinel */
+};
+
+static PyTypeObject IRFModelType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                         /*ob_size*/
+  "irf.Model",             /*tp_name*/
+  sizeof(IRFModel), /*tp_basicsize*/
+  0,                         /*tp_itemsize*/
+  (destructor)IRFModel_dealloc,   /*tp_dealloc*/
+  0,                         /*tp_print*/
+  0,                         /*tp_getattr*/
+  0,                         /*tp_setattr*/
+  0,                         /*tp_compare*/
+  0,                         /*tp_repr*/
+  0,                         /*tp_as_number*/
+  0,                         /*tp_as_sequence*/
+  0,                         /*tp_as_mapping*/
+  0,                         /*tp_hash */
+  0,                         /*tp_call*/
+  0,                         /*tp_str*/
+  0,                         /*tp_getattro*/
+  0,                         /*tp_setattro*/
+  0,                         /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+  "Memory-mapped classification-only IRF models",           /* tp_doc */
+  0,                   /* tp_traverse */
+  0,                   /* tp_clear */
+  0,                   /* tp_richcompare */
+  0,                   /* tp_weaklistoffset */
+  0,                   /* tp_iter */
+  0,                   /* tp_iternext */
+  IRFModel_methods,             /* tp_methods */
+  0,             /* tp_members */
+  0,                         /* tp_getset */
+  0,                         /* tp_base */
+  0,                         /* tp_dict */
+  0,                         /* tp_descr_get */
+  0,                         /* tp_descr_set */
+  0,                         /* tp_dictoffset */
+  0,      /* tp_init */
+  0,                         /* tp_alloc */
+  IRFModel_new,                 /* tp_new */
+};
+
+// rows built under the forest's lock when the iterator is made, as other threads can change the
+// forest between calls to next while the GIL is released
+struct SampleIter {
+  PyObject_HEAD
+  PyObject* rows; // list of (id, features, y)
+  Py_ssize_t next;
+
+  void setRows(PyObject* withRows) {
+    Py_XDECREF(rows);
+    rows = withRows;
+    next = 0;
   }
 
   SampleIter(void) {
-    walker = 0;
+    rows = 0;
+    next = 0;
   }
 
   ~SampleIter(void) {
-    delete walker;
+    Py_XDECREF(rows);
   }
 };
 
@@ -336,9 +1308,11 @@ PyObject* SampleIter_iter(PyObject *self) {
 
 PyObject* SampleIter_iternext(PyObject *self) {
   SampleIter *p = (SampleIter*)self;
-  if(p->walker->stillSome()) {
-    Sample* s = p->walker->get();
-    return Py_BuildValue("(sNf)", s->suid.c_str(), packFeatures(s), s->y);
+  if(p->rows && p->next < PyList_GET_SIZE(p->rows)) {
+    PyObject* row = PyList_GET_ITEM(p->rows, p->next);
+    ++p->next;
+    Py_INCREF(row);
+    return row;
   } else {
     /* Raising of standard StopIteration exception with empty value. */
     PyErr_SetNone(PyExc_StopIteration);
@@ -393,9 +1367,13 @@ static PyTypeObject SampleIterType = {
 static PyObject* IRF_load(PyObject* self, PyObject* args) {
   IRF* p;
 
-  char* fname;
-  if(!PyArg_ParseTuple(args, "s",
-                       &fname))
+  PyObject* file;
+  char* modeName = 0;
+  char* sampleFileName = 0;
+  if(!PyArg_ParseTuple(args, "O|zs",
+                       &file,
+                       &modeName,
+                       &sampleFileName))
     return 0;
 
   p = (IRF*) PyObject_CallObject((PyObject*) &IRFType, args);
@@ -405,9 +1383,61 @@ static PyObject* IRF_load(PyObject* self, PyObject* args) {
   return (PyObject*) p;
 }
 
+static PyObject* IRF_compact(PyObject* self, PyObject* args) {
+  char* baseName;
+  PyObject* deltaNames;
+  char* outName;
+  if(!PyArg_ParseTuple(args, "sOs",
+                       &baseName,
+                       &deltaNames,
+                       &outName))
+    return 0;
+
+  PyObject* seq = PySequence_Fast(deltaNames, "argument 2 must be a sequence of file names");
+  if(!seq)
+    return 0;
+
+  ifstream baseS(baseName);
+  bool ok = baseS.is_open();
+  vector<ifstream*> deltaFiles;
+  for(Py_ssize_t i = 0; ok && i < PySequence_Fast_GET_SIZE(seq); ++i) {
+    char* deltaName = PyString_AsString(PySequence_Fast_GET_ITEM(seq, i));
+    if(!deltaName) {
+      ok = false;
+      break;
+    }
+    deltaFiles.push_back(new ifstream(deltaName));
+    ok = deltaFiles.back()->is_open();
+  }
+  Py_DECREF(seq);
+
+  if(ok) {
+    vector<istream*> deltas(deltaFiles.begin(), deltaFiles.end());
+    ofstream outS(outName);
+    ok = outS.is_open() && compact(baseS, deltas, outS);
+  }
+
+  for(vector<ifstream*>::iterator it = deltaFiles.begin(); it != deltaFiles.end(); ++it)
+    delete *it;
+
+  if(PyErr_Occurred())
+    return 0;
+  return PyBool_FromLong(ok);
+}
+
+static PyObject* IRF_loadModel(PyObject* self, PyObject* args) {
+  return PyObject_CallObject((PyObject*) &IRFModelType, args);
+}
+
 static PyMethodDef module_methods[] = {
   {"load", (PyCFunction)IRF_load, METH_VARARGS,
-   "load random forest from file"
+   "load random forest from file name or file object, optionally with mode 'parallel' or 'lazy' (None for eager) and a sample file to write features into as they are read"
+  },
+  {"compact", (PyCFunction)IRF_compact, METH_VARARGS,
+   "merge saved forest and deltas into a new saved forest"
+  },
+  {"loadModel", (PyCFunction)IRF_loadModel, METH_VARARGS,
+   "map classification-only model from file"
   },
   {NULL}  /* Sentinel */
 };
@@ -427,7 +1457,32 @@ static PyObject* IRF_samples(IRF* self, PyObject* args) {
     return NULL;
   }
 
-  p->setRange(getSamples(self->forest));
+  PyObject* rows = PyList_New(0);
+  if(!rows) {
+    Py_DECREF(p);
+    return NULL;
+  }
+  lockForest(self);
+  SampleWalker* walker = getSamples(self->forest);
+  bool ok = true;
+  while(ok && walker->stillSome()) {
+    Sample* s = walker->get();
+    PyObject* row;
+    if(s->suid.empty())
+      row = Py_BuildValue("(KNf)", (unsigned long long) s->uid, packFeatures(s), s->y);
+    else
+      row = Py_BuildValue("(sNf)", s->suid.c_str(), packFeatures(s), s->y);
+    ok = row && PyList_Append(rows, row) == 0;
+    Py_XDECREF(row);
+  }
+  delete walker;
+  unlockForest(self);
+  if(!ok) {
+    Py_DECREF(rows);
+    Py_DECREF(p);
+    return NULL;
+  }
+  p->setRows(rows);
 
   return (PyObject *)p;
 }
@@ -442,6 +1497,8 @@ PyMODINIT_FUNC initirf(void) {
     return;
   if (PyType_Ready(&SampleIterType) < 0)
     return;
+  if (PyType_Ready(&IRFModelType) < 0)
+    return;
 
   m = Py_InitModule3("irf", module_methods,
                      "Incremental Random Forest.");
@@ -449,4 +1506,6 @@ PyMODINIT_FUNC initirf(void) {
   Py_INCREF(&IRFType);
   PyModule_AddObject(m, "IRF", (PyObject *)&IRFType);
   PyModule_AddObject(m, "SampleIter", (PyObject *)&SampleIterType);
+  Py_INCREF(&IRFModelType);
+  PyModule_AddObject(m, "Model", (PyObject *)&IRFModelType);
 }
@@ -2,8 +2,14 @@
  * Author Carlos Guerreiro cguerreiro@igalia.com
  * Licensed under the MIT license */
 
+#include <cmath>
+#include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <sstream>
+#include <fstream>
+#include <vector>
+#include <string>
 
 #include <v8.h>
 #include <node.h>
@@ -16,10 +22,202 @@ using namespace node;
 using namespace std;
 using namespace IncrementalRandomForest;
 
+// reads straight out of a Buffer's memory, which is not NUL terminated
+class MemorySource : public Source {
+private:
+  const char* data;
+  size_t size;
+public:
+  MemorySource(const char* withData, size_t withSize) : data(withData), size(withSize) {
+  }
+  virtual size_t read(char* out, size_t n) {
+    if(n > size)
+      n = size;
+    memcpy(out, data, n);
+    data += n;
+    size -= n;
+    return n;
+  }
+};
+
+// pulls Buffers from a JS function until it returns something else
+class FunctionSource : public Source {
+private:
+  Local<Function> f;
+  string pending;
+  size_t pendingOffset;
+public:
+  FunctionSource(Local<Function> withF) : f(withF), pendingOffset(0) {
+  }
+  virtual size_t read(char* out, size_t n) {
+    if(pendingOffset == pending.size()) {
+      HandleScope scope;
+      Local<Value> chunk = f->Call(Context::GetCurrent()->Global(), 0, 0);
+      if(chunk.IsEmpty() || !Buffer::HasInstance(chunk))
+        return 0;
+      Local<Object> o = chunk->ToObject();
+      pending.assign(Buffer::Data(o), Buffer::Length(o));
+      pendingOffset = 0;
+    }
+    if(n > pending.size() - pendingOffset)
+      n = pending.size() - pendingOffset;
+    memcpy(out, pending.data() + pendingOffset, n);
+    pendingOffset += n;
+    return n;
+  }
+};
+
+// hands each chunk to a JS function as a Buffer
+class FunctionSink : public Sink {
+private:
+  Local<Function> f;
+public:
+  FunctionSink(Local<Function> withF) : f(withF) {
+  }
+  virtual bool write(const char* data, size_t size) {
+    HandleScope scope;
+    Buffer* chunk = Buffer::New(const_cast<char*>(data), size);
+    Local<Value> argv[1] = { Local<Value>::New(chunk->handle_) };
+    TryCatch tc;
+    Local<Value> ret = f->Call(Context::GetCurrent()->Global(), 1, argv);
+    return !ret.IsEmpty() && !ret->IsFalse();
+  }
+};
+
+// copies each chunk into a single growing block as it arrives, which the Buffer then takes over
+class BlockSink : public Sink {
+private:
+  char* data;
+  size_t size;
+  size_t capacity;
+
+  static void freeBlock(char* block, void*) {
+    free(block);
+  }
+public:
+  BlockSink(void) : data(0), size(0), capacity(0) {
+  }
+  ~BlockSink(void) {
+    free(data);
+  }
+  virtual bool write(const char* chunk, size_t n) {
+    if(size + n > capacity) {
+      size_t grownCapacity = capacity ? capacity : 64 * 1024;
+      while(grownCapacity < size + n)
+        grownCapacity *= 2;
+      char* grown = static_cast<char*>(realloc(data, grownCapacity));
+      if(!grown)
+        return false;
+      data = grown;
+      capacity = grownCapacity;
+    }
+    memcpy(data + size, chunk, n);
+    size += n;
+    return true;
+  }
+  Buffer* toBuffer(void) {
+    if(!data)
+      return Buffer::New(0);
+    // shrinking is done in place
+    char* trimmed = static_cast<char*>(realloc(data, size ? size : 1));
+    if(trimmed)
+      data = trimmed;
+    Buffer* out = Buffer::New(data, size, freeBlock, 0);
+    data = 0;
+    size = capacity = 0;
+    return out;
+  }
+};
+
+// typed arrays, used in place
+template <class T>
+static bool getTypedArray(Local<Value> v, ExternalArrayType type, T*& data, int& length) {
+  if(!v->IsObject())
+    return false;
+  Local<Object> o = v->ToObject();
+  if(!o->HasIndexedPropertiesInExternalArrayData() || o->GetIndexedPropertiesExternalArrayDataType() != type)
+    return false;
+  data = static_cast<T*>(o->GetIndexedPropertiesExternalArrayData());
+  length = o->GetIndexedPropertiesExternalArrayDataLength();
+  return true;
+}
+
+static Local<Object> newTypedArray(const char* constructorName, int length) {
+  Local<Function> constructor = Local<Function>::Cast(Context::GetCurrent()->Global()->Get(String::New(constructorName)));
+  Local<Value> argv[1] = { Local<Value>::New(Integer::New(length)) };
+  return constructor->NewInstance(1, argv);
+}
+
+// offsets must start at 0 and never go back or beyond the codes and values
+static bool checkOffsets(const int* offsets, int nOffsets, int nValues) {
+  if(nOffsets < 1 || offsets[0] != 0)
+    return false;
+  for(int i = 1; i < nOffsets; ++i) {
+    if(offsets[i] < offsets[i - 1])
+      return false;
+  }
+  return offsets[nOffsets - 1] <= nValues;
+}
+
+class IRF;
+
+// work done on the libuv thread pool, while the forest is not otherwise accessible
+struct AsyncOp {
+  uv_work_t request;
+  IRF* ih;
+  Persistent<Function> callback;
+
+  virtual ~AsyncOp(void) {
+    callback.Dispose();
+  }
+  virtual void run(Forest* f) = 0;
+  virtual Handle<Value> result(void) = 0;
+};
+
+struct CommitOp : public AsyncOp {
+  virtual void run(Forest* f) {
+    commit(f);
+  }
+  virtual Handle<Value> result(void) {
+    return Undefined();
+  }
+};
+
+struct ClassifyBatchOp : public AsyncOp {
+  vector<Sample> samples;
+  vector<float> results;
+
+  virtual void run(Forest* f) {
+    results.resize(samples.size());
+    for(size_t i = 0; i < samples.size(); ++i)
+      results[i] = classify(f, &samples[i]);
+  }
+  virtual Handle<Value> result(void) {
+    Local<Array> a = Array::New(results.size());
+    for(size_t i = 0; i < results.size(); ++i)
+      a->Set(i, Number::New(results[i]));
+    return a;
+  }
+};
+
+struct ToBufferOp : public AsyncOp {
+  BlockSink sink;
+
+  virtual void run(Forest* f) {
+    save(f, sink);
+  }
+  virtual Handle<Value> result(void) {
+    return sink.toBuffer()->handle_;
+  }
+};
+
 class IRF: ObjectWrap {
 private:
   Forest* f;
+  ofstream* log;
+  bool busy;
 
+public:
   static void setFeatures(Sample* s, Local<Object>& features) {
     Local<Array> featureNames = features->GetOwnPropertyNames();
     int featureCount = featureNames->Length();
@@ -33,6 +231,7 @@ private:
     }
   }
 
+private:
   static void getFeatures(Sample* s, Local<Object>& features) {
     map<int, float>::const_iterator it;
     char key[16];
@@ -43,15 +242,42 @@ private:
   }
 
 public:
-  IRF(uint32_t count) : ObjectWrap() {
-    f = create(count);
+  IRF(uint32_t count, const ForestConfig& config) : ObjectWrap(), log(0), busy(false) {
+    f = create(count, config);
   }
 
-  IRF(Forest* withF) : ObjectWrap(), f(withF) {
+  IRF(Forest* withF) : ObjectWrap(), f(withF), log(0), busy(false) {
   }
 
   ~IRF() {
     destroy(f);
+    delete log;
+  }
+
+  // the forest, or 0 with an exception thrown while an asynchronous operation owns it, or while
+  // each or saveTo are calling back into JS in the middle of walking it
+  static IRF* unwrapIdle(const Arguments& args) {
+    IRF* ih = ObjectWrap::Unwrap<IRF>(args.This());
+    if(ih->busy) {
+      ThrowException(Exception::Error(String::New("busy with another operation")));
+      return 0;
+    }
+    return ih;
+  }
+
+  static bool getLoadMode(Local<Value> v, LoadMode& mode) {
+    String::AsciiValue modeName(v->ToString());
+    if(!*modeName)
+      return false;
+    if(strcmp(*modeName, "eager") == 0)
+      mode = LOAD_EAGER;
+    else if(strcmp(*modeName, "parallel") == 0)
+      mode = LOAD_PARALLEL;
+    else if(strcmp(*modeName, "lazy") == 0)
+      mode = LOAD_LAZY;
+    else
+      return false;
+    return true;
   }
 
   static void init(Handle < Object > target, Handle<Value> (*func)(const Arguments&), Persistent<FunctionTemplate>& ct, const char* name) {
@@ -62,13 +288,36 @@ public:
     ct->SetClassName(nameSymbol);
     NODE_SET_PROTOTYPE_METHOD(ct, "add", add);
     NODE_SET_PROTOTYPE_METHOD(ct, "remove", remove);
+    NODE_SET_PROTOTYPE_METHOD(ct, "addUid", addUid);
+    NODE_SET_PROTOTYPE_METHOD(ct, "removeUid", removeUid);
+    NODE_SET_PROTOTYPE_METHOD(ct, "relabel", relabel);
+    NODE_SET_PROTOTYPE_METHOD(ct, "relabelUid", relabelUid);
+    NODE_SET_PROTOTYPE_METHOD(ct, "patch", patch);
+    NODE_SET_PROTOTYPE_METHOD(ct, "patchUid", patchUid);
     NODE_SET_PROTOTYPE_METHOD(ct, "classify", classify);
     NODE_SET_PROTOTYPE_METHOD(ct, "classifyPartial", classifyPartial);
+    NODE_SET_PROTOTYPE_METHOD(ct, "addBatch", addBatch);
+    NODE_SET_PROTOTYPE_METHOD(ct, "classifyBatch", classifyBatch);
+    NODE_SET_PROTOTYPE_METHOD(ct, "addFromFile", addFromFile);
+    NODE_SET_PROTOTYPE_METHOD(ct, "addFromBuffer", addFromBuffer);
     NODE_SET_PROTOTYPE_METHOD(ct, "asJSON", asJSON);
     NODE_SET_PROTOTYPE_METHOD(ct, "statsJSON", statsJSON);
+    NODE_SET_PROTOTYPE_METHOD(ct, "countersJSON", countersJSON);
+    NODE_SET_PROTOTYPE_METHOD(ct, "config", config);
     NODE_SET_PROTOTYPE_METHOD(ct, "each", each);
+    NODE_SET_PROTOTYPE_METHOD(ct, "exportSamples", exportSamples);
     NODE_SET_PROTOTYPE_METHOD(ct, "commit", commit);
+    NODE_SET_PROTOTYPE_METHOD(ct, "commitAsync", commitAsync);
+    NODE_SET_PROTOTYPE_METHOD(ct, "classifyBatchAsync", classifyBatchAsync);
+    NODE_SET_PROTOTYPE_METHOD(ct, "toBufferAsync", toBufferAsync);
     NODE_SET_PROTOTYPE_METHOD(ct, "toBuffer", toBuffer);
+    NODE_SET_PROTOTYPE_METHOD(ct, "saveTo", saveTo);
+    NODE_SET_PROTOTYPE_METHOD(ct, "saveModel", saveModel);
+    NODE_SET_PROTOTYPE_METHOD(ct, "toDeltaBuffer", toDeltaBuffer);
+    NODE_SET_PROTOTYPE_METHOD(ct, "applyDelta", applyDelta);
+    NODE_SET_PROTOTYPE_METHOD(ct, "setLog", setLog);
+    NODE_SET_PROTOTYPE_METHOD(ct, "replayLog", replayLog);
+    NODE_SET_PROTOTYPE_METHOD(ct, "setSampleFile", setSampleFile);
     target->Set(nameSymbol, ct->GetFunction());
   }
 
@@ -82,15 +331,54 @@ public:
 
     Local<Object> o = args[0]->ToObject();
 
-    cerr << Buffer::Length(o) << endl;
+    MemorySource source(Buffer::Data(o), Buffer::Length(o));
 
-    stringstream ss(Buffer::Data(o));
-
-    IRF* ih = new IRF(load(ss));
+    IRF* ih = new IRF(load(source, LOAD_EAGER));
     ih->Wrap(args.This());
     return args.This();
   }
 
+  // missing properties keep their defaults
+  static void getConfig(Local<Object> o, ForestConfig& config) {
+    Local<Value> v;
+    v = o->Get(String::NewSymbol("maxCodesToConsider"));
+    if(v->IsNumber())
+      config.maxCodesToConsider = v->Uint32Value();
+    v = o->Get(String::NewSymbol("maxCodesToKeep"));
+    if(v->IsNumber())
+      config.maxCodesToKeep = v->Uint32Value();
+    v = o->Get(String::NewSymbol("minEvidence"));
+    if(v->IsNumber())
+      config.minEvidence = v->Uint32Value();
+    v = o->Get(String::NewSymbol("minEntropyGain"));
+    if(v->IsNumber())
+      config.minEntropyGain = v->NumberValue();
+    v = o->Get(String::NewSymbol("maxDepth"));
+    if(v->IsNumber())
+      config.maxDepth = v->Uint32Value();
+    v = o->Get(String::NewSymbol("minSamplesLeaf"));
+    if(v->IsNumber())
+      config.minSamplesLeaf = v->Uint32Value();
+    v = o->Get(String::NewSymbol("maxUnsplit"));
+    if(v->IsNumber())
+      config.maxUnsplit = v->Uint32Value();
+    v = o->Get(String::NewSymbol("splitMargin"));
+    if(v->IsNumber())
+      config.splitMargin = v->NumberValue();
+    v = o->Get(String::NewSymbol("splitPatience"));
+    if(v->IsNumber())
+      config.splitPatience = v->Uint32Value();
+    v = o->Get(String::NewSymbol("windowSize"));
+    if(v->IsNumber())
+      config.windowSize = v->Uint32Value();
+    v = o->Get(String::NewSymbol("windowAge"));
+    if(v->IsNumber())
+      config.windowAge = v->NumberValue();
+    v = o->Get(String::NewSymbol("maxCounts"));
+    if(v->IsNumber())
+      config.maxCounts = (unsigned long) v->NumberValue();
+  }
+
   static Handle<Value> New(const Arguments& args) {
     HandleScope scope;
 
@@ -102,31 +390,80 @@ public:
     if(args.Length() >= 1) {
       if(args[0]->IsNumber()) {
         uint32_t count = args[0]->ToInteger()->Value();
-        ih = new IRF(count);
-      } else if(Buffer::HasInstance(args[0])) {
-        Local<Object> o = args[0]->ToObject();
-        stringstream ss(Buffer::Data(o));
-        ih = new IRF(load(ss));
+        ForestConfig config;
+        if(args.Length() >= 2) {
+          if(!args[1]->IsObject())
+            return ThrowException(Exception::Error(String::New("argument 2 must be an object (configuration)")));
+          getConfig(args[1]->ToObject(), config);
+        }
+        ih = new IRF(count, config);
+      } else if(Buffer::HasInstance(args[0]) || args[0]->IsFunction()) {
+        LoadMode mode = LOAD_EAGER;
+        if(args.Length() >= 2 && !args[1]->IsUndefined() && !getLoadMode(args[1], mode))
+          return ThrowException(Exception::Error(String::New("argument 2 must be 'eager', 'parallel' or 'lazy'")));
+        // features go straight into the sample file, if given, as they are read
+        if(args.Length() >= 3 && !args[2]->IsString())
+          return ThrowException(Exception::Error(String::New("argument 3 must be a string (sample file name)")));
+        String::Utf8Value sampleFileName(args.Length() >= 3 ? args[2] : Local<Value>::New(Undefined()));
+        Forest* f;
+        if(Buffer::HasInstance(args[0])) {
+          Local<Object> o = args[0]->ToObject();
+          MemorySource source(Buffer::Data(o), Buffer::Length(o));
+          f = args.Length() >= 3 ? load(source, mode, *sampleFileName) : load(source, mode);
+        } else {
+          FunctionSource source(Local<Function>::Cast(args[0]));
+          f = args.Length() >= 3 ? load(source, mode, *sampleFileName) : load(source, mode);
+        }
+        if(!f)
+          return ThrowException(Exception::Error(String::New("could not create sample file")));
+        ih = new IRF(f);
       } else {
-        return ThrowException(Exception::Error(String::New("argument 1 must be a number (number of trees) or a Buffer (to create from)")));
+        return ThrowException(Exception::Error(String::New("argument 1 must be a number (number of trees), a Buffer or a function returning Buffers (to create from)")));
       }
     } else
-      ih = new IRF(1);
+      ih = new IRF(1, ForestConfig());
 
     ih->Wrap(args.This());
     return args.This();
   }
 
+  // uids as numbers, so only up to 2^53
+  static bool getUid(Handle<Value> v, uint64_t& uid) {
+    if(!v->IsNumber())
+      return false;
+    double d = v->NumberValue();
+    if(!(d >= 0 && d <= 9007199254740992.0) || d != floor(d))
+      return false;
+    uid = (uint64_t) d;
+    return true;
+  }
+
   static Handle<Value> add(const Arguments& args) {
+    return addSample(args, false);
+  }
+
+  static Handle<Value> addUid(const Arguments& args) {
+    return addSample(args, true);
+  }
+
+  static Handle<Value> addSample(const Arguments& args, bool withUid) {
     HandleScope scope;
 
-    if(args.Length() != 3) {
-      return ThrowException(Exception::Error(String::New("add takes 3 arguments")));
+    if(args.Length() != 3 && args.Length() != 4) {
+      return ThrowException(Exception::Error(String::New(withUid ? "addUid takes 3 or 4 arguments" : "add takes 3 or 4 arguments")));
     }
 
-    Local<String> suid = *args[0]->ToString();
-    if(suid.IsEmpty())
-      return ThrowException(Exception::Error(String::New("argument 1 must be a string")));
+    uint64_t uid = 0;
+    Local<String> suid;
+    if(withUid) {
+      if(!getUid(args[0], uid))
+        return ThrowException(Exception::Error(String::New("argument 1 must be a non-negative integer")));
+    } else {
+      suid = *args[0]->ToString();
+      // an empty suid would stand for a uid
+      if(suid.IsEmpty() || suid->Length() == 0)
+        return ThrowException(Exception::Error(String::New("argument 1 must be a non-empty string")));
+    }
 
     if(!args[1]->IsObject())
       return ThrowException(Exception::Error(String::New("argument 2 must be a object")));
@@ -136,12 +473,22 @@ public:
       return ThrowException(Exception::Error(String::New("argument 3 must be a number")));
     Local<Number> y = *args[2]->ToNumber();
 
-    IRF* ih = ObjectWrap::Unwrap<IRF>(args.This());
+    if(args.Length() == 4 && !args[3]->IsNumber())
+      return ThrowException(Exception::Error(String::New("argument 4 must be a number (timestamp)")));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
     Sample* s = new Sample();
-    s->suid = *String::AsciiValue(suid);
+    if(withUid)
+      s->uid = uid;
+    else
+      s->suid = *String::AsciiValue(suid);
     s->y = y->Value();
     setFeatures(s, features);
 
+    if(args.Length() == 4)
+      return scope.Close(Boolean::New(IncrementalRandomForest::add(ih->f, s, args[3]->NumberValue())));
     return scope.Close(Boolean::New(IncrementalRandomForest::add(ih->f, s)));
   }
 
@@ -156,11 +503,124 @@ public:
     if(suid.IsEmpty())
       return ThrowException(Exception::Error(String::New("argument 1 must be a string")));
 
-    IRF* ih = ObjectWrap::Unwrap<IRF>(args.This());
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
 
     return scope.Close(Boolean::New(IncrementalRandomForest::remove(ih->f, *String::AsciiValue(suid))));
   }
 
+  static Handle<Value> removeUid(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 1) {
+      return ThrowException(Exception::Error(String::New("removeUid takes 1 argument")));
+    }
+
+    uint64_t uid;
+    if(!getUid(args[0], uid))
+      return ThrowException(Exception::Error(String::New("argument 1 must be a non-negative integer")));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    return scope.Close(Boolean::New(IncrementalRandomForest::removeUid(ih->f, uid)));
+  }
+
+  static Handle<Value> relabel(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 2) {
+      return ThrowException(Exception::Error(String::New("relabel takes 2 arguments")));
+    }
+
+    Local<String> suid = *args[0]->ToString();
+    if(suid.IsEmpty())
+      return ThrowException(Exception::Error(String::New("argument 1 must be a string")));
+
+    if(!args[1]->IsNumber())
+      return ThrowException(Exception::Error(String::New("argument 2 must be a number")));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    return scope.Close(Boolean::New(IncrementalRandomForest::relabel(ih->f, *String::AsciiValue(suid), args[1]->NumberValue())));
+  }
+
+  static Handle<Value> relabelUid(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 2) {
+      return ThrowException(Exception::Error(String::New("relabelUid takes 2 arguments")));
+    }
+
+    uint64_t uid;
+    if(!getUid(args[0], uid))
+      return ThrowException(Exception::Error(String::New("argument 1 must be a non-negative integer")));
+
+    if(!args[1]->IsNumber())
+      return ThrowException(Exception::Error(String::New("argument 2 must be a number")));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    return scope.Close(Boolean::New(IncrementalRandomForest::relabelUid(ih->f, uid, args[1]->NumberValue())));
+  }
+
+  static Handle<Value> patch(const Arguments& args) {
+    return patchSample(args, false);
+  }
+
+  static Handle<Value> patchUid(const Arguments& args) {
+    return patchSample(args, true);
+  }
+
+  static Handle<Value> patchSample(const Arguments& args, bool withUid) {
+    HandleScope scope;
+
+    if(args.Length() != 2 && args.Length() != 3) {
+      return ThrowException(Exception::Error(String::New(withUid ? "patchUid takes 2 or 3 arguments" : "patch takes 2 or 3 arguments")));
+    }
+
+    uint64_t uid = 0;
+    Local<String> suid;
+    if(withUid) {
+      if(!getUid(args[0], uid))
+        return ThrowException(Exception::Error(String::New("argument 1 must be a non-negative integer")));
+    } else {
+      suid = *args[0]->ToString();
+      if(suid.IsEmpty())
+        return ThrowException(Exception::Error(String::New("argument 1 must be a string")));
+    }
+
+    if(!args[1]->IsObject())
+      return ThrowException(Exception::Error(String::New("argument 2 must be a object")));
+    Local<Object> features = *args[1]->ToObject();
+
+    if(args.Length() == 3 && !args[2]->IsArray())
+      return ThrowException(Exception::Error(String::New("argument 3 must be an array (codes to remove)")));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    Sample added;
+    setFeatures(&added, features);
+    vector<int> removed;
+    if(args.Length() == 3) {
+      Local<Array> codes = Local<Array>::Cast(args[2]);
+      for(uint32_t i = 0; i < codes->Length(); ++i)
+        removed.push_back(codes->Get(i)->Int32Value());
+    }
+
+    if(withUid)
+      return scope.Close(Boolean::New(IncrementalRandomForest::patchUid(ih->f, uid, added.xCodes, removed)));
+    return scope.Close(Boolean::New(IncrementalRandomForest::patch(ih->f, *String::AsciiValue(suid), added.xCodes, removed)));
+  }
+
   static Handle<Value> classify(const Arguments& args) {
     HandleScope scope;
 
@@ -172,7 +632,9 @@ public:
       return ThrowException(Exception::Error(String::New("argument 1 must be a object")));
     Local<Object> features = *args[0]->ToObject();
 
-    IRF* ih = ObjectWrap::Unwrap<IRF>(args.This());
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
 
     IncrementalRandomForest::Sample s;
     setFeatures(&s, features);
@@ -196,7 +658,9 @@ public:
       return ThrowException(Exception::Error(String::New("argument 2 must be a number")));
     Local<Number> nTrees = *args[1]->ToNumber();
 
-    IRF* ih = ObjectWrap::Unwrap<IRF>(args.This());
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
 
     IncrementalRandomForest::Sample s;
     setFeatures(&s, features);
@@ -204,6 +668,121 @@ public:
     return scope.Close(Number::New(IncrementalRandomForest::classifyPartial(ih->f, &s, nTrees->Value())));
   }
 
+  static Handle<Value> addBatch(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 5) {
+      return ThrowException(Exception::Error(String::New("addBatch takes 5 arguments")));
+    }
+
+    int* offsets;
+    int nOffsets;
+    if(!getTypedArray(args[1], kExternalIntArray, offsets, nOffsets))
+      return ThrowException(Exception::Error(String::New("argument 2 must be an Int32Array (offsets)")));
+    int n = nOffsets - 1;
+
+    int* codes;
+    int nCodes;
+    if(!getTypedArray(args[2], kExternalIntArray, codes, nCodes))
+      return ThrowException(Exception::Error(String::New("argument 3 must be an Int32Array (codes)")));
+
+    float* values;
+    int nValues;
+    if(!getTypedArray(args[3], kExternalFloatArray, values, nValues) || nValues != nCodes)
+      return ThrowException(Exception::Error(String::New("argument 4 must be a Float32Array (values) as long as codes")));
+
+    if(!checkOffsets(offsets, nOffsets, nCodes))
+      return ThrowException(Exception::Error(String::New("offsets must go from 0 to at most the number of codes, without decreasing")));
+
+    float* ys;
+    int nYs;
+    if(!getTypedArray(args[4], kExternalFloatArray, ys, nYs) || nYs != n)
+      return ThrowException(Exception::Error(String::New("argument 5 must be a Float32Array (labels) with one element per sample")));
+
+    // ids can be strings in an Array, or integers in an Int32Array or Uint32Array
+    vector<string> idStrings(n);
+    int* intIds;
+    unsigned int* uintIds;
+    int nIds;
+    char key[16];
+    if(getTypedArray(args[0], kExternalIntArray, intIds, nIds) && nIds == n) {
+      for(int i = 0; i < n; ++i) {
+        sprintf(key, "%d", intIds[i]);
+        idStrings[i] = key;
+      }
+    } else if(getTypedArray(args[0], kExternalUnsignedIntArray, uintIds, nIds) && nIds == n) {
+      for(int i = 0; i < n; ++i) {
+        sprintf(key, "%u", uintIds[i]);
+        idStrings[i] = key;
+      }
+    } else if(args[0]->IsArray() && Local<Array>::Cast(args[0])->Length() == (uint32_t)n) {
+      Local<Array> ids = Local<Array>::Cast(args[0]);
+      for(int i = 0; i < n; ++i)
+        idStrings[i] = *String::AsciiValue(ids->Get(i)->ToString());
+    } else
+      return ThrowException(Exception::Error(String::New("argument 1 must be an Array, Int32Array or Uint32Array (ids) with one element per sample")));
+
+    vector<const char*> ids(n);
+    for(int i = 0; i < n; ++i)
+      ids[i] = idStrings[i].c_str();
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    int added = IncrementalRandomForest::addBatch(ih->f, n, n > 0 ? &ids[0] : 0, offsets, codes, values, ys);
+
+    return scope.Close(Integer::New(added));
+  }
+
+  static Handle<Value> classifyBatch(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 3 && args.Length() != 4) {
+      return ThrowException(Exception::Error(String::New("classifyBatch takes 3 or 4 arguments")));
+    }
+
+    int* offsets;
+    int nOffsets;
+    if(!getTypedArray(args[0], kExternalIntArray, offsets, nOffsets))
+      return ThrowException(Exception::Error(String::New("argument 1 must be an Int32Array (offsets)")));
+    int n = nOffsets - 1;
+
+    int* codes;
+    int nCodes;
+    if(!getTypedArray(args[1], kExternalIntArray, codes, nCodes))
+      return ThrowException(Exception::Error(String::New("argument 2 must be an Int32Array (codes)")));
+
+    float* values;
+    int nValues;
+    if(!getTypedArray(args[2], kExternalFloatArray, values, nValues) || nValues != nCodes)
+      return ThrowException(Exception::Error(String::New("argument 3 must be a Float32Array (values) as long as codes")));
+
+    if(!checkOffsets(offsets, nOffsets, nCodes))
+      return ThrowException(Exception::Error(String::New("offsets must go from 0 to at most the number of codes, without decreasing")));
+
+    Local<Object> out;
+    if(args.Length() == 4) {
+      if(!args[3]->IsObject())
+        return ThrowException(Exception::Error(String::New("argument 4 must be a Float32Array (output) with one element per sample")));
+      out = args[3]->ToObject();
+    } else
+      out = newTypedArray("Float32Array", n);
+
+    float* ys;
+    int nYs;
+    if(!getTypedArray(out, kExternalFloatArray, ys, nYs) || nYs != n)
+      return ThrowException(Exception::Error(String::New("argument 4 must be a Float32Array (output) with one element per sample")));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    IncrementalRandomForest::classifyBatch(ih->f, n, offsets, codes, values, ys);
+
+    return scope.Close(out);
+  }
+
   static Handle<Value> asJSON(const Arguments& args) {
     HandleScope scope;
 
@@ -211,7 +790,9 @@ public:
       return ThrowException(Exception::Error(String::New("toJSON takes 0 arguments")));
     }
 
-    IRF* ih = ObjectWrap::Unwrap<IRF>(args.This());
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
 
     stringstream ss;
     IncrementalRandomForest::asJSON(ih->f, ss);
@@ -227,7 +808,9 @@ public:
       return ThrowException(Exception::Error(String::New("statsJSON takes 0 arguments")));
     }
 
-    IRF* ih = ObjectWrap::Unwrap<IRF>(args.This());
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
 
     stringstream ss;
     IncrementalRandomForest::statsJSON(ih->f, ss);
@@ -236,6 +819,24 @@ public:
     return scope.Close(String::New(ss.str().c_str()));
   }
 
+  static Handle<Value> countersJSON(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 0) {
+      return ThrowException(Exception::Error(String::New("countersJSON takes 0 arguments")));
+    }
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    stringstream ss;
+    IncrementalRandomForest::countersJSON(ih->f, ss);
+    ss.flush();
+
+    return scope.Close(String::New(ss.str().c_str()));
+  }
+
   static Handle<Value> each(const Arguments& args) {
     HandleScope scope;
 
@@ -254,16 +855,22 @@ public:
     const unsigned argc = 3;
     Local<Value> argv[argc] = { v };
 
-    IRF* ih = ObjectWrap::Unwrap<IRF>(args.This());
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
 
     SampleWalker* walker = getSamples(ih->f);
+    ih->busy = true;
 
     Local<Object> globalObj = Context::GetCurrent()->Global();
     Local<Function> objectConstructor = Local<Function>::Cast(globalObj->Get(String::New("Object")));
 
     while(walker->stillSome()) {
       Sample* s = walker->get();
-      argv[0] = Local<String>::New(String::New(s->suid.c_str()));
+      if(s->suid.empty())
+        argv[0] = Local<Number>::New(Number::New((double) s->uid));
+      else
+        argv[0] = Local<String>::New(String::New(s->suid.c_str()));
       Local<Object> features = Object::New();
       getFeatures(s, features);
       argv[1] = features;
@@ -274,11 +881,92 @@ public:
         break;
     }
 
+    ih->busy = false;
     delete walker;
 
     return Undefined();
   }
 
+  static Handle<Value> exportSamples(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 0) {
+      return ThrowException(Exception::Error(String::New("exportSamples takes 0 arguments")));
+    }
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    int n;
+    int nCodes;
+    countSamples(ih->f, n, nCodes);
+
+    Local<Object> offsetsA = newTypedArray("Int32Array", n + 1);
+    Local<Object> codesA = newTypedArray("Int32Array", nCodes);
+    Local<Object> valuesA = newTypedArray("Float32Array", nCodes);
+    Local<Object> ysA = newTypedArray("Float32Array", n);
+    Local<Object> uidsA = newTypedArray("Float64Array", n);
+
+    int* offsets;
+    int* codes;
+    float* values;
+    float* ys;
+    double* uidNumbers;
+    int length;
+    getTypedArray(offsetsA, kExternalIntArray, offsets, length);
+    getTypedArray(codesA, kExternalIntArray, codes, length);
+    getTypedArray(valuesA, kExternalFloatArray, values, length);
+    getTypedArray(ysA, kExternalFloatArray, ys, length);
+    getTypedArray(uidsA, kExternalDoubleArray, uidNumbers, length);
+
+    vector<const char*> ids(n);
+    vector<uint64_t> uids(n);
+    IncrementalRandomForest::exportSamples(ih->f, n ? &ids[0] : 0, n ? &uids[0] : 0, offsets, codes, values, ys);
+    // uids as numbers, so only exact up to 2^53
+    for(int i = 0; i < n; ++i)
+      uidNumbers[i] = (double) uids[i];
+
+    Local<Array> idsA = Array::New(n);
+    for(int i = 0; i < n; ++i)
+      idsA->Set(i, String::New(ids[i]));
+
+    Local<Object> out = Object::New();
+    out->Set(String::NewSymbol("ids"), idsA);
+    out->Set(String::NewSymbol("uids"), uidsA);
+    out->Set(String::NewSymbol("offsets"), offsetsA);
+    out->Set(String::NewSymbol("codes"), codesA);
+    out->Set(String::NewSymbol("values"), valuesA);
+    out->Set(String::NewSymbol("ys"), ysA);
+    return scope.Close(out);
+  }
+
+  static Handle<Value> config(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 0) {
+      return ThrowException(Exception::Error(String::New("config takes 0 arguments")));
+    }
+
+    IRF* ih = ObjectWrap::Unwrap<IRF>(args.This());
+    const ForestConfig& config = IncrementalRandomForest::getConfig(ih->f);
+
+    Local<Object> out = Object::New();
+    out->Set(String::NewSymbol("maxCodesToConsider"), Integer::NewFromUnsigned(config.maxCodesToConsider));
+    out->Set(String::NewSymbol("maxCodesToKeep"), Integer::NewFromUnsigned(config.maxCodesToKeep));
+    out->Set(String::NewSymbol("minEvidence"), Integer::NewFromUnsigned(config.minEvidence));
+    out->Set(String::NewSymbol("minEntropyGain"), Number::New(config.minEntropyGain));
+    out->Set(String::NewSymbol("maxDepth"), Integer::NewFromUnsigned(config.maxDepth));
+    out->Set(String::NewSymbol("minSamplesLeaf"), Integer::NewFromUnsigned(config.minSamplesLeaf));
+    out->Set(String::NewSymbol("maxUnsplit"), Integer::NewFromUnsigned(config.maxUnsplit));
+    out->Set(String::NewSymbol("splitMargin"), Number::New(config.splitMargin));
+    out->Set(String::NewSymbol("splitPatience"), Integer::NewFromUnsigned(config.splitPatience));
+    out->Set(String::NewSymbol("windowSize"), Integer::NewFromUnsigned(config.windowSize));
+    out->Set(String::NewSymbol("windowAge"), Number::New(config.windowAge));
+    out->Set(String::NewSymbol("maxCounts"), Number::New(config.maxCounts));
+    return scope.Close(out);
+  }
+
   static Handle<Value> commit(const Arguments& args) {
     HandleScope scope;
 
@@ -286,13 +974,107 @@ public:
       return ThrowException(Exception::Error(String::New("commit takes 0 arguments")));
     }
 
-    IRF* ih = ObjectWrap::Unwrap<IRF>(args.This());
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
 
     IncrementalRandomForest::commit(ih->f);
 
     return scope.Close(Undefined());
   }
 
+  static void runAsync(uv_work_t* request) {
+    AsyncOp* op = static_cast<AsyncOp*>(request->data);
+    op->run(op->ih->f);
+  }
+
+  static void afterAsync(uv_work_t* request) {
+    HandleScope scope;
+    AsyncOp* op = static_cast<AsyncOp*>(request->data);
+    IRF* ih = op->ih;
+    ih->busy = false;
+
+    const unsigned argc = 2;
+    Local<Value> argv[argc] = { Local<Value>::New(Null()), Local<Value>::New(op->result()) };
+    TryCatch tc;
+    op->callback->Call(Context::GetCurrent()->Global(), argc, argv);
+    delete op;
+    ih->Unref();
+    if(tc.HasCaught())
+      FatalException(tc);
+  }
+
+  static Handle<Value> startAsync(IRF* ih, AsyncOp* op, Local<Value> callback) {
+    op->ih = ih;
+    op->callback = Persistent<Function>::New(Local<Function>::Cast(callback));
+    op->request.data = op;
+    ih->busy = true;
+    ih->Ref();
+    uv_queue_work(uv_default_loop(), &op->request, runAsync, afterAsync);
+    return Undefined();
+  }
+
+  static Handle<Value> commitAsync(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 1 || !args[0]->IsFunction()) {
+      return ThrowException(Exception::TypeError(String::New("commitAsync takes a callback function")));
+    }
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    return scope.Close(startAsync(ih, new CommitOp(), args[0]));
+  }
+
+  static Handle<Value> classifyBatchAsync(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 2) {
+      return ThrowException(Exception::Error(String::New("classifyBatchAsync takes 2 arguments")));
+    }
+
+    if(!args[0]->IsArray())
+      return ThrowException(Exception::Error(String::New("argument 1 must be an array of objects")));
+    Local<Array> batch = Local<Array>::Cast(args[0]);
+
+    if(!args[1]->IsFunction())
+      return ThrowException(Exception::TypeError(String::New("argument 2 must be a callback function")));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    ClassifyBatchOp* op = new ClassifyBatchOp();
+    op->samples.resize(batch->Length());
+    for(uint32_t i = 0; i < batch->Length(); ++i) {
+      Local<Value> v = batch->Get(i);
+      if(!v->IsObject()) {
+        delete op;
+        return ThrowException(Exception::Error(String::New("argument 1 must be an array of objects")));
+      }
+      Local<Object> features = v->ToObject();
+      setFeatures(&op->samples[i], features);
+    }
+
+    return scope.Close(startAsync(ih, op, args[1]));
+  }
+
+  static Handle<Value> toBufferAsync(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 1 || !args[0]->IsFunction()) {
+      return ThrowException(Exception::TypeError(String::New("toBufferAsync takes a callback function")));
+    }
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    return scope.Close(startAsync(ih, new ToBufferOp(), args[0]));
+  }
+
   static Handle<Value> toBuffer(const Arguments& args) {
     HandleScope scope;
 
@@ -300,21 +1082,305 @@ public:
       return ThrowException(Exception::Error(String::New("save takes 0 arguments")));
     }
 
-    IRF* ih = ObjectWrap::Unwrap<IRF>(args.This());
-    stringstream ss(stringstream::out | stringstream::binary);
-    save(ih->f, ss);
-    ss.flush();
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+    BlockSink sink;
+    save(ih->f, sink);
+
+    return scope.Close(sink.toBuffer()->handle_);
+  }
+
+  static Handle<Value> saveTo(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 1) {
+      return ThrowException(Exception::Error(String::New("saveTo takes 1 argument")));
+    }
+    if (!args[0]->IsFunction()) {
+      return ThrowException(Exception::TypeError(String::New("argument must be a callback function")));
+    }
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+    FunctionSink sink(Local<Function>::Cast(args[0]));
+    ih->busy = true;
+    bool saved = save(ih->f, sink);
+    ih->busy = false;
+
+    return scope.Close(Boolean::New(saved));
+  }
+
+  static Handle<Value> toDeltaBuffer(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 0) {
+      return ThrowException(Exception::Error(String::New("toDeltaBuffer takes 0 arguments")));
+    }
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+    BlockSink sink;
+    saveDelta(ih->f, sink);
+
+    return scope.Close(sink.toBuffer()->handle_);
+  }
+
+  static Handle<Value> applyDelta(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 1) {
+      return ThrowException(Exception::Error(String::New("applyDelta takes 1 argument")));
+    }
+
+    if(!Buffer::HasInstance(args[0]))
+      return ThrowException(Exception::Error(String::New("argument must be a Buffer")));
+
+    Local<Object> o = args[0]->ToObject();
+    MemorySource source(Buffer::Data(o), Buffer::Length(o));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    return scope.Close(Boolean::New(IncrementalRandomForest::applyDelta(ih->f, source)));
+  }
+
+  static Handle<Value> setLog(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 1) {
+      return ThrowException(Exception::Error(String::New("setLog takes 1 argument")));
+    }
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    IncrementalRandomForest::setLog(ih->f, 0);
+    delete ih->log;
+    ih->log = 0;
+
+    if(args[0]->IsNull())
+      return scope.Close(Boolean::New(true));
+
+    Local<String> fileName = *args[0]->ToString();
+    if(fileName.IsEmpty())
+      return ThrowException(Exception::Error(String::New("argument 1 must be a string or null")));
+
+    ih->log = new ofstream(*String::Utf8Value(fileName), ios::out | ios::app);
+    if(!ih->log->is_open()) {
+      delete ih->log;
+      ih->log = 0;
+      return scope.Close(Boolean::New(false));
+    }
+
+    IncrementalRandomForest::setLog(ih->f, ih->log);
+    return scope.Close(Boolean::New(true));
+  }
+
+  static Handle<Value> replayLog(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 1) {
+      return ThrowException(Exception::Error(String::New("replayLog takes 1 argument")));
+    }
+
+    Local<String> fileName = *args[0]->ToString();
+    if(fileName.IsEmpty())
+      return ThrowException(Exception::Error(String::New("argument 1 must be a string")));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    ifstream inS(*String::Utf8Value(fileName));
+    if(!inS.is_open())
+      return scope.Close(Boolean::New(false));
+
+    return scope.Close(Boolean::New(IncrementalRandomForest::replayLog(ih->f, inS)));
+  }
+
+  static Handle<Value> setSampleFile(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 1) {
+      return ThrowException(Exception::Error(String::New("setSampleFile takes 1 argument")));
+    }
+
+    Local<String> fileName = *args[0]->ToString();
+    if(fileName.IsEmpty())
+      return ThrowException(Exception::Error(String::New("argument 1 must be a string")));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    return scope.Close(Boolean::New(IncrementalRandomForest::setSampleFile(ih->f, *String::Utf8Value(fileName))));
+  }
+
+  static Handle<Value> saveModel(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 1) {
+      return ThrowException(Exception::Error(String::New("saveModel takes 1 argument")));
+    }
+
+    Local<String> fileName = *args[0]->ToString();
+    if(fileName.IsEmpty())
+      return ThrowException(Exception::Error(String::New("argument 1 must be a string")));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    ofstream outS(*String::Utf8Value(fileName), ios::out | ios::binary);
+    if(!outS.is_open())
+      return scope.Close(Boolean::New(false));
+
+    return scope.Close(Boolean::New(IncrementalRandomForest::saveModel(ih->f, outS)));
+  }
+
+  // libsvm text from a file or a Buffer, with the label of negative samples and an optional id prefix
+  static Handle<Value> addFromLibsvm(const Arguments& args, const char* name, bool fromFile) {
+    HandleScope scope;
+
+    if(args.Length() != 2 && args.Length() != 3) {
+      return ThrowException(Exception::Error(String::New((string(name) + " takes 2 or 3 arguments").c_str())));
+    }
+
+    if(fromFile ? !args[0]->IsString() : !Buffer::HasInstance(args[0]))
+      return ThrowException(Exception::Error(String::New(fromFile ? "argument 1 must be a string" : "argument 1 must be a Buffer")));
+    if(!args[1]->IsNumber())
+      return ThrowException(Exception::Error(String::New("argument 2 must be a number (label of negative samples)")));
+    float negativeLabel = args[1]->NumberValue();
+    String::Utf8Value idPrefix(args.Length() == 3 ? args[2]->ToString() : String::New(""));
+
+    IRF* ih = unwrapIdle(args);
+    if(!ih)
+      return Undefined();
+
+    int added;
+    if(fromFile) {
+      added = IncrementalRandomForest::addFromFile(ih->f, *String::Utf8Value(args[0]), *idPrefix, negativeLabel, 0);
+    } else {
+      Local<Object> o = args[0]->ToObject();
+      istringstream inS(string(Buffer::Data(o), Buffer::Length(o)));
+      added = IncrementalRandomForest::addFromStream(ih->f, inS, *idPrefix, negativeLabel);
+    }
+    if(added < 0)
+      return ThrowException(Exception::Error(String::New("could not read libsvm samples")));
+
+    return scope.Close(Integer::New(added));
+  }
+
+  static Handle<Value> addFromFile(const Arguments& args) {
+    return addFromLibsvm(args, "addFromFile", true);
+  }
+
+  static Handle<Value> addFromBuffer(const Arguments& args) {
+    return addFromLibsvm(args, "addFromBuffer", false);
+  }
+};
+
+class IRFModel: ObjectWrap {
+private:
+  Model* m;
+
+public:
+  IRFModel(Model* withM) : ObjectWrap(), m(withM) {
+  }
+
+  ~IRFModel() {
+    destroy(m);
+  }
+
+  static void init(Handle < Object > target, Handle<Value> (*func)(const Arguments&), Persistent<FunctionTemplate>& ct, const char* name) {
+    Local<FunctionTemplate> t = FunctionTemplate::New(func);
+    ct = Persistent<FunctionTemplate>::New(t);
+    ct->InstanceTemplate()->SetInternalFieldCount(1);
+    Local<String> nameSymbol = String::NewSymbol(name);
+    ct->SetClassName(nameSymbol);
+    NODE_SET_PROTOTYPE_METHOD(ct, "classify", classify);
+    NODE_SET_PROTOTYPE_METHOD(ct, "classifyPartial", classifyPartial);
+    target->Set(nameSymbol, ct->GetFunction());
+  }
+
+  static Handle<Value> New(const Arguments& args) {
+    HandleScope scope;
+
+    if (!args.IsConstructCall()) {
+      return ThrowException(Exception::TypeError(String::New("Use the new operator to create instances of this object.")));
+    }
+
+    if(args.Length() != 1) {
+      return ThrowException(Exception::Error(String::New("Model takes 1 argument")));
+    }
+
+    Local<String> fileName = *args[0]->ToString();
+    if(fileName.IsEmpty())
+      return ThrowException(Exception::Error(String::New("argument 1 must be a string (model file name)")));
+
+    Model* m = loadModel(*String::Utf8Value(fileName));
+    if(!m)
+      return ThrowException(Exception::Error(String::New("could not map model file")));
 
-    Buffer* out = Buffer::New(const_cast<char*>(ss.str().c_str()), ss.tellp());
+    IRFModel* im = new IRFModel(m);
+    im->Wrap(args.This());
+    return args.This();
+  }
+
+  static Handle<Value> classify(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 1) {
+      return ThrowException(Exception::Error(String::New("classify takes 1 argument")));
+    }
+
+    if(!args[0]->IsObject())
+      return ThrowException(Exception::Error(String::New("argument 1 must be a object")));
+    Local<Object> features = *args[0]->ToObject();
+
+    IRFModel* im = ObjectWrap::Unwrap<IRFModel>(args.This());
+
+    IncrementalRandomForest::Sample s;
+    IRF::setFeatures(&s, features);
+
+    return scope.Close(Number::New(IncrementalRandomForest::classify(im->m, &s)));
+  }
+
+  static Handle<Value> classifyPartial(const Arguments& args) {
+    HandleScope scope;
+
+    if(args.Length() != 2) {
+      return ThrowException(Exception::Error(String::New("classifyPartial takes 2 argument")));
+    }
+
+    if(!args[0]->IsObject())
+      return ThrowException(Exception::Error(String::New("argument 1 must be a object")));
+    Local<Object> features = *args[0]->ToObject();
+
+    if(!args[1]->IsNumber())
+      return ThrowException(Exception::Error(String::New("argument 2 must be a number")));
+    Local<Number> nTrees = *args[1]->ToNumber();
+
+    IRFModel* im = ObjectWrap::Unwrap<IRFModel>(args.This());
+
+    IncrementalRandomForest::Sample s;
+    IRF::setFeatures(&s, features);
 
-    return scope.Close(out->handle_);
+    return scope.Close(Number::New(IncrementalRandomForest::classifyPartial(im->m, &s, nTrees->Value())));
   }
 };
 
 static Persistent<FunctionTemplate> irf_ct;
+static Persistent<FunctionTemplate> model_ct;
 
 void RegisterModule(Handle<Object> target) {
   IRF::init(target, IRF::New, irf_ct, "IRF");
+  IRFModel::init(target, IRFModel::New, model_ct, "Model");
 }
 
 NODE_MODULE(irf, RegisterModule);
@@ -6,15 +6,27 @@
 #include <cmath>
 #include <ctime>
 #include <utility>
+#include <iterator>
 
 #include <map>
+#include <deque>
 #include <vector>
 #include <set>
 #include <stack>
 
 #include <fstream>
 #include <sstream>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "randomForest.h"
 #include "MurmurHash3.h"
@@ -29,13 +41,8 @@ using google::sparse_hash_map;
 
 namespace IncrementalRandomForest {
 
-  static const unsigned int maxCodesToConsider = 30;
-  static const unsigned int maxCodesToKeep = 40;
-  static const unsigned int minEvidence = 2;
-  static const unsigned int maxUnsplit = 30;
-  static const unsigned int minBalanceSplit = 10;
+  // see ForestConfig for the limits that can be set per forest
   static const float minProbDiff = 0;
-  static const float minEntropyGain = 0.01;
 
   template <class T>
   static inline string to_string (const T& t)
@@ -45,13 +52,124 @@ namespace IncrementalRandomForest {
     return ss.str();
   }
 
+  // features moved out to a sample file: their count, then the codes, ascending, and their values
+  struct StoredCodes {
+    uint32_t count;
+    const int32_t* codes(void) const {
+      return reinterpret_cast<const int32_t*>(this + 1);
+    }
+    const float* values(void) const {
+      return reinterpret_cast<const float*>(codes() + count);
+    }
+    size_t size(void) const {
+      return sizeof(StoredCodes) + count * (sizeof(int32_t) + sizeof(float));
+    }
+  };
+
+  // features are read through these, wherever they are kept
+  static bool findCode(const Sample* s, int code, float& value) {
+    if(s->stored) {
+      const int32_t* begin = s->stored->codes();
+      const int32_t* end = begin + s->stored->count;
+      const int32_t* it = lower_bound(begin, end, code);
+      if(it == end || *it != code)
+        return false;
+      value = s->stored->values()[it - begin];
+      return true;
+    }
+    map<int, float>::const_iterator itCode = s->xCodes.find(code);
+    if(itCode == s->xCodes.end())
+      return false;
+    value = itCode->second;
+    return true;
+  }
+
+  static size_t countCodes(const Sample* s) {
+    return s->stored ? s->stored->count : s->xCodes.size();
+  }
+
+  template <class Visitor>
+  static void visitSampleCodes(const Sample* s, Visitor& v) {
+    if(s->stored) {
+      const int32_t* codes = s->stored->codes();
+      const float* values = s->stored->values();
+      for(uint32_t i = 0; i < s->stored->count; ++i)
+        v(codes[i], values[i]);
+    } else {
+      for(map<int, float>::const_iterator itC = s->xCodes.begin(); itC != s->xCodes.end(); ++itC)
+        v(itC->first, itC->second);
+    }
+  }
+
+  // what samples are known by in the forest: their suid, or their uid when that is empty
+  struct SampleId {
+    string suid;
+    uint64_t uid;
+    SampleId(void) : uid(0) {
+    }
+    SampleId(const Sample* s) : suid(s->suid), uid(s->suid.empty() ? s->uid : 0) {
+    }
+    explicit SampleId(const char* withSuid) : suid(withSuid), uid(0) {
+    }
+    explicit SampleId(uint64_t withUid) : uid(withUid) {
+    }
+    bool operator<(const SampleId& other) const {
+      int c = suid.compare(other.suid);
+      return c < 0 || (c == 0 && uid < other.uid);
+    }
+  };
+
+  static void setSampleId(Sample* s, const SampleId& id) {
+    s->suid = id.suid;
+    s->uid = id.uid;
+  }
+
+  // in text, from version 8, a uid is written as '#' followed by it. suids starting with '#' get
+  // another one in front
+  static ostream& operator<<(ostream& outS, const SampleId& id) {
+    if(id.suid.empty())
+      return outS << '#' << id.uid;
+    if(id.suid[0] == '#')
+      outS << '#';
+    return outS << id.suid;
+  }
+
+  static bool parseSampleId(const string& token, int version, SampleId& id) {
+    id = SampleId();
+    if(version < 8 || token.empty() || token[0] != '#') {
+      id.suid = token;
+      return !token.empty();
+    }
+    if(token.size() > 1 && token[1] == '#') {
+      id.suid = token.substr(1);
+      return true;
+    }
+    istringstream uidS(token.substr(1));
+    return (uidS >> id.uid) && uidS.eof();
+  }
+
+  static bool readSampleId(istream& inS, int version, SampleId& id) {
+    string token;
+    return (inS >> token) && parseSampleId(token, version, id);
+  }
+
+  struct CodeWriter {
+    ostream& out;
+    const char* before;
+    const char* after;
+    CodeWriter(ostream& withOut, const char* withBefore, const char* withAfter) :
+      out(withOut), before(withBefore), after(withAfter) {
+    }
+    void operator()(int code, float value) {
+      out << before << code << " " << value << after;
+    }
+  };
+
   static void printSample(ostream& out, Sample* s) {
     out << s->y;
-    out << " " << s->xCodes.size();
-    map<int, float>::const_iterator itCodes;
-    for(itCodes = s->xCodes.begin(); itCodes != s->xCodes.end(); ++itCodes) {
-      out << " " << itCodes->first << " " << itCodes->second;
-    }
+    out << " " << countCodes(s);
+    CodeWriter writer(out, " ", "");
+    visitSampleCodes(s, writer);
     out << endl;
   }
 
@@ -69,14 +187,28 @@ namespace IncrementalRandomForest {
     return h;
   }
 
-  static void findUsedCodes(SampleWalker& sw, set<int>& uc) {
-    map<int, float>::const_iterator itC;
-    while(sw.stillSome()) {
-      Sample* s = sw.get();
-      for(itC = s->xCodes.begin(); itC != s->xCodes.end(); ++itC)
-        uc.insert(itC->first);
+  // n log n, tabulated for the small counts found in most nodes. n times the entropy of
+  // counts c0 and c1 is nLogN(c0 + c1) - nLogN(c0) - nLogN(c1), with no division or log
+  class NLogNTable {
+  private:
+    static const unsigned int tableSize = 4096;
+    double table[tableSize];
+  public:
+    NLogNTable(void) {
+      table[0] = 0;
+      for(unsigned int n = 1; n < tableSize; ++n)
+        table[n] = n * log((double) n);
     }
-  }
+    double operator()(unsigned int n) const {
+      return n < tableSize ? table[n] : n * log((double) n);
+    }
+  };
+
+  static const NLogNTable nLogN;
+
+  // how far entropyBinary and DecisionCounts::entropy, computed in float, can be from the
+  // tabulated estimate. generous, as it only decides which candidates get the exact check
+  static const double entropyEstimateSlack = 1e-4;
 
   static void splitListByTarget(const vector<Sample*>& sl, vector<Sample*>& sl0, vector<Sample*>& sl1) {
     vector<Sample*>::const_iterator it;
@@ -89,29 +221,15 @@ namespace IncrementalRandomForest {
     }
   }
 
-  class VectorSampleWalker : public SampleWalker {
-  private:
-    vector<Sample*>::const_iterator itCurr;
-    vector<Sample*>::const_iterator itEnd;
-  public:
-    VectorSampleWalker(const vector<Sample*>& sv) :
-      itCurr(sv.begin()), itEnd(sv.end()) {
-    }
-    virtual bool stillSome(void) const {
-      return itCurr != itEnd;
-    }
-    virtual Sample* get(void) {
-      return *itCurr++;
-    }
-  };
-
-  static void splitListAgainstCode(SampleWalker& sw, int c, vector<Sample*>& sl0, vector<Sample*>& sl1) {
-    while(sw.stillSome()) {
-      Sample* s = sw.get();
-      map<int, float>::const_iterator itCode = s->xCodes.find(c);
+  // SampleWalker is for users of the library, internally samples are walked over as ranges
+  template <class Iterator>
+  static void splitListAgainstCode(Iterator begin, Iterator end, int c, vector<Sample*>& sl0, vector<Sample*>& sl1) {
+    for(; begin != end; ++begin) {
+      Sample* s = *begin;
+      float value;
       bool cc;
-      if(itCode != s->xCodes.end()) {
-        cc = itCode->second > 0.5;
+      if(findCode(s, c, value)) {
+        cc = value > 0.5;
       } else
         cc = false;
 
@@ -135,7 +253,7 @@ namespace IncrementalRandomForest {
       rank = 0; // needs to be set afterwards
     }
 
-    bool enoughEvidence(DecisionTreeNode* dt) const;
+    bool enoughEvidence(DecisionTreeNode* dt, unsigned int minEvidence) const;
 
     bool isZeroFor(DecisionTreeNode* dt) const;
 
@@ -155,17 +273,82 @@ namespace IncrementalRandomForest {
   struct DecisionTreeInternal;
   struct DecisionTreeLeaf;
 
+  // doubly linked, from the coldest to the warmest, copies are not linked
+  struct CountedLink {
+    CountedLink* colder;
+    CountedLink* warmer;
+    CountedLink(void) : colder(this), warmer(this) {
+    }
+    CountedLink(const CountedLink&) : colder(this), warmer(this) {
+    }
+    CountedLink& operator=(const CountedLink&) {
+      return *this;
+    }
+    void unlink(void) {
+      colder->warmer = warmer;
+      warmer->colder = colder;
+      colder = warmer = this;
+    }
+    // just warmer than l
+    void linkAfter(CountedLink* l) {
+      colder = l;
+      warmer = l->warmer;
+      warmer->colder = this;
+      l->warmer = this;
+    }
+  };
+
+  // the memory budget evicts from the cold end, without walking the tree
+  struct CountedNodes {
+    CountedLink ends;    // ends.warmer is the coldest node, ends.colder the warmest
+    CountedLink reached; // nodes reached by the current update go just warmer, so deeper ones end up colder
+    unsigned long kept;  // counters of the linked nodes, as last accounted
+    bool complete;       // false until the nodes loaded with counters are linked too
+    CountedNodes(void) : kept(0), complete(false) {
+      reached.linkAfter(&ends);
+    }
+  };
+
+  struct DecisionTreeNode;
+
+  // a node's place in the list, kept out of the node so that forests without a memory budget
+  // pay only for the pointer to it
+  struct CountedEntry : public CountedLink {
+    DecisionTreeNode* node;
+    CountedNodes* list;
+    // its counters as last accounted in the list, stale while the update that reached it
+    // may still change them
+    unsigned long countsAccounted;
+    bool countsStale;
+    CountedEntry(DecisionTreeNode* withNode, CountedNodes* withList) :
+      node(withNode), list(withList), countsAccounted(0), countsStale(false) {
+    }
+  };
+
   struct DecisionTreeNode {
     int code; // iff code == -1 it's a leaf node
     unsigned int c0;
     unsigned int c1;
+    bool countsEvicted; // decisionCountMap dropped under the memory budget, here where it takes no room
     sparse_hash_map<int, DecisionCounts> decisionCountMap;
     unsigned long id;
     pair<CodeRankType, int> minValidRank;
-    DecisionTreeNode() : decisionCountMap() {
+    CountedEntry* counted; // not saved: 0 unless listed under the memory budget
+    DecisionTreeNode() : countsEvicted(false), decisionCountMap(), counted(0) {
       decisionCountMap.set_deleted_key(-1);
       minValidRank = make_pair(0U, 0);
     }
+    ~DecisionTreeNode() {
+      uncount();
+    }
+    void uncount(void) {
+      if(!counted)
+        return;
+      counted->list->kept -= counted->countsAccounted;
+      counted->unlink();
+      delete counted;
+      counted = 0;
+    }
     DecisionTreeInternal* checkInternal(void);
     DecisionTreeLeaf* checkLeaf(void);
     bool checkType(DecisionTreeInternal**, DecisionTreeLeaf**);
@@ -174,6 +357,7 @@ namespace IncrementalRandomForest {
   struct DecisionTreeInternal : public DecisionTreeNode {
     DecisionTreeNode* negative;
     DecisionTreeNode* positive;
+    unsigned int splitStreak; // updates in a row another code was best, not saved
   };
 
   struct DecisionTreeLeaf : public DecisionTreeNode {
@@ -207,7 +391,7 @@ namespace IncrementalRandomForest {
     }
   }
 
-  bool DecisionCounts::enoughEvidence(DecisionTreeNode* dt) const {
+  bool DecisionCounts::enoughEvidence(DecisionTreeNode* dt, unsigned int minEvidence) const {
     const unsigned int c0n = dt->c0 - c0p;
     const unsigned int c1n = dt->c1 - c1p;
     return ((c0n + c1n) >= minEvidence) && ((c0p + c1p) >= minEvidence);
@@ -234,6 +418,30 @@ namespace IncrementalRandomForest {
     return (hn * cn + hp * cp) / (cn + cp);
   }
 
+  // moves the node to the warm end, leaving it to eviction to account for its counters
+  static void reachNode(TreeState& ts, DecisionTreeNode* n) {
+    CountedNodes* counted = ts.counted;
+    if(!counted)
+      return;
+    if(n->counted && n->counted->list == counted)
+      n->counted->unlink();
+    else {
+      n->uncount();
+      n->counted = new CountedEntry(n, counted);
+    }
+    n->counted->linkAfter(&counted->reached);
+    n->counted->countsStale = true;
+  }
+
+  // before an update reaches any node
+  static void startReaching(TreeState& ts) {
+    CountedNodes* counted = ts.counted;
+    if(!counted)
+      return;
+    counted->reached.unlink();
+    counted->reached.linkAfter(counted->ends.colder);
+  }
+
   static DecisionTreeLeaf* makeLeaf(TreeState& ts, float v) {
     DecisionTreeLeaf* n = new DecisionTreeLeaf();
     n->code = -1;
@@ -241,6 +449,7 @@ namespace IncrementalRandomForest {
     n->c0 = 0;
     n->c1 = 0;
     n->id = rand_r(&ts.seed);
+    reachNode(ts, n);
     return n;
   }
 
@@ -249,7 +458,9 @@ namespace IncrementalRandomForest {
     n->code = c;
     n->negative = n0;
     n->positive = n1;
+    n->splitStreak = 0;
     n->id = rand_r(&ts.seed);
+    reachNode(ts, n);
     return n;
   }
 
@@ -259,6 +470,16 @@ namespace IncrementalRandomForest {
     return (c0n == dt->c0) && (c1n == dt->c1) && (c0p == 0) && (c1p == 0);
   }
 
+  // just this node, as its own type
+  static void deleteDecisionTreeNode(DecisionTreeNode* dt) {
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
+    if(dt->checkType(&ni, &nl))
+      delete nl;
+    else
+      delete ni;
+  }
+
   static void destroyDecisionTreeNode(DecisionTreeNode* dt) {
     DecisionTreeInternal* ni;
     DecisionTreeLeaf* nl;
@@ -291,16 +512,7 @@ namespace IncrementalRandomForest {
       l->value = (float)l->c1 / n;
   }
 
-  class TreeSampleWalker;
-
-  static void computeDecisionCounters(DecisionTreeNode* dt,
-                                      const TreeSampleWalker& origSW,
-                                      sparse_hash_map<int, DecisionCounts>& decisionCountMap,
-                                      unsigned int& outC0,
-                                      unsigned int& outC1,
-                                      pair<CodeRankType, int>& minValidRank);
-
-  static pair<CodeRankType, int> findMinRankToConsider(const sparse_hash_map<int, DecisionCounts>& dcMap) {
+  static pair<CodeRankType, int> findMinRankToConsider(const sparse_hash_map<int, DecisionCounts>& dcMap, unsigned int maxCodesToConsider) {
     sparse_hash_map<int, DecisionCounts>::const_iterator mapIt;
     pair<CodeRankType, int> minRankToConsider;
     minRankToConsider.first = 0; minRankToConsider.second = 0; // FIXME: is this necessary?
@@ -316,111 +528,209 @@ namespace IncrementalRandomForest {
     return minRankToConsider;
   }
 
-  static int findMinEntropyCode(float currentEntropy, DecisionTreeNode* dt) {
+  // the split is chosen by DecisionCounts::entropy, taking the first minimum in map order.
+  // all candidates are first estimated together from the n log n table, and only the ones
+  // within float error of the best estimate get the exact evaluation, keeping the choice
+  // and its tie-breaking while doing the logs for one or two codes instead of up to 30
+  static int findMinEntropyCode(TreeState& ts, float currentEntropy, DecisionTreeNode* dt) {
+    const ForestConfig& config = *ts.config;
     float minEntropy = 10;
     int minEntropyCode = -1;
 
     sparse_hash_map<int, DecisionCounts>::const_iterator mapIt;
 
     // FIXME: this is possibly too inneficient. keep DCs sorted by rank in a vector instead?
-    pair<CodeRankType, int> minRankToConsider = findMinRankToConsider(dt->decisionCountMap);
+    pair<CodeRankType, int> minRankToConsider = findMinRankToConsider(dt->decisionCountMap, config.maxCodesToConsider);
 
+    vector<sparse_hash_map<int, DecisionCounts>::const_iterator> candidates;
+    candidates.reserve(dt->decisionCountMap.size());
     for(mapIt = dt->decisionCountMap.begin(); mapIt != dt->decisionCountMap.end(); ++mapIt) {
       const DecisionCounts& dc = mapIt->second;
 
       if(make_pair(dc.rank, mapIt->first) >= minRankToConsider &&
-         dc.enoughEvidence(dt)) {
+         dc.enoughEvidence(dt, config.minEvidence)) {
+        if(!dc.enoughEvidence(dt, config.minSamplesLeaf)) {
+          ++ts.counters.leafSizeLimited;
+          continue;
+        }
+        candidates.push_back(mapIt);
+      }
+    }
+    const size_t nCandidates = candidates.size();
+    if(nCandidates == 0)
+      return -1;
+
+    // n times the entropy after each split
+    vector<double> estimates(nCandidates);
+    double minEstimate = numeric_limits<double>::max();
+    for(size_t i = 0; i < nCandidates; ++i) {
+      const unsigned int c0p = candidates[i]->second.c0p;
+      const unsigned int c1p = candidates[i]->second.c1p;
+      const unsigned int c0n = dt->c0 - c0p;
+      const unsigned int c1n = dt->c1 - c1p;
+      estimates[i] = nLogN(c0n + c1n) - nLogN(c0n) - nLogN(c1n) + nLogN(c0p + c1p) - nLogN(c0p) - nLogN(c1p);
+      minEstimate = min(minEstimate, estimates[i]);
+    }
 
-        float ah = dc.entropy(dt);
+    const double maxEstimate = minEstimate + entropyEstimateSlack * (dt->c0 + dt->c1);
+    for(size_t i = 0; i < nCandidates; ++i) {
+      if(estimates[i] > maxEstimate)
+        continue;
 
-        if(ah < minEntropy) {
-          minEntropy = ah;
-          minEntropyCode = mapIt->first;
-        }
+      float ah = candidates[i]->second.entropy(dt);
+
+      if(ah < minEntropy) {
+        minEntropy = ah;
+        minEntropyCode = candidates[i]->first;
       }
     }
 
     if(minEntropyCode == -1)
       return -1;
 
-    if(minEntropy < currentEntropy)
+    if(minEntropy < currentEntropy - config.minEntropyGain)
       return minEntropyCode;
 
     return -1;
   }
 
-  static void splitNode(TreeState& ts, DecisionTreeInternal* dt, int minEntropyCode, SampleWalker& sw);
+  // the code to split a node on, or -1 to keep it a leaf
+  static int findSplitCode(TreeState& ts, DecisionTreeNode* dt, unsigned int depth) {
+    const ForestConfig& config = *ts.config;
+    float currentEntropy = entropyBinary(dt->c0, dt->c1);
+    int minEntropyCode = findMinEntropyCode(ts, currentEntropy, dt);
+    if(minEntropyCode == -1)
+      return -1;
+    if(config.maxDepth > 0 && depth >= config.maxDepth) {
+      ++ts.counters.depthLimited;
+      return -1;
+    }
+    if(dt->c0 + dt->c1 <= config.maxUnsplit) {
+      ++ts.counters.sizeLimited;
+      return -1;
+    }
+    return minEntropyCode;
+  }
 
-  class TreeSampleWalker : public SampleWalker {
-  private:
-    stack<DecisionTreeNode*> st;
-    vector<Sample*>::iterator itCurr, itEnd;
-    bool hasSome;
-
-    bool stackDown(DecisionTreeNode* n) {
-      DecisionTreeInternal* ni;
-      DecisionTreeLeaf* nl;
-      while(!n->checkType(&ni, &nl)) {
-        st.push(ni);
-        n = ni->negative;
-      }
-      itCurr = nl->samples.begin();
-      itEnd = nl->samples.end();
-      if(itCurr != itEnd) {
-        st.push(nl);
-        return true;
-      } else {
-        return false;
-      }
+  // samples being distributed down a subtree are kept in a single array, and
+  // the node being (re)built works on a [begin, end) range of it, partitioned
+  // in place between its children. Items are either Sample pointers or, when
+  // growing trees in bulk, indices into samples flattened for the purpose
+
+  struct SamplePointers {
+    typedef Sample* Item;
+
+    Sample* sample(Item s) const {
+      return s;
     }
-  private:
-    void advanceToNext(void) {
-      while(!st.empty()) {
-        DecisionTreeInternal* ni = st.top()->checkInternal();
-        st.pop();
-        if(stackDown(ni->positive))
-          break;
-      }
+    float y(Item s) const {
+      return s->y;
     }
-  public:
-    TreeSampleWalker(DecisionTreeNode* n): st() {
-      if(!stackDown(n)) {
-        advanceToNext();
-      }
+    // 0 when not in the sample
+    float value(Item s, int code) const {
+      float v;
+      return findCode(s, code, v) ? v : 0;
     }
-    virtual bool stillSome(void) const {
-      return !st.empty();
+    template <class Visitor>
+    void visitCodes(Item s, Visitor& v) const {
+      visitSampleCodes(s, v);
     }
-    virtual Sample* get(void) {
-      Sample* s = *itCurr;
+  };
+
+  struct CodeCollector {
+    vector<int>& codes;
+    CodeCollector(vector<int>& withCodes) : codes(withCodes) {
+    }
+    void operator()(int code, float) {
+      codes.push_back(code);
+    }
+  };
 
-      ++itCurr;
-      if(itCurr == itEnd) {
-        st.pop(); // pop leaf
+  // for n1 samples of class 1 and n0 of class 0 with the same codes
+  struct CodeCounter {
+    sparse_hash_map<int, DecisionCounts>& decisionCountMap;
+    unsigned int n1;
+    unsigned int n0;
+    CodeCounter(sparse_hash_map<int, DecisionCounts>& withMap, unsigned int withN1, unsigned int withN0) :
+      decisionCountMap(withMap), n1(withN1), n0(withN0) {
+    }
+    void operator()(int code, float value) {
+      if(!(value > 0.5))
+        return;
+      sparse_hash_map<int, DecisionCounts>::iterator dcIt = decisionCountMap.find(code);
+      if(dcIt == decisionCountMap.end())
+        return;
+      dcIt->second.c1p += n1;
+      dcIt->second.c0p += n0;
+    }
+  };
 
-        advanceToNext();
-      }
+  template <class Store>
+  struct GoesNegative {
+    const Store& store;
+    int code;
+    GoesNegative(const Store& withStore, int withCode) : store(withStore), code(withCode) {
+    }
+    bool operator()(typename Store::Item s) const {
+      return !(store.value(s, code) > 0.5);
+    }
+  };
 
-      return s;
+  // samples sharing their features are counted once, by how many of them there are by class. y of
+  // 0.5 is 1 for c0 and c1 but 0 for the counters by code, as when counting samples one by one
+  template <class Item>
+  struct FeatureGroup {
+    Item item;
+    unsigned int n0;    // y < 0.5
+    unsigned int nHalf; // y == 0.5
+    unsigned int n1;    // y > 0.5
+    FeatureGroup(Item withItem) : item(withItem), n0(0), nHalf(0), n1(0) {
+    }
+    void count(float y) {
+      if(y > 0.5)
+        ++n1;
+      else if(y >= 0.5)
+        ++nHalf;
+      else
+        ++n0;
     }
   };
 
-  // samples
-  static void setupLeafFromSamples(DecisionTreeLeaf* dt) {
-    // FIXME: probably done already as we can only call this on a leaf
-    dt->code = -1;
+  template <class Store>
+  static void groupByFeatures(const Store& store, const typename Store::Item* begin, const typename Store::Item* end,
+                              vector<FeatureGroup<typename Store::Item> >& groups) {
+    for(const typename Store::Item* p = begin; p != end; ++p) {
+      groups.push_back(FeatureGroup<typename Store::Item>(*p));
+      groups.back().count(store.y(*p));
+    }
+  }
 
-    computeDecisionCounters(dt,
-                            TreeSampleWalker(dt),
-                            dt->decisionCountMap,
-                            dt->c0,
-                            dt->c1,
-                            dt->minValidRank);
-    updateValue(dt);
+  // by their interned features, in the order first seen
+  static void groupByFeatures(const SamplePointers& store, Sample* const* begin, Sample* const* end,
+                              vector<FeatureGroup<Sample*> >& groups) {
+    sparse_hash_map<const StoredCodes*, size_t> groupOf;
+    for(Sample* const* p = begin; p != end; ++p) {
+      Sample* s = *p;
+      if(!s->stored) {
+        groups.push_back(FeatureGroup<Sample*>(s));
+        groups.back().count(store.y(s));
+        continue;
+      }
+      sparse_hash_map<const StoredCodes*, size_t>::iterator itG = groupOf.find(s->stored);
+      if(itG == groupOf.end()) {
+        itG = groupOf.insert(make_pair(s->stored, groups.size())).first;
+        groups.push_back(FeatureGroup<Sample*>(s));
+      }
+      groups[itG->second].count(store.y(s));
+    }
   }
 
-  static void computeDecisionCounters(DecisionTreeNode* dt,
-                                      const TreeSampleWalker& origSW,
+  template <class Store>
+  static void computeDecisionCounters(const ForestConfig& config,
+                                      DecisionTreeNode* dt,
+                                      const Store& store,
+                                      const typename Store::Item* begin,
+                                      const typename Store::Item* end,
                                       sparse_hash_map<int, DecisionCounts>& decisionCountMap,
                                       unsigned int& outC0,
                                       unsigned int& outC1,
@@ -428,88 +738,103 @@ namespace IncrementalRandomForest {
 
     minValidRank = make_pair(0U, 0);
 
-    set<int> usedCodes;
-    TreeSampleWalker sw2 = origSW;
-    findUsedCodes(sw2, usedCodes);
+    vector<FeatureGroup<typename Store::Item> > groups;
+    groupByFeatures(store, begin, end, groups);
 
-    set<int>::const_iterator ucIt;
+    vector<int> usedCodes;
+    CodeCollector collector(usedCodes);
 
     int c0 = 0;
     int c1 = 0;
 
-    vector<Sample*>::const_iterator sIt;
-
-    decisionCountMap.clear();
-
-    for(TreeSampleWalker sw = origSW; sw.stillSome();) {
-      Sample* s = sw.get();
-      bool classIn = s->y >= 0.5;
-      if(classIn)
-        ++c1;
-      else
-        ++c0;
+    typename vector<FeatureGroup<typename Store::Item> >::const_iterator gIt;
+    for(gIt = groups.begin(); gIt != groups.end(); ++gIt) {
+      store.visitCodes(gIt->item, collector);
+      c1 += gIt->nHalf + gIt->n1;
+      c0 += gIt->n0;
     }
+    sort(usedCodes.begin(), usedCodes.end());
+    usedCodes.erase(unique(usedCodes.begin(), usedCodes.end()), usedCodes.end());
     outC0 = c0;
     outC1 = c1;
 
+    decisionCountMap.clear();
+
     set<pair<CodeRankType, int> > ranks;
+    vector<int>::const_iterator ucIt;
     for(ucIt = usedCodes.begin(); ucIt != usedCodes.end(); ++ucIt) {
       const int code = *ucIt;
       CodeRankType rank = codeRankInNode(code, dt->id);
       ranks.insert(make_pair(rank, code));
-      if(ranks.size() > maxCodesToKeep) {
+      if(ranks.size() > config.maxCodesToKeep) {
         minValidRank = max(minValidRank, make_pair(ranks.begin()->first, code + 1));
         ranks.erase(ranks.begin());
       }
     }
 
     set<pair<CodeRankType, int> >::const_iterator rIt;
-    for(rIt = ranks.begin(); rIt != ranks.end(); ++rIt) {
-      const int code = rIt->second;
-      DecisionCounts& dc = decisionCountMap[code];
-      dc.rank = codeRankInNode(code, dt->id);
-      for(TreeSampleWalker sw=origSW; sw.stillSome();) {
-        Sample* s = sw.get();
-        bool classIn = s->y > 0.5;
+    for(rIt = ranks.begin(); rIt != ranks.end(); ++rIt)
+      decisionCountMap[rIt->second].rank = rIt->first;
 
-        map<int, float>::const_iterator itCodeInS = s->xCodes.find(code);
-        bool hasCode = itCodeInS != s->xCodes.end() && itCodeInS->second > 0.5;
-
-        if(classIn) {
-          if(hasCode) {
-            ++(dc.c1p);
-          }
-        } else {
-          if(hasCode) {
-            ++(dc.c0p);
-          }
-        }
-      }
+    // all kept codes counted in a single pass over the samples
+    for(gIt = groups.begin(); gIt != groups.end(); ++gIt) {
+      CodeCounter counter(decisionCountMap, gIt->n1, gIt->n0 + gIt->nHalf);
+      store.visitCodes(gIt->item, counter);
     }
   }
 
-  static DecisionTreeNode* splitLeafIfPossible(TreeState& ts, DecisionTreeNode* dt) {
-    float currentEntropy = entropyBinary(dt->c0, dt->c1);
-    int minEntropyCode = findMinEntropyCode(currentEntropy, dt);
+  // samples
+  template <class Store>
+  static void setupLeafFromSamples(const ForestConfig& config, DecisionTreeLeaf* dt, const Store& store, const typename Store::Item* begin, const typename Store::Item* end) {
+    // FIXME: probably done already as we can only call this on a leaf
+    dt->code = -1;
+
+    computeDecisionCounters(config,
+                            dt,
+                            store,
+                            begin,
+                            end,
+                            dt->decisionCountMap,
+                            dt->c0,
+                            dt->c1,
+                            dt->minValidRank);
+    updateValue(dt);
+  }
 
+  template <class Store>
+  static void splitNode(TreeState& ts, DecisionTreeInternal* dt, unsigned int depth, int minEntropyCode, const Store& store, typename Store::Item* begin, typename Store::Item* end);
+
+  // takes the samples in range if staying a leaf
+  template <class Store>
+  static DecisionTreeNode* splitLeafIfPossible(TreeState& ts, DecisionTreeLeaf* dt, unsigned int depth, int minEntropyCode, const Store& store, typename Store::Item* begin, typename Store::Item* end) {
     bool shouldBeSplit = minEntropyCode != -1;
 
     if(shouldBeSplit) {
-      TreeSampleWalker sw(dt);
       DecisionTreeInternal* newInternal = makeInternal(ts, minEntropyCode, 0, 0);
       newInternal->c0 = dt->c0;
       newInternal->c1 = dt->c1;
       newInternal->minValidRank = dt->minValidRank;
       newInternal->decisionCountMap = dt->decisionCountMap;
       newInternal->id = dt->id;
-      splitNode(ts, newInternal, minEntropyCode, sw);
+      splitNode(ts, newInternal, depth, minEntropyCode, store, begin, end);
       destroyDecisionTreeNode(dt);
       return newInternal;
-    } else
+    } else {
+      dt->samples.clear();
+      dt->samples.reserve(end - begin);
+      for(const typename Store::Item* p = begin; p != end; ++p)
+        dt->samples.push_back(store.sample(*p));
       return dt;
+    }
+  }
+
+  template <class Store>
+  static DecisionTreeNode* splitLeafIfPossible(TreeState& ts, DecisionTreeLeaf* dt, unsigned int depth, const Store& store, typename Store::Item* begin, typename Store::Item* end) {
+    return splitLeafIfPossible(ts, dt, depth, findSplitCode(ts, dt, depth), store, begin, end);
   }
 
-  static void splitNode(TreeState& ts, DecisionTreeInternal* dt, int minEntropyCode, SampleWalker& sw) {
+  template <class Store>
+  static void splitNode(TreeState& ts, DecisionTreeInternal* dt, unsigned int depth, int minEntropyCode, const Store& store, typename Store::Item* begin, typename Store::Item* end) {
     DecisionTreeLeaf* dtn = makeLeaf(ts, 0);
     DecisionTreeLeaf* dtp = makeLeaf(ts, 0);
 
@@ -518,10 +843,10 @@ namespace IncrementalRandomForest {
       exit(1);
     }
 
-    splitListAgainstCode(sw, minEntropyCode, dtn->samples, dtp->samples);
+    typename Store::Item* middle = stable_partition(begin, end, GoesNegative<Store>(store, minEntropyCode));
 
-    setupLeafFromSamples(dtn);
-    setupLeafFromSamples(dtp);
+    setupLeafFromSamples(*ts.config, dtn, store, begin, middle);
+    setupLeafFromSamples(*ts.config, dtp, store, middle, end);
 
     if(dt->negative) {
       // resplit
@@ -536,26 +861,119 @@ namespace IncrementalRandomForest {
 
     dt->code = minEntropyCode;
 
-    dt->negative = splitLeafIfPossible(ts, dt->negative);
-    dt->positive = splitLeafIfPossible(ts, dt->positive);
+    dt->negative = splitLeafIfPossible(ts, dtn, depth + 1, store, begin, middle);
+    dt->positive = splitLeafIfPossible(ts, dtp, depth + 1, store, middle, end);
+  }
+
+  // all samples under a node, in leaf order
+  static void collectRecursive(DecisionTreeNode* dt, vector<Sample*>& v) {
+    DecisionTreeInternal *ni;
+    DecisionTreeLeaf* nl;
+    if(dt->checkType(&ni, &nl)) {
+      copy(nl->samples.begin(), nl->samples.end(), back_inserter(v));
+    } else {
+      collectRecursive(ni->negative, v);
+      collectRecursive(ni->positive, v);
+    }
+  }
+
+  static Sample** beginOf(vector<Sample*>& v) {
+    return v.empty() ? 0 : &v[0];
+  }
+
+  static Sample** endOf(vector<Sample*>& v) {
+    return beginOf(v) + v.size();
+  }
+
+  // before a subtree is scanned, the pages of a sample file holding the features of its
+  // samples are asked for in as few ranges as possible, so that they are read ahead
+  static void prefetchSamples(const vector<Sample*>& v) {
+    static const uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    vector<pair<uintptr_t, uintptr_t> > ranges;
+    for(vector<Sample*>::const_iterator it = v.begin(); it != v.end(); ++it) {
+      const StoredCodes* sc = (*it)->stored;
+      if(!sc)
+        continue;
+      uintptr_t first = (uintptr_t) sc & ~(pageSize - 1);
+      uintptr_t last = ((uintptr_t) sc + sc->size() + pageSize - 1) & ~(pageSize - 1);
+      ranges.push_back(make_pair(first, last));
+    }
+    if(ranges.empty())
+      return;
+    sort(ranges.begin(), ranges.end());
+    pair<uintptr_t, uintptr_t> current = ranges[0];
+    for(size_t i = 1; i <= ranges.size(); ++i) {
+      if(i < ranges.size() && ranges[i].first <= current.second) {
+        current.second = max(current.second, ranges[i].second);
+        continue;
+      }
+      madvise((void*) current.first, current.second - current.first, MADV_WILLNEED);
+      if(i < ranges.size())
+        current = ranges[i];
+    }
   }
 
-  static void updateDecisionCounters(DecisionTreeNode* dt, Sample* s, int addedBefore0, int addedBefore1, int direction = 1) {
+  // codes of an added sample the node has no counters for yet, counted if they rank high enough
+  struct NewCodeCounter {
+    const ForestConfig& config;
+    DecisionTreeNode* dt;
+    bool classIn;
+    set<pair<CodeRankType, int> >& ranks;
+    NewCodeCounter(const ForestConfig& withConfig, DecisionTreeNode* withDt, bool withClassIn, set<pair<CodeRankType, int> >& withRanks) :
+      config(withConfig), dt(withDt), classIn(withClassIn), ranks(withRanks) {
+    }
+    void operator()(int code, float value) {
+      sparse_hash_map<int, DecisionCounts>::iterator dcIt = dt->decisionCountMap.find(code);
+      if(dcIt != dt->decisionCountMap.end())
+        return;
+
+      CodeRankType newRank = codeRankInNode(code, dt->id);
+
+      bool doInsert = make_pair(newRank, code) >= dt->minValidRank;
+
+      if(doInsert) {
+        dcIt = dt->decisionCountMap.insert(make_pair(code, DecisionCounts())).first;
+        DecisionCounts& dc = dcIt->second;
+        dc.rank = newRank;
+
+        if(classIn) {
+          if(value >= 0.5) {
+            ++(dc.c1p);
+          }
+        } else {
+          if(value >= 0.5) {
+            ++(dc.c0p);
+          }
+        }
+
+        ranks.insert(make_pair(dc.rank, code));
+
+        if(ranks.size() > config.maxCodesToKeep) {
+          int toDrop = ranks.begin()->second;
+          dt->minValidRank = max(dt->minValidRank, make_pair(ranks.begin()->first, ranks.begin()->second + 1));
+          ranks.erase(ranks.begin());
+          dt->decisionCountMap.erase(toDrop);
+        }
+      }
+    }
+  };
+
+  static void updateDecisionCounters(const ForestConfig& config, DecisionTreeNode* dt, Sample* s, int addedBefore0, int addedBefore1, int direction = 1) {
     sparse_hash_map<int, DecisionCounts>::iterator dcIt;
     for(dcIt = dt->decisionCountMap.begin(); dcIt != dt->decisionCountMap.end();) {
       const int code = dcIt->first;
       DecisionCounts& dc = dcIt->second;
-      map<int, float>::const_iterator codeIt = s->xCodes.find(code);
-      if(codeIt == s->xCodes.end()) {
+      float value;
+      if(!findCode(s, code, value)) {
         // code not used in sample
       } else {
         // code used in sample
         if(s->y >= 0.5) {
-          if(codeIt->second >= 0.5) {
+          if(value >= 0.5) {
             (dc.c1p) += direction;
           }
         } else {
-          if(codeIt->second >= 0.5) {
+          if(value >= 0.5) {
             (dc.c0p) += direction;
           }
         }
@@ -577,41 +995,8 @@ namespace IncrementalRandomForest {
     for(dcIt = dt->decisionCountMap.begin(); dcIt != dt->decisionCountMap.end(); ++dcIt)
       ranks.insert(make_pair(dcIt->second.rank, dcIt->first));
 
-    map<int, float>::const_iterator codeIt;
-    for(codeIt = s->xCodes.begin(); codeIt != s->xCodes.end(); ++codeIt) {
-      sparse_hash_map<int, DecisionCounts>::iterator dcIt = dt->decisionCountMap.find(codeIt->first);
-      if(dcIt == dt->decisionCountMap.end()) {
-
-        CodeRankType newRank = codeRankInNode(codeIt->first, dt->id);
-
-        bool doInsert = make_pair(newRank, codeIt->first) >= dt->minValidRank;
-
-        if(doInsert) {
-          dcIt = dt->decisionCountMap.insert(make_pair(codeIt->first, DecisionCounts())).first;
-          DecisionCounts& dc = dcIt->second;
-          dc.rank = newRank;
-
-          if(s->y >= 0.5) {
-            if(codeIt->second >= 0.5) {
-              (dc.c1p) += direction;
-            }
-          } else {
-            if(codeIt->second >= 0.5) {
-              (dc.c0p) += direction;
-            }
-          }
-
-          ranks.insert(make_pair(dc.rank, codeIt->first));
-
-          if(ranks.size() > maxCodesToKeep) {
-            int toDrop = ranks.begin()->second;
-            dt->minValidRank = max(dt->minValidRank, make_pair(ranks.begin()->first, ranks.begin()->second + 1));
-            ranks.erase(ranks.begin());
-            dt->decisionCountMap.erase(toDrop);
-          }
-        }
-      }
-    }
+    NewCodeCounter counter(config, dt, s->y >= 0.5, ranks);
+    visitSampleCodes(s, counter);
   }
 
   static void printDCs(const sparse_hash_map<int, DecisionCounts>& dc, DecisionTreeNode* dt) {
@@ -627,21 +1012,22 @@ namespace IncrementalRandomForest {
   }
 
   static void printNodeSamples(DecisionTreeNode* dt) {
-    TreeSampleWalker sw(dt);
-    while(sw.stillSome()) {
-      printSample(cerr, sw.get());
-    }
+    vector<Sample*> v;
+    collectRecursive(dt, v);
+    for(vector<Sample*>::const_iterator it = v.begin(); it != v.end(); ++it)
+      printSample(cerr, *it);
   }
 
-  static bool compareDCsDir(const sparse_hash_map<int, DecisionCounts>& dcM1,
+  static bool compareDCsDir(const ForestConfig& config,
+                            const sparse_hash_map<int, DecisionCounts>& dcM1,
                             const sparse_hash_map<int, DecisionCounts>& dcM2,
                             DecisionTreeNode* dt,
                             const char* tag1,
                             const char* tag2) {
     bool valid = true;
 
-    pair<CodeRankType, int> minR1 = findMinRankToConsider(dcM1);
-    pair<CodeRankType, int> minR2 = findMinRankToConsider(dcM2);
+    pair<CodeRankType, int> minR1 = findMinRankToConsider(dcM1, config.maxCodesToConsider);
+    pair<CodeRankType, int> minR2 = findMinRankToConsider(dcM2, config.maxCodesToConsider);
 
     sparse_hash_map<int, DecisionCounts>::const_iterator itDC;
 
@@ -689,55 +1075,25 @@ namespace IncrementalRandomForest {
     return valid;
   }
 
-  static bool compareDCs(const sparse_hash_map<int, DecisionCounts>& dcM1,
+  static bool compareDCs(const ForestConfig& config,
+                         const sparse_hash_map<int, DecisionCounts>& dcM1,
                          const sparse_hash_map<int, DecisionCounts>& dcM2,
                          DecisionTreeNode* dt,
                          const char* tag1,
                          const char* tag2) {
     bool valid = true;
 
-    if(!compareDCsDir(dcM1, dcM2, dt, tag1, tag2))
+    if(!compareDCsDir(config, dcM1, dcM2, dt, tag1, tag2))
       valid = false;
-    if(!compareDCsDir(dcM2, dcM1, dt, tag2, tag1))
+    if(!compareDCsDir(config, dcM2, dcM1, dt, tag2, tag1))
       valid = false;
 
     return valid;
   }
 
-  static void insertLeafSamples(vector<Sample*>& v, SampleWalker& sw) {
-    while(sw.stillSome())
-      v.push_back(sw.get());
-  }
+  static bool validateDecisionTree(TreeState& ts, DecisionTreeNode* dt) {
 
-  static void collectRecursive(DecisionTreeNode* dt, vector<Sample*>& v) {
-    DecisionTreeInternal *ni;
-    DecisionTreeLeaf* nl;
-    if(dt->checkType(&ni, &nl)) {
-      copy(nl->samples.begin(), nl->samples.end(), back_inserter(v));
-    } else {
-      collectRecursive(ni->negative, v);
-      collectRecursive(ni->positive, v);
-    }
-  }
-
-  static bool validateWalker(DecisionTreeNode* dt) {
-    vector<Sample*> vRec;
-    collectRecursive(dt, vRec);
-    vector<Sample*> vWalker;
-    TreeSampleWalker sw(dt);
-    while(sw.stillSome())
-      vWalker.push_back(sw.get());
-    if(vWalker != vRec) {
-      cerr << "ERROR: vWalker != vRec" << endl;
-      return false;
-    } else {
-      return true;
-    }
-  }
-
-  static bool validateDecisionTree(TreeState& ts, DecisionTreeNode* dt) {
-
-    bool valid = true;
+    bool valid = true;
 
     DecisionTreeInternal* ni;
     DecisionTreeLeaf* nl;
@@ -745,22 +1101,15 @@ namespace IncrementalRandomForest {
 
     // make sure there are no multiple versions of the same post
 
-    if(!validateWalker(dt))
-      valid = false;
-
     if(nl) {
       vector<Sample*>::const_iterator itS;
-      map<string, Sample*> suidMap;
+      set<SampleId> ids;
       for(itS = nl->samples.begin(); itS != nl->samples.end(); ++itS) {
-        Sample* s = *itS;
-        const string& suid = s->suid;
-
-        map<string, Sample*>::const_iterator itSS = suidMap.find(suid);
-        if(itSS != suidMap.end()) {
-          cerr << "ERROR: multiple occurances of post " << suid << endl;
+        SampleId id(*itS);
+        if(!ids.insert(id).second) {
+          cerr << "ERROR: multiple occurances of post " << id << endl;
           valid = false;
         }
-        suidMap[s->suid] = s;
       }
     }
 
@@ -808,17 +1157,18 @@ namespace IncrementalRandomForest {
       }
     }
 
-    // validate counters against samples
+    // validate counters against samples, unless dropped under the memory budget
 
-    {
+    if(!dt->countsEvicted) {
       sparse_hash_map<int, DecisionCounts> computedDCs;
       unsigned int computedC0, computedC1;
       pair<CodeRankType, int> computedMinValidRank;
 
       // FIXME: validate minValidRank
 
-      TreeSampleWalker sw(dt);
-      computeDecisionCounters(dt, sw, computedDCs, computedC0, computedC1 ,computedMinValidRank);
+      vector<Sample*> below;
+      collectRecursive(dt, below);
+      computeDecisionCounters(*ts.config, dt, SamplePointers(), beginOf(below), endOf(below), computedDCs, computedC0, computedC1 ,computedMinValidRank);
       if(computedC0 != dt->c0) {
         cerr << "ERROR: c0 != computedC0 : " << dt->c0 << " != " << computedC0 << endl;
         valid = false;
@@ -827,7 +1177,7 @@ namespace IncrementalRandomForest {
         cerr << "ERROR: c1 != computedC1 : " << dt->c1 << " != " << computedC1 << endl;
         valid = false;
       }
-      if(!compareDCs(dt->decisionCountMap, computedDCs, dt, "stored", "computed")) {
+      if(!compareDCs(*ts.config, dt->decisionCountMap, computedDCs, dt, "stored", "computed")) {
         cerr << "bang bang bang" << endl;
         cerr << "dt = " << (long) dt << endl;
         cerr << "minValidRank = " << dt->minValidRank.first << " , " << dt->minValidRank.second << endl;
@@ -842,7 +1192,9 @@ namespace IncrementalRandomForest {
 
       sparse_hash_map<int, DecisionCounts>::const_iterator itDC;
       itDC = dt->decisionCountMap.find(dt->code);
-      if(itDC != dt->decisionCountMap.end()) {
+      if(dt->countsEvicted) {
+        // nothing to check the children against
+      } else if(itDC != dt->decisionCountMap.end()) {
         const DecisionCounts& dc = itDC->second;
 
         const unsigned int c0n = dt->c0 - dc.c0p;
@@ -916,12 +1268,10 @@ namespace IncrementalRandomForest {
     // how to avoid the duplicate work?
     if(ni) {
       vector<Sample*> aN, aP;
-      VectorSampleWalker swAdd(batchAdd);
-      splitListAgainstCode(swAdd, ni->code, aN, aP);
+      splitListAgainstCode(batchAdd.begin(), batchAdd.end(), ni->code, aN, aP);
 
       vector<Sample*> rN, rP;
-      VectorSampleWalker swRemove(batchRemove);
-      splitListAgainstCode(swRemove, ni->code, rN, rP);
+      splitListAgainstCode(batchRemove.begin(), batchRemove.end(), ni->code, rN, rP);
 
       if(aN.size() > 0 || rN.size() > 0)
         updateDecisionTreeSamples(ni->negative, aN, rN);
@@ -932,71 +1282,92 @@ namespace IncrementalRandomForest {
     }
   }
 
-  static DecisionTreeNode* updateDecisionTreeNode(TreeState& ts, DecisionTreeNode* dt, const vector<Sample*>& batchAdd, const vector<Sample*>& batchRemove) {
-    DecisionTreeInternal* ni;
-    DecisionTreeLeaf* nl;
-
-    dt->checkType(&ni, &nl);
-
-    {
-      // removals
-
-      vector<Sample*>::const_iterator bIt;
-      int addedBefore0 = 0;
-      int addedBefore1 = 0;
-      for(bIt = batchRemove.begin(); bIt != batchRemove.end(); ++bIt) {
-        updateDecisionCounters(dt, *bIt, addedBefore0, addedBefore1, -1);
-        if((*bIt)->y >= 0.5)
-          ++addedBefore1;
-        else
-          ++addedBefore0;
-      }
+  // with hysteresis configured, an internal node keeps its split while another code is only
+  // marginally better, until that code has been the best for splitPatience updates in a row
+  static bool keepSplit(TreeState& ts, DecisionTreeInternal* ni, int minEntropyCode) {
+    const ForestConfig& config = *ts.config;
+    if(config.splitMargin == 0 && config.splitPatience == 0)
+      return false;
 
-      vector<Sample*> b0, b1;
+    sparse_hash_map<int, DecisionCounts>::const_iterator current = ni->decisionCountMap.find(ni->code);
+    if(current == ni->decisionCountMap.end() ||
+       !current->second.enoughEvidence(ni, config.minEvidence) ||
+       !current->second.enoughEvidence(ni, config.minSamplesLeaf))
+      return false;
 
-      // FIXME: more efficient just to count them!
-      splitListByTarget(batchRemove, b0, b1);
+    const DecisionCounts& best = ni->decisionCountMap.find(minEntropyCode)->second;
+    // a margin of 0 is no margin rule, rather than one any better code passes
+    if(config.splitMargin > 0 && best.entropy(ni) < current->second.entropy(ni) - config.splitMargin)
+      return false;
+    if(config.splitPatience > 0 && ++ni->splitStreak >= config.splitPatience)
+      return false;
 
-      (dt->c1) += -1 * b1.size();
-      (dt->c0) += -1 * b0.size();
+    ++ts.counters.resplitsHeld;
+    return true;
+  }
 
-    }
+  // counters dropped under the memory budget, computed again from the samples below as they are now
+  static void rebuildEvictedCounts(TreeState& ts, DecisionTreeNode* dt) {
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
+    dt->checkType(&ni, &nl);
 
-    {
-      // additions
+    vector<Sample*> collected;
+    vector<Sample*>& below = nl ? nl->samples : collected;
+    if(ni)
+      collectRecursive(dt, collected);
+    prefetchSamples(below);
+    computeDecisionCounters(*ts.config,
+                            dt,
+                            SamplePointers(),
+                            beginOf(below),
+                            endOf(below),
+                            dt->decisionCountMap,
+                            dt->c0,
+                            dt->c1,
+                            dt->minValidRank);
+    dt->countsEvicted = false;
+    ++ts.counters.countsRebuilt;
+  }
 
-      vector<Sample*>::const_iterator bIt;
-      int addedBefore0 = 0;
-      int addedBefore1 = 0;
-      for(bIt = batchAdd.begin(); bIt != batchAdd.end(); ++bIt) {
-        updateDecisionCounters(dt, *bIt, addedBefore0, addedBefore1);
-        if((*bIt)->y >= 0.5)
-          ++addedBefore1;
-        else
-          ++addedBefore0;
-      }
+  // once codes have been passed over by rank, dropping others can leave too few to choose a split
+  // from, and then all are counted again from the samples below
+  static void refillDecisionCounters(TreeState& ts, DecisionTreeNode* dt) {
+    if((dt->decisionCountMap.size() >= ts.config->maxCodesToConsider)
+       || ((dt->minValidRank.first == 0) && (dt->minValidRank.second == 0)))
+      return;
 
-      vector<Sample*> b0, b1;
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
+    dt->checkType(&ni, &nl);
 
-      // FIXME: more efficient just to count them!
-      splitListByTarget(batchAdd, b0, b1);
+    vector<Sample*> collected;
+    vector<Sample*>& below = nl ? nl->samples : collected;
+    if(ni)
+      collectRecursive(dt, collected);
+    prefetchSamples(below);
+    computeDecisionCounters(*ts.config,
+                            dt,
+                            SamplePointers(),
+                            beginOf(below),
+                            endOf(below),
+                            dt->decisionCountMap,
+                            dt->c0,
+                            dt->c1,
+                            dt->minValidRank);
+  }
 
-      (dt->c1) += b1.size();
-      (dt->c0) += b0.size();
-    }
+  // once a node's counters are up to date: a leaf is split or has its value updated, and an internal
+  // node becomes a leaf, has its subtree rebuilt on another code or, when it keeps its split, is
+  // returned with descend set for the caller to carry on into its children
+  static DecisionTreeNode* decideSplit(TreeState& ts, DecisionTreeNode* dt, unsigned int depth, bool& descend) {
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
 
-    if((dt->decisionCountMap.size() < maxCodesToConsider)
-       && ((dt->minValidRank.first != 0) || (dt->minValidRank.second != 0))) {
-      computeDecisionCounters(dt,
-                              TreeSampleWalker(dt),
-                              dt->decisionCountMap,
-                              dt->c0,
-                              dt->c1,
-                              dt->minValidRank);
-    }
+    dt->checkType(&ni, &nl);
+    descend = false;
 
-    float currentEntropy = entropyBinary(dt->c0, dt->c1);
-    int minEntropyCode = findMinEntropyCode(currentEntropy, dt);
+    int minEntropyCode = findSplitCode(ts, dt, depth);
 
     bool shouldBeSplit = minEntropyCode != -1;
 
@@ -1013,8 +1384,7 @@ namespace IncrementalRandomForest {
         newInternal->minValidRank = dt->minValidRank;
         newInternal->decisionCountMap = dt->decisionCountMap;
         newInternal->id = dt->id;
-        VectorSampleWalker sw(nl->samples);
-        splitNode(ts, newInternal, minEntropyCode, sw);
+        splitNode(ts, newInternal, depth, minEntropyCode, SamplePointers(), beginOf(nl->samples), endOf(nl->samples));
 
         destroyDecisionTreeNode(nl);
 
@@ -1033,42 +1403,115 @@ namespace IncrementalRandomForest {
         DecisionTreeLeaf* newLeaf = makeLeaf(ts, 0);
         newLeaf->id = dt->id;
 
-        TreeSampleWalker sw(dt);
-
-        insertLeafSamples(newLeaf->samples, sw);
+        collectRecursive(dt, newLeaf->samples);
+        prefetchSamples(newLeaf->samples);
 
-        setupLeafFromSamples(newLeaf);
+        setupLeafFromSamples(*ts.config, newLeaf, SamplePointers(), beginOf(newLeaf->samples), endOf(newLeaf->samples));
 
         destroyDecisionTreeNode(dt);
 
         return newLeaf;
       } else {
 
-        if(minEntropyCode != ni->code) {
-          TreeSampleWalker sw(dt);
-          splitNode(ts, ni, minEntropyCode, sw);
-        } else {
-          vector<Sample*> aN, aP;
-          VectorSampleWalker swAdd(batchAdd);
+        if(minEntropyCode == ni->code)
+          ni->splitStreak = 0;
 
-          splitListAgainstCode(swAdd, ni->code, aN, aP);
+        if(minEntropyCode != ni->code && !keepSplit(ts, ni, minEntropyCode)) {
+          vector<Sample*> below;
+          collectRecursive(dt, below);
+          prefetchSamples(below);
+          ++ts.counters.resplits;
+          ts.counters.resplitSamples += below.size();
+          ni->splitStreak = 0;
+          splitNode(ts, ni, depth, minEntropyCode, SamplePointers(), beginOf(below), endOf(below));
+        } else
+          descend = true;
 
-          vector<Sample*> rN, rP;
-          VectorSampleWalker swRemove(batchRemove);
+        return dt;
+      }
+    }
+  }
 
-          splitListAgainstCode(swRemove, ni->code, rN, rP);
+  static DecisionTreeNode* updateDecisionTreeNode(TreeState& ts, DecisionTreeNode* dt, unsigned int depth, const vector<Sample*>& batchAdd, const vector<Sample*>& batchRemove) {
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
 
-          if(aN.size() > 0 || rN.size() > 0) {
-            ni->negative = updateDecisionTreeNode(ts, ni->negative, aN, rN);
-          }
-          if(aP.size() > 0 || rP.size() > 0) {
-            ni->positive = updateDecisionTreeNode(ts, ni->positive, aP, rP);
-          }
+    dt->checkType(&ni, &nl);
+
+    reachNode(ts, dt);
+    ++ts.counters.nodeUpdates;
+
+    if(dt->countsEvicted) {
+      // with the batch already in
+      rebuildEvictedCounts(ts, dt);
+    } else {
+      {
+        // removals
+
+        vector<Sample*>::const_iterator bIt;
+        int addedBefore0 = 0;
+        int addedBefore1 = 0;
+        for(bIt = batchRemove.begin(); bIt != batchRemove.end(); ++bIt) {
+          updateDecisionCounters(*ts.config, dt, *bIt, addedBefore0, addedBefore1, -1);
+          if((*bIt)->y >= 0.5)
+            ++addedBefore1;
+          else
+            ++addedBefore0;
         }
 
-        return dt;
+        vector<Sample*> b0, b1;
+
+        // FIXME: more efficient just to count them!
+        splitListByTarget(batchRemove, b0, b1);
+
+        (dt->c1) += -1 * b1.size();
+        (dt->c0) += -1 * b0.size();
+
+      }
+
+      {
+        // additions
+
+        vector<Sample*>::const_iterator bIt;
+        int addedBefore0 = 0;
+        int addedBefore1 = 0;
+        for(bIt = batchAdd.begin(); bIt != batchAdd.end(); ++bIt) {
+          updateDecisionCounters(*ts.config, dt, *bIt, addedBefore0, addedBefore1);
+          if((*bIt)->y >= 0.5)
+            ++addedBefore1;
+          else
+            ++addedBefore0;
+        }
+
+        vector<Sample*> b0, b1;
+
+        // FIXME: more efficient just to count them!
+        splitListByTarget(batchAdd, b0, b1);
+
+        (dt->c1) += b1.size();
+        (dt->c0) += b0.size();
+      }
+    }
+
+    refillDecisionCounters(ts, dt);
+
+    bool descend;
+    DecisionTreeNode* n = decideSplit(ts, dt, depth, descend);
+    if(descend) {
+      vector<Sample*> aN, aP;
+      splitListAgainstCode(batchAdd.begin(), batchAdd.end(), ni->code, aN, aP);
+
+      vector<Sample*> rN, rP;
+      splitListAgainstCode(batchRemove.begin(), batchRemove.end(), ni->code, rN, rP);
+
+      if(aN.size() > 0 || rN.size() > 0) {
+        ni->negative = updateDecisionTreeNode(ts, ni->negative, depth + 1, aN, rN);
+      }
+      if(aP.size() > 0 || rP.size() > 0) {
+        ni->positive = updateDecisionTreeNode(ts, ni->positive, depth + 1, aP, rP);
       }
     }
+    return n;
   }
 
   static DecisionTreeNode* updateDecisionTree(TreeState& ts, DecisionTreeNode* dt, const vector<Sample*>& batchAdd, const vector<Sample*>& batchRemove) {
@@ -1088,14 +1531,390 @@ namespace IncrementalRandomForest {
       }
     }
 
+    startReaching(ts);
     updateDecisionTreeSamples(dt, batchAdd, batchRemove);
-    DecisionTreeNode* n = updateDecisionTreeNode(ts, dt, batchAdd, batchRemove);
+    DecisionTreeNode* n = updateDecisionTreeNode(ts, dt, 0, batchAdd, batchRemove);
+    return n;
+  }
+
+  // as counted by updateDecisionCounters: the codes the sample has move over to its new class
+  static void relabelDecisionCounters(DecisionTreeNode* dt, Sample* s, int deltaC1) {
+    sparse_hash_map<int, DecisionCounts>::iterator dcIt;
+    for(dcIt = dt->decisionCountMap.begin(); dcIt != dt->decisionCountMap.end(); ++dcIt) {
+      float value;
+      if(findCode(s, dcIt->first, value) && value >= 0.5) {
+        DecisionCounts& dc = dcIt->second;
+        dc.c1p += deltaC1;
+        dc.c0p -= deltaC1;
+      }
+    }
+  }
+
+  // a sample already in the tree has had its label changed from oldY. as routing depends only on
+  // features, only the nodes on its path have their counters changed and a better split looked for
+  static DecisionTreeNode* relabelDecisionTreeNode(TreeState& ts, DecisionTreeNode* dt, unsigned int depth, Sample* s, float oldY) {
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
+
+    dt->checkType(&ni, &nl);
+
+    reachNode(ts, dt);
+    ++ts.counters.nodeUpdates;
+
+    if(dt->countsEvicted)
+      rebuildEvictedCounts(ts, dt);
+    else {
+      int deltaC1 = (s->y > 0.5) - (oldY > 0.5);
+      dt->c1 += deltaC1;
+      dt->c0 -= deltaC1;
+      relabelDecisionCounters(dt, s, (s->y >= 0.5) - (oldY >= 0.5));
+    }
+
+    bool descend;
+    DecisionTreeNode* n = decideSplit(ts, dt, depth, descend);
+    if(descend) {
+      float value;
+      if(findCode(s, ni->code, value) && value > 0.5)
+        ni->positive = relabelDecisionTreeNode(ts, ni->positive, depth + 1, s, oldY);
+      else
+        ni->negative = relabelDecisionTreeNode(ts, ni->negative, depth + 1, s, oldY);
+    }
+    return n;
+  }
+
+  static DecisionTreeNode* relabelDecisionTree(TreeState& ts, DecisionTreeNode* dt, Sample* s, float oldY) {
+    startReaching(ts);
+    return relabelDecisionTreeNode(ts, dt, 0, s, oldY);
+  }
+
+  // as updateDecisionCounters would take the sample off as it was and count it again as it is,
+  // for just the patched codes, as the counters of all others would come out the same
+  static void patchDecisionCounters(const ForestConfig& config, DecisionTreeNode* dt, const Sample* before, Sample* s, const vector<int>& patched) {
+    vector<int> newCodes;
+    vector<int>::const_iterator it;
+    for(it = patched.begin(); it != patched.end(); ++it) {
+      float value;
+      bool isIn = findCode(s, *it, value);
+      int delta = isIn && value >= 0.5;
+      sparse_hash_map<int, DecisionCounts>::iterator dcIt = dt->decisionCountMap.find(*it);
+      if(dcIt == dt->decisionCountMap.end()) {
+        if(isIn)
+          newCodes.push_back(*it);
+        continue;
+      }
+      if(findCode(before, *it, value) && value >= 0.5)
+        --delta;
+      DecisionCounts& dc = dcIt->second;
+      if(s->y >= 0.5)
+        dc.c1p += delta;
+      else
+        dc.c0p += delta;
+      if(!isIn && dc.c0p == 0 && dc.c1p == 0)
+        dt->decisionCountMap.erase(dcIt);
+    }
+
+    if(newCodes.empty())
+      return;
+
+    set<pair<CodeRankType, int> > ranks;
+    sparse_hash_map<int, DecisionCounts>::const_iterator dcIt;
+    for(dcIt = dt->decisionCountMap.begin(); dcIt != dt->decisionCountMap.end(); ++dcIt)
+      ranks.insert(make_pair(dcIt->second.rank, dcIt->first));
+
+    NewCodeCounter counter(config, dt, s->y >= 0.5, ranks);
+    for(it = newCodes.begin(); it != newCodes.end(); ++it) {
+      float value;
+      findCode(s, *it, value);
+      counter(*it, value);
+    }
+  }
+
+  static bool goesPositive(const Sample* s, int code) {
+    float value;
+    return findCode(s, code, value) && value > 0.5;
+  }
+
+  // while a patched sample is taken out of a subtree it has the features it was put in with
+  static void swapFeatures(Sample* s1, Sample* s2) {
+    swap(s1->stored, s2->stored);
+    s1->xCodes.swap(s2->xCodes);
+  }
+
+  // a sample already in the tree has had the patched codes added, dropped or changed in value, and
+  // before has the features it had. nodes sending it the same way as before only have the counters
+  // for those codes changed, and from the first one splitting on a patched code that sends it the
+  // other way, it is removed from one subtree and added to the other as on commit
+  static DecisionTreeNode* patchDecisionTreeNode(TreeState& ts, DecisionTreeNode* dt, unsigned int depth, Sample* s, Sample* before, const vector<int>& patched) {
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
+
+    dt->checkType(&ni, &nl);
+
+    reachNode(ts, dt);
+    ++ts.counters.nodeUpdates;
+
+    DecisionTreeNode** from = 0;
+    DecisionTreeNode** to = 0;
+    vector<Sample*> none, moved(1, s);
+    if(ni && binary_search(patched.begin(), patched.end(), ni->code)) {
+      bool wasPositive = goesPositive(before, ni->code);
+      if(wasPositive != goesPositive(s, ni->code)) {
+        from = wasPositive ? &ni->positive : &ni->negative;
+        to = wasPositive ? &ni->negative : &ni->positive;
+        swapFeatures(s, before);
+        updateDecisionTreeSamples(*from, none, moved);
+        swapFeatures(s, before);
+        updateDecisionTreeSamples(*to, moved, none);
+      }
+    }
+
+    if(dt->countsEvicted)
+      rebuildEvictedCounts(ts, dt);
+    else
+      patchDecisionCounters(*ts.config, dt, before, s, patched);
+
+    refillDecisionCounters(ts, dt);
+
+    bool descend;
+    DecisionTreeNode* n = decideSplit(ts, dt, depth, descend);
+    if(descend) {
+      if(from) {
+        swapFeatures(s, before);
+        *from = updateDecisionTreeNode(ts, *from, depth + 1, none, moved);
+        swapFeatures(s, before);
+        *to = updateDecisionTreeNode(ts, *to, depth + 1, moved, none);
+      } else if(goesPositive(s, ni->code))
+        ni->positive = patchDecisionTreeNode(ts, ni->positive, depth + 1, s, before, patched);
+      else
+        ni->negative = patchDecisionTreeNode(ts, ni->negative, depth + 1, s, before, patched);
+    }
     return n;
   }
 
-  static DecisionTreeNode* loadDecisionTreeNodeForForest(TreeState& ts, istream& forestS, map<long, Sample*>& sampleMap) {
+  static DecisionTreeNode* patchDecisionTree(TreeState& ts, DecisionTreeNode* dt, Sample* s, Sample* before, const vector<int>& patched) {
+    startReaching(ts);
+    return patchDecisionTreeNode(ts, dt, 0, s, before, patched);
+  }
+
+  // links the nodes not reached since they were loaded coldest, deeper ones first as when reached
+  static void listCounted(CountedNodes* counted, DecisionTreeNode* dt) {
+    if(!dt->counted && !dt->decisionCountMap.empty()) {
+      dt->counted = new CountedEntry(dt, counted);
+      dt->counted->countsAccounted = dt->decisionCountMap.size();
+      counted->kept += dt->counted->countsAccounted;
+      dt->counted->linkAfter(&counted->ends);
+    }
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
+    if(!dt->checkType(&ni, &nl)) {
+      listCounted(counted, ni->positive);
+      listCounted(counted, ni->negative);
+    }
+  }
+
+  // drops the counters of the nodes reached longest ago, deeper ones first on ties, until
+  // the tree keeps at most budget of them
+  static void evictColdCounts(TreeState& ts, DecisionTreeNode* dt, unsigned long budget) {
+    CountedNodes* counted = ts.counted;
+    if(!counted->complete) {
+      listCounted(counted, dt);
+      counted->complete = true;
+    }
+    // the nodes reached since the last time are the warmest
+    for(CountedLink* l = counted->ends.colder; l != &counted->ends; l = l->colder) {
+      if(l == &counted->reached)
+        continue;
+      CountedEntry* e = static_cast<CountedEntry*>(l);
+      if(!e->countsStale)
+        break;
+      counted->kept = counted->kept - e->countsAccounted + e->node->decisionCountMap.size();
+      e->countsAccounted = e->node->decisionCountMap.size();
+      e->countsStale = false;
+    }
+    while(counted->kept > budget) {
+      CountedLink* l = counted->ends.warmer;
+      if(l == &counted->reached)
+        l = l->warmer;
+      DecisionTreeNode* n = static_cast<CountedEntry*>(l)->node;
+      n->uncount();
+      if(n->decisionCountMap.empty())
+        continue;
+      // swapped out rather than cleared, so that the memory is given back
+      sparse_hash_map<int, DecisionCounts> dropped;
+      dropped.set_deleted_key(-1);
+      n->decisionCountMap.swap(dropped);
+      n->countsEvicted = true;
+      ++ts.counters.countsEvicted;
+    }
+  }
+
+  // samples are referred to by their address at save time in full snapshots, by id in deltas
+  template <class K>
+  static K sampleKey(Sample* s);
+
+  template <>
+  long sampleKey<long>(Sample* s) {
+    return (long)s;
+  }
+
+  template <>
+  SampleId sampleKey<SampleId>(Sample* s) {
+    return SampleId(s);
+  }
+
+  static const char deletedSuid[] = "";
+  static const uint64_t deletedUid = 0;
+
+  struct SuidHash {
+    size_t operator()(const char* suid) const {
+      uint32_t h;
+      MurmurHash3_x86_32(suid, strlen(suid), 42, &h);
+      return h;
+    }
+  };
+
+  struct SuidEqual {
+    bool operator()(const char* suid1, const char* suid2) const {
+      if(suid1 == suid2)
+        return true;
+      if(suid1 == deletedSuid || suid2 == deletedSuid)
+        return false;
+      return strcmp(suid1, suid2) == 0;
+    }
+  };
+
+  struct UidHash {
+    size_t operator()(const uint64_t* uid) const {
+      uint32_t h;
+      MurmurHash3_x86_32(uid, sizeof(*uid), 42, &h);
+      return h;
+    }
+  };
+
+  struct UidEqual {
+    bool operator()(const uint64_t* uid1, const uint64_t* uid2) const {
+      if(uid1 == uid2)
+        return true;
+      if(uid1 == &deletedUid || uid2 == &deletedUid)
+        return false;
+      return *uid1 == *uid2;
+    }
+  };
+
+  // in SampleId order
+  static bool sampleBefore(const Sample* s1, const Sample* s2) {
+    int c = s1->suid.compare(s2->suid);
+    return c < 0 || (c == 0 && s1->uid < s2->uid);
+  }
+
+  // committed samples by suid or uid, hashed. Keys point to the ids of the samples themselves, so
+  // that they are not kept twice, and must be erased before the sample is deleted. In no particular
+  // order, sorted copies are made for whatever needs samples in id order
+  class SampleIndex {
+  private:
+    typedef sparse_hash_map<const char*, Sample*, SuidHash, SuidEqual> SuidIndex;
+    typedef sparse_hash_map<const uint64_t*, Sample*, UidHash, UidEqual> UidIndex;
+    SuidIndex bySuid;
+    UidIndex byUid;
+  public:
+    SampleIndex(void) {
+      bySuid.set_deleted_key(deletedSuid);
+      byUid.set_deleted_key(&deletedUid);
+    }
+
+    size_t size(void) const {
+      return bySuid.size() + byUid.size();
+    }
+    bool empty(void) const {
+      return bySuid.empty() && byUid.empty();
+    }
+    void swap(SampleIndex& other) {
+      bySuid.swap(other.bySuid);
+      byUid.swap(other.byUid);
+    }
+
+    // 0 if there is none
+    Sample* find(const char* suid) const {
+      SuidIndex::const_iterator it = bySuid.find(suid);
+      return it != bySuid.end() ? it->second : 0;
+    }
+    Sample* find(uint64_t uid) const {
+      UidIndex::const_iterator it = byUid.find(&uid);
+      return it != byUid.end() ? it->second : 0;
+    }
+    Sample* find(const SampleId& id) const {
+      return id.suid.empty() ? find(id.uid) : find(id.suid.c_str());
+    }
+
+    // replacing any sample with the same id, which must be deleted only after this
+    void insert(Sample* s) {
+      if(s->suid.empty()) {
+        byUid.erase(&s->uid);
+        byUid.insert(make_pair(&s->uid, s));
+      } else {
+        bySuid.erase(s->suid.c_str());
+        bySuid.insert(make_pair(s->suid.c_str(), s));
+      }
+    }
+
+    void erase(const SampleId& id) {
+      if(id.suid.empty())
+        byUid.erase(&id.uid);
+      else
+        bySuid.erase(id.suid.c_str());
+    }
+
+    void all(vector<Sample*>& out) const {
+      out.clear();
+      out.reserve(size());
+      for(SuidIndex::const_iterator it = bySuid.begin(); it != bySuid.end(); ++it)
+        out.push_back(it->second);
+      for(UidIndex::const_iterator it = byUid.begin(); it != byUid.end(); ++it)
+        out.push_back(it->second);
+    }
+
+    void sorted(vector<Sample*>& out) const {
+      all(out);
+      sort(out.begin(), out.end(), sampleBefore);
+    }
+  };
+
+  static Sample* findSample(const map<long, Sample*>& sampleMap, long sampleId) {
+    map<long, Sample*>::const_iterator itS = sampleMap.find(sampleId);
+    return itS != sampleMap.end() ? itS->second : 0;
+  }
+
+  // delta samples, with ids as written by that version
+  // the samples as they will be once a delta is applied: those it changes, 0 if removed, over the
+  // forest's. samples already in the forest keep their address, as they are updated in place
+  struct DeltaSamples {
+    const SampleIndex& samples;
+    const map<SampleId, Sample*>& staged;
+    int version;
+    DeltaSamples(const SampleIndex& withSamples, const map<SampleId, Sample*>& withStaged, int withVersion) :
+      samples(withSamples), staged(withStaged), version(withVersion) {
+    }
+  };
+
+  static Sample* findSample(const DeltaSamples& delta, const string& token) {
+    SampleId id;
+    if(!parseSampleId(token, delta.version, id))
+      return 0;
+    Sample* s = delta.samples.find(id);
+    map<SampleId, Sample*>::const_iterator it = delta.staged.find(id);
+    if(it == delta.staged.end())
+      return s;
+    if(!it->second)
+      return 0;
+    return s ? s : it->second;
+  }
+
+  // 0 if the input ends or is malformed before the subtree is complete, or has unknown samples
+  template <class K, class Samples>
+  static DecisionTreeNode* loadDecisionTreeNodeForForest(TreeState& ts, istream& forestS, const Samples& sampleMap) {
     int nodeCode;
-    forestS >> nodeCode;
+    if(!(forestS >> nodeCode))
+      return 0;
 
     DecisionTreeNode* n = 0;
     DecisionTreeLeaf* nl = 0;
@@ -1114,7 +1933,14 @@ namespace IncrementalRandomForest {
     forestS >> n->c0 >> n->c1;
 
     int countDC;
-    forestS >> countDC;
+    if(!(forestS >> countDC)) {
+      deleteDecisionTreeNode(n);
+      return 0;
+    }
+    if(countDC < 0) {
+      n->countsEvicted = true;
+      countDC = 0;
+    }
 
     n->decisionCountMap.resize(countDC);
 
@@ -1124,7 +1950,10 @@ namespace IncrementalRandomForest {
       DecisionCounts dc;
       // FIXME: no need to be backwards compatible after complete deployment
       unsigned int dummy;
-      forestS >> dummy >> dummy >> dc.c0p >> dc.c1p >> dc.rank;
+      if(!(forestS >> dummy >> dummy >> dc.c0p >> dc.c1p >> dc.rank)) {
+        deleteDecisionTreeNode(n);
+        return 0;
+      }
       // not loading empty DC
       if(!(dc.c0p == 0 && dc.c1p == 0))
         n->decisionCountMap[code] = dc;
@@ -1132,26 +1961,41 @@ namespace IncrementalRandomForest {
 
     if(nl) {
       int countSamples;
-      forestS >> countSamples;
-      nl->samples.resize(countSamples);
+      if(!(forestS >> countSamples) || countSamples < 0) {
+        delete nl;
+        return 0;
+      }
+      nl->samples.reserve(countSamples);
       for(int i = 0;  i< countSamples; ++i) {
-        long sampleId;
-        forestS >> sampleId;
-        if(sampleMap.find(sampleId) == sampleMap.end()) {
-          cerr << "unknown sample!" << endl;
-          exit(1);
+        K sampleId;
+        Sample* s = (forestS >> sampleId) ? findSample(sampleMap, sampleId) : 0;
+        if(!s) {
+          if(forestS)
+            cerr << "unknown sample!" << endl;
+          delete nl;
+          return 0;
         }
-        nl->samples[i] = sampleMap[sampleId];
+        nl->samples.push_back(s);
       }
 
-      forestS >> nl->value;
+      if(!(forestS >> nl->value)) {
+        delete nl;
+        return 0;
+      }
     } else {
-      ni->negative = loadDecisionTreeNodeForForest(ts, forestS, sampleMap);
-      ni->positive = loadDecisionTreeNodeForForest(ts, forestS, sampleMap);
+      ni->negative = loadDecisionTreeNodeForForest<K>(ts, forestS, sampleMap);
+      ni->positive = ni->negative ? loadDecisionTreeNodeForForest<K>(ts, forestS, sampleMap) : 0;
+      if(!ni->positive) {
+        if(ni->negative)
+          destroyDecisionTreeNode(ni->negative);
+        delete ni;
+        return 0;
+      }
     }
     return n;
   }
 
+  template <class K>
   static void saveDecisionTreeNodeInForest(DecisionTreeNode* dt, ostream& forestS) {
     DecisionTreeInternal* ni;
     DecisionTreeLeaf* nl;
@@ -1160,7 +2004,10 @@ namespace IncrementalRandomForest {
     forestS << dt->id << endl;
     forestS << dt->minValidRank.first << " " << dt->minValidRank.second << endl;
     forestS << dt->c0 << " " << dt->c1 << endl;
-    forestS << dt->decisionCountMap.size() << endl;
+    if(dt->countsEvicted)
+      forestS << -1 << endl;
+    else
+      forestS << dt->decisionCountMap.size() << endl;
     sparse_hash_map<int, DecisionCounts>::const_iterator dcIt;
     for(dcIt = dt->decisionCountMap.begin(); dcIt != dt->decisionCountMap.end(); ++dcIt) {
       forestS << dcIt->first << endl;
@@ -1174,45 +2021,197 @@ namespace IncrementalRandomForest {
       forestS << nl->samples.size() << endl;
       vector<Sample*>::const_iterator sIt;
       for(sIt = nl->samples.begin(); sIt != nl->samples.end(); ++sIt)
-        forestS << (long)(*sIt) << endl;
+        forestS << sampleKey<K>(*sIt) << endl;
     }
 
     if(nl) {
       forestS << nl->value << endl;
     } else {
-      saveDecisionTreeNodeInForest(ni->negative, forestS);
-      saveDecisionTreeNodeInForest(ni->positive, forestS);
+      saveDecisionTreeNodeInForest<K>(ni->negative, forestS);
+      saveDecisionTreeNodeInForest<K>(ni->positive, forestS);
     }
   }
 
+  // full snapshots start with
+  //   irf <version>
+  // then the forest config, tree count, samples and, with a sliding window, the
+  // window contents, and then, for each tree,
+  //   <#nodes> <#bytes> <seed>
+  // followed by its nodes in pre-order. Knowing where each tree starts lets
+  // them be parsed concurrently, or kept aside until first used. Each tree
+  // has a seed of its own so that trees can also be grown concurrently.
+  // Nodes with their counters dropped under the memory budget have -1 for their count, from version 7.
+  // Samples may have a uid instead of a suid from version 8, and ids are written as by SampleId.
+  // Deltas have just the window entries added since the last save from version 9, rather than the whole window.
+  // Version 5 snapshots have no window. Version 3 snapshots have no config. Version 2 snapshots have a single seed,
+  // before the tree count, and no per tree seeds. Older snapshots have no tag
+  // and no per tree sizes either.
+
+  static const int forestFormatVersion = 9;
+
+  // the config is a count of fields followed by them, so that new ones can be appended
+  // (version 4 had no count and just the first 4). fields missing when loading keep their defaults
+  static void saveConfig(const ForestConfig& config, ostream& outS) {
+    outS << 12 << " " << config.maxCodesToConsider << " " << config.maxCodesToKeep << " " << config.minEvidence
+         << " " << config.minEntropyGain << " " << config.maxDepth << " " << config.minSamplesLeaf << " " << config.maxUnsplit
+         << " " << config.splitMargin << " " << config.splitPatience << " " << config.windowSize << " " << config.windowAge
+         << " " << config.maxCounts << endl;
+  }
+
+  template <class T>
+  static void setConfigField(const vector<double>& fields, size_t i, T& field) {
+    if(i < fields.size())
+      field = (T) fields[i];
+  }
+
+  static void loadConfig(istream& inS, int version, ForestConfig& config) {
+    size_t nFields = 4;
+    if(version >= 5)
+      inS >> nFields;
+    vector<double> fields(nFields);
+    for(size_t i = 0; i < nFields; ++i)
+      inS >> fields[i];
+    setConfigField(fields, 0, config.maxCodesToConsider);
+    setConfigField(fields, 1, config.maxCodesToKeep);
+    setConfigField(fields, 2, config.minEvidence);
+    setConfigField(fields, 3, config.minEntropyGain);
+    setConfigField(fields, 4, config.maxDepth);
+    setConfigField(fields, 5, config.minSamplesLeaf);
+    setConfigField(fields, 6, config.maxUnsplit);
+    setConfigField(fields, 7, config.splitMargin);
+    setConfigField(fields, 8, config.splitPatience);
+    setConfigField(fields, 9, config.windowSize);
+    setConfigField(fields, 10, config.windowAge);
+    setConfigField(fields, 11, config.maxCounts);
+  }
+
+  static uint32_t countDecisionTreeNodes(DecisionTreeNode* dt);
+
   static void saveDecisionTreeInForest(TreeState& ts, DecisionTreeNode* dt, ostream& forestS) {
-    saveDecisionTreeNodeInForest(dt, forestS);
+    stringstream treeS;
+    saveDecisionTreeNodeInForest<long>(dt, treeS);
+    const string& text = treeS.str();
+    forestS << countDecisionTreeNodes(dt) << " " << text.size() << " " << ts.seed << endl;
+    forestS.write(text.data(), text.size());
   }
 
-  void outputDecisionTree(TreeState& ts, DecisionTreeNode* dt, ostream& outS) {
-    DecisionTreeInternal* ni;
-    DecisionTreeLeaf* nl;
+  static bool readDecisionTreeRecord(istream& forestS, int version, unsigned long& nodeCount, TreeState& ts, string& text) {
+    size_t length;
+    forestS >> nodeCount >> length;
+    if(version >= 3)
+      forestS >> ts.seed;
+    forestS.get(); // end of line
+    text.resize(length);
+    if(length > 0)
+      forestS.read(&text[0], length);
+    return forestS.good();
+  }
 
-    if(dt->checkType(&ni, &nl)) {
-      outS << nl->value;
-    } else {
-      outS << "[";
-      outS << ni->code << ",";
-      outputDecisionTree(ts, ni->negative, outS);
-      outS << ",";
-      outputDecisionTree(ts, ni->positive, outS);
-      outS << "]";
+  // FIXME: full snapshots have no way to report failure yet
+  static DecisionTreeNode* checkLoadedTree(DecisionTreeNode* dt) {
+    if(!dt) {
+      cerr << "malformed tree in snapshot!" << endl;
+      exit(1);
     }
+    return dt;
   }
 
-  void outputDecisionTreeWithStats(TreeState& ts, DecisionTreeNode* dt, ostream& outS) {
-    DecisionTreeInternal* ni;
-    DecisionTreeLeaf* nl;
+  static DecisionTreeNode* loadDecisionTreeFromRecord(const string& text, const map<long, Sample*>& sampleMap) {
+    // node ids are all being loaded so the seed is not really used
+    TreeState scratch;
+    istringstream treeS(text);
+    return checkLoadedTree(loadDecisionTreeNodeForForest<long>(scratch, treeS, sampleMap));
+  }
 
-    outS << "{";
+  // the seed moves on for every node made, loaded ones included
+  static void advanceSeed(TreeState& ts, unsigned long nodeCount) {
+    for(unsigned long i = 0; i < nodeCount; ++i)
+      rand_r(&ts.seed);
+  }
 
+  // per tree seeds, drawn from a forest-wide one (as kept before version 3)
+  static void seedTrees(TreeState& ts, vector<TreeState>& treeStates) {
+    for(vector<TreeState>::iterator it = treeStates.begin(); it != treeStates.end(); ++it)
+      it->seed = rand_r(&ts.seed);
+  }
 
-    if(dt->checkType(&ni, &nl)) {
+  static size_t countCPUs(void) {
+    long nCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    return nCPUs > 1 ? nCPUs : 1;
+  }
+
+  // each job on a thread of its own, the first one on the calling thread
+  template <class Job>
+  static void runJobs(vector<Job>& jobs, void* (*run)(void*)) {
+    vector<pthread_t> threads(jobs.size());
+    vector<bool> started(jobs.size(), false);
+    for(size_t t = 1; t < jobs.size(); ++t)
+      started[t] = pthread_create(&threads[t], 0, run, &jobs[t]) == 0;
+    if(!jobs.empty())
+      run(&jobs[0]);
+    for(size_t t = 1; t < jobs.size(); ++t) {
+      if(started[t])
+        pthread_join(threads[t], 0);
+      else
+        run(&jobs[t]); // could not get a thread, do it here
+    }
+  }
+
+  struct TreeLoadJob {
+    const vector<string>* records;
+    const map<long, Sample*>* sampleMap;
+    vector<DecisionTreeNode*>* forest;
+    size_t first;
+    size_t step;
+  };
+
+  static void* loadDecisionTreesJob(void* arg) {
+    TreeLoadJob* job = (TreeLoadJob*) arg;
+    for(size_t i = job->first; i < job->records->size(); i += job->step)
+      (*job->forest)[i] = loadDecisionTreeFromRecord((*job->records)[i], *job->sampleMap);
+    return 0;
+  }
+
+  static void loadDecisionTreesInParallel(const vector<string>& records, const map<long, Sample*>& sampleMap, vector<DecisionTreeNode*>& forest) {
+    size_t nThreads = min(countCPUs(), records.size());
+
+    forest.resize(records.size(), 0);
+    vector<TreeLoadJob> jobs(nThreads);
+    for(size_t t = 0; t < nThreads; ++t) {
+      TreeLoadJob& job = jobs[t];
+      job.records = &records;
+      job.sampleMap = &sampleMap;
+      job.forest = &forest;
+      job.first = t;
+      job.step = nThreads;
+    }
+    runJobs(jobs, loadDecisionTreesJob);
+  }
+
+  void outputDecisionTree(TreeState& ts, DecisionTreeNode* dt, ostream& outS) {
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
+
+    if(dt->checkType(&ni, &nl)) {
+      outS << nl->value;
+    } else {
+      outS << "[";
+      outS << ni->code << ",";
+      outputDecisionTree(ts, ni->negative, outS);
+      outS << ",";
+      outputDecisionTree(ts, ni->positive, outS);
+      outS << "]";
+    }
+  }
+
+  void outputDecisionTreeWithStats(TreeState& ts, DecisionTreeNode* dt, ostream& outS) {
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
+
+    outS << "{";
+
+
+    if(dt->checkType(&ni, &nl)) {
       outS << "\"value\":" << nl->value;
     } else {
       outS << "\"split\":" << dt->code;
@@ -1241,38 +2240,125 @@ namespace IncrementalRandomForest {
       outS << "}";
     }
     outS << "}";
+    if(dt->countsEvicted)
+      outS << ",\"evicted\":true";
 
     outS << "}";
   }
 
-  static void loadRandomForest(TreeState& ts, istream& forestS, vector<DecisionTreeNode*>& forest, map<string, Sample*>& samples) {
-    forestS >> ts.seed;
-    int nTrees;
-    forestS >> nTrees;
-    int nSamples;
-    forestS >> nSamples;
-    map<long, Sample*> sampleMap;
-    for(int i = 0; i < nSamples; ++i) {
-      long sampleId;
-      forestS >> sampleId;
-      Sample* s = new Sample();
-      forestS >> s->suid;
-      forestS >> s->y;
-      int countSampleCodes;
-      forestS >> countSampleCodes;
-      for(int j = 0; j < countSampleCodes; ++j) {
-        int code;
-        float value;
-        forestS >> code >> value;
-        s->xCodes[code] = value;
+  // flat inference-only model, laid out to be used in place once mapped
+
+  static const char modelMagic[4] = { 'I', 'R', 'F', 'M' };
+  static const uint32_t modelVersion = 1;
+
+  struct ModelHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t nTrees;
+    uint32_t nNodes;
+  };
+
+  struct ModelNode {
+    int32_t code; // iff code == -1 it's a leaf node
+    uint32_t negative;
+    uint32_t positive;
+    float value;
+  };
+
+  static uint32_t countDecisionTreeNodes(DecisionTreeNode* dt) {
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
+    if(dt->checkType(&ni, &nl))
+      return 1;
+    return 1 + countDecisionTreeNodes(ni->negative) + countDecisionTreeNodes(ni->positive);
+  }
+
+  // nodes are written in pre-order, so children indexes can be computed without a second pass
+  static uint32_t saveDecisionTreeNodeInModel(DecisionTreeNode* dt, uint32_t index, ostream& outS) {
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
+    ModelNode mn;
+    memset(&mn, 0, sizeof(mn));
+    mn.code = dt->code;
+    if(dt->checkType(&ni, &nl)) {
+      mn.value = nl->value;
+      outS.write((const char*)&mn, sizeof(mn));
+      return index + 1;
+    }
+    mn.negative = index + 1;
+    mn.positive = mn.negative + countDecisionTreeNodes(ni->negative);
+    outS.write((const char*)&mn, sizeof(mn));
+    uint32_t next = saveDecisionTreeNodeInModel(ni->negative, mn.negative, outS);
+    return saveDecisionTreeNodeInModel(ni->positive, next, outS);
+  }
+
+  class Model {
+  private:
+    void* data;
+    size_t size;
+    const uint32_t* roots;
+    const ModelNode* nodes;
+    uint32_t nTrees;
+
+    float evaluate(Sample* s, uint32_t root) const {
+      const ModelNode* n = &nodes[root];
+      while(n->code != -1) {
+        map<int, float>::const_iterator xCodeIt = s->xCodes.find(n->code);
+        float y = xCodeIt != s->xCodes.end() ? xCodeIt->second : 0;
+        n = &nodes[y >= 0.5 ? n->positive : n->negative];
       }
-      sampleMap[sampleId] = s;
-      samples[s->suid] = s;
+      return n->value;
     }
-    for(int i = 0; i < nTrees; ++i) {
-      forest.push_back(loadDecisionTreeNodeForForest(ts, forestS, sampleMap));
+  public:
+    Model(void* withData, size_t withSize) : data(withData), size(withSize) {
+      const ModelHeader* h = (const ModelHeader*) data;
+      nTrees = h->nTrees;
+      roots = (const uint32_t*) ((const char*) data + sizeof(ModelHeader));
+      nodes = (const ModelNode*) (roots + nTrees);
+    }
+
+    ~Model(void) {
+      munmap(data, size);
+    }
+
+    // whole and well formed: roots within the nodes, and children after their parent, so that
+    // evaluate stays in bounds and always reaches a leaf
+    static bool check(const void* data, size_t size) {
+      if(size < sizeof(ModelHeader))
+        return false;
+      const ModelHeader* h = (const ModelHeader*) data;
+      if(memcmp(h->magic, modelMagic, sizeof(modelMagic)) != 0 || h->version != modelVersion)
+        return false;
+      if(size != sizeof(ModelHeader) + (uint64_t) h->nTrees * sizeof(uint32_t) + (uint64_t) h->nNodes * sizeof(ModelNode))
+        return false;
+      const uint32_t* roots = (const uint32_t*) ((const char*) data + sizeof(ModelHeader));
+      const ModelNode* nodes = (const ModelNode*) (roots + h->nTrees);
+      for(uint32_t i = 0; i < h->nTrees; ++i) {
+        if(roots[i] >= h->nNodes)
+          return false;
+      }
+      for(uint32_t i = 0; i < h->nNodes; ++i) {
+        const ModelNode& n = nodes[i];
+        if(n.code == -1)
+          continue;
+        if(n.negative <= i || n.negative >= h->nNodes || n.positive <= i || n.positive >= h->nNodes)
+          return false;
+      }
+      return true;
     }
-  }
+
+    float classify(Sample* s) const {
+      return classifyPartial(s, nTrees);
+    }
+
+    float classifyPartial(Sample* s, int n) const {
+      n = min(n, (int) nTrees);
+      double v = 0;
+      for(int i = 0; i < n; ++i)
+        v += evaluate(s, roots[i]);
+      return v / n;
+    }
+  };
 
   static float evaluateSampleAgainstDecisionTree(TreeState& ts, Sample* s, DecisionTreeNode* dt) {
     DecisionTreeNode* dtn = dt;
@@ -1299,114 +2385,1495 @@ namespace IncrementalRandomForest {
     return nl->value;
   }
 
-  static bool sampleInTree(const Sample* sp, int t) {
-    char s[64];
-    sprintf(s, "%d%s", t, sp->suid.c_str());
-    uint32_t out;
-    MurmurHash3_x86_32(s, strlen(s), 42, &out);
-    return (out % 3) < 2; // 2 in 3 chance
+  // one row of a batch in compressed sparse row layout, codes not assumed sorted
+  struct RowFeatures {
+    const int* codes;
+    const float* values;
+    int n;
+
+    float get(int code) const {
+      for(int i = 0; i < n; ++i) {
+        if(codes[i] == code)
+          return values[i];
+      }
+      return 0;
+    }
+  };
+
+  static float evaluateRowAgainstDecisionTree(const RowFeatures& row, DecisionTreeNode* dt) {
+    DecisionTreeNode* dtn = dt;
+
+    DecisionTreeInternal* ni;
+    DecisionTreeLeaf* nl;
+
+    while(!dtn->checkType(&ni, &nl))
+      dtn = row.get(dtn->code) >= 0.5 ? ni->positive : ni->negative;
+
+    return nl->value;
+  }
+
+  // hashes the tree id followed by the suid, or the bytes of the uid from the lowest. The id is
+  // copied once, and the digits of each tree id written in front of it
+  class TreeMembership {
+  private:
+    enum { maxDigits = 16 };
+    vector<char> key;
+  public:
+    TreeMembership(const Sample* sp) {
+      if(sp->suid.empty()) {
+        key.resize(maxDigits + sizeof(sp->uid));
+        for(size_t i = 0; i < sizeof(sp->uid); ++i)
+          key[maxDigits + i] = (char) (sp->uid >> (8 * i));
+      } else {
+        key.resize(maxDigits + strlen(sp->suid.c_str()));
+        copy(sp->suid.c_str(), sp->suid.c_str() + key.size() - maxDigits, key.begin() + maxDigits);
+      }
+    }
+    bool inTree(int t) {
+      char* begin = &key[0] + maxDigits;
+      unsigned int u = t;
+      do {
+        *--begin = '0' + u % 10;
+        u /= 10;
+      } while(u);
+      uint32_t out;
+      MurmurHash3_x86_32(begin, &key[0] + key.size() - begin, 42, &out);
+      return (out % 3) < 2; // 2 in 3 chance
+    }
+  };
+
+  // what each tree gets of the samples, with one membership pass per sample
+  template <class Samples>
+  static void splitByTree(const Samples& samples, size_t nTrees, vector<vector<Sample*> >& trees) {
+    trees.assign(nTrees, vector<Sample*>());
+    for(typename Samples::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+      TreeMembership membership(it->second);
+      for(size_t t = 0; t < nTrees; ++t) {
+        if(membership.inTree(t))
+          trees[t].push_back(it->second);
+      }
+    }
+  }
+
+  // trees that start empty are grown top-down, with the same outcome as updateDecisionTree
+  // but without the per sample bookkeeping: samples are flattened once for all trees, and
+  // each tree keeps the indices of its own in a single array, split like any other subtree
+
+  struct FlatSamples {
+    typedef int Item;
+
+    vector<Sample*> samples;
+    vector<int> offsets;
+    vector<int> codes;
+    vector<float> values;
+
+    FlatSamples(const map<SampleId, Sample*>& sm) : offsets(1, 0) {
+      for(map<SampleId, Sample*>::const_iterator it = sm.begin(); it != sm.end(); ++it) {
+        Sample* s = it->second;
+        samples.push_back(s);
+        visitSampleCodes(s, *this);
+        offsets.push_back(codes.size());
+      }
+    }
+
+    // flattening, as each sample's codes are visited
+    void operator()(int code, float value) {
+      codes.push_back(code);
+      values.push_back(value);
+    }
+
+    Sample* sample(int i) const {
+      return samples[i];
+    }
+    float y(int i) const {
+      return samples[i]->y;
+    }
+
+    // 0 when not in the sample
+    float value(int i, int code) const {
+      vector<int>::const_iterator b = codes.begin() + offsets[i];
+      vector<int>::const_iterator e = codes.begin() + offsets[i + 1];
+      vector<int>::const_iterator it = lower_bound(b, e, code);
+      return it != e && *it == code ? values[it - codes.begin()] : 0;
+    }
+    template <class Visitor>
+    void visitCodes(int i, Visitor& v) const {
+      for(int j = offsets[i]; j < offsets[i + 1]; ++j)
+        v(codes[j], values[j]);
+    }
+  };
+
+  // as updateDecisionTree adding all samples to an empty leaf: the counters are left as
+  // updateDecisionCounters would leave them after each sample in turn, making the same
+  // changes to decisionCountMap in the same order
+  static DecisionTreeNode* growDecisionTree(TreeState& ts, DecisionTreeLeaf* dt, const FlatSamples& fs, int* begin, int* end) {
+    sparse_hash_map<int, CodeRankType> rankCache;
+    set<pair<CodeRankType, int> > ranks;
+    startReaching(ts);
+    ++ts.counters.nodeUpdates;
+    reachNode(ts, dt);
+    int c0 = 0;
+    int c1 = 0;
+    for(const int* p = begin; p != end; ++p) {
+      bool classIn = fs.y(*p) >= 0.5;
+      for(int j = fs.offsets[*p]; j < fs.offsets[*p + 1]; ++j) {
+        const int code = fs.codes[j];
+        sparse_hash_map<int, DecisionCounts>::iterator dcIt = dt->decisionCountMap.find(code);
+        if(dcIt == dt->decisionCountMap.end()) {
+          // once turned down codes never get in, as minValidRank only grows
+          sparse_hash_map<int, CodeRankType>::iterator rcIt = rankCache.find(code);
+          if(rcIt != rankCache.end())
+            continue;
+          CodeRankType newRank = codeRankInNode(code, dt->id);
+          rankCache[code] = newRank;
+          if(make_pair(newRank, code) < dt->minValidRank)
+            continue;
+          dcIt = dt->decisionCountMap.insert(make_pair(code, DecisionCounts())).first;
+          dcIt->second.rank = newRank;
+          ranks.insert(make_pair(newRank, code));
+        }
+
+        if(fs.values[j] >= 0.5) {
+          if(classIn)
+            ++(dcIt->second.c1p);
+          else
+            ++(dcIt->second.c0p);
+        }
+
+        if(ranks.size() > ts.config->maxCodesToKeep) {
+          int toDrop = ranks.begin()->second;
+          dt->minValidRank = max(dt->minValidRank, make_pair(ranks.begin()->first, ranks.begin()->second + 1));
+          ranks.erase(ranks.begin());
+          dt->decisionCountMap.erase(toDrop);
+        }
+      }
+      if(fs.y(*p) > 0.5)
+        ++c1;
+      else
+        ++c0;
+    }
+    dt->c0 = c0;
+    dt->c1 = c1;
+
+    if((dt->decisionCountMap.size() < ts.config->maxCodesToConsider)
+       && ((dt->minValidRank.first != 0) || (dt->minValidRank.second != 0)))
+      computeDecisionCounters(*ts.config, dt, fs, begin, end, dt->decisionCountMap, dt->c0, dt->c1, dt->minValidRank);
+
+    int minEntropyCode = findSplitCode(ts, dt, 0);
+    if(minEntropyCode == -1)
+      updateValue(dt);
+    return splitLeafIfPossible(ts, dt, 0, minEntropyCode, fs, begin, end);
+  }
+
+  static bool isEmptyDecisionTree(DecisionTreeNode* dt) {
+    return dt && dt->code == -1 && dt->c0 == 0 && dt->c1 == 0 &&
+      dt->decisionCountMap.empty() && dt->minValidRank == make_pair(0U, 0);
+  }
+
+  struct TreeBuildJob {
+    const FlatSamples* fs;
+    vector<DecisionTreeNode*>* forest;
+    vector<TreeState>* treeStates;
+    vector<size_t>* treeSizes;
+    size_t first;
+    size_t step;
+  };
+
+  static void* buildDecisionTreesJob(void* arg) {
+    TreeBuildJob* job = (TreeBuildJob*) arg;
+    const FlatSamples& fs = *job->fs;
+    // keys of its own, as tree ids are written into them
+    vector<TreeMembership> memberships;
+    memberships.reserve(fs.samples.size());
+    for(size_t i = 0; i < fs.samples.size(); ++i)
+      memberships.push_back(TreeMembership(fs.samples[i]));
+    vector<int> indices;
+    for(size_t t = job->first; t < job->forest->size(); t += job->step) {
+      indices.clear();
+      for(size_t i = 0; i < fs.samples.size(); ++i) {
+        if(memberships[i].inTree(t))
+          indices.push_back(i);
+      }
+      int* begin = indices.empty() ? 0 : &indices[0];
+      (*job->forest)[t] = growDecisionTree((*job->treeStates)[t], (*job->forest)[t]->checkLeaf(), fs, begin, begin + indices.size());
+      (*job->treeSizes)[t] = indices.size();
+    }
+    return 0;
   }
 
+  // trees must all be empty, treeSizes gets how many samples went into each
+  static void buildDecisionTreesInParallel(const map<SampleId, Sample*>& batchAdd, vector<DecisionTreeNode*>& forest,
+                                           vector<TreeState>& treeStates, vector<size_t>& treeSizes) {
+    FlatSamples fs(batchAdd);
+    size_t nThreads = min(countCPUs(), forest.size());
+    treeSizes.assign(forest.size(), 0);
+    vector<TreeBuildJob> jobs(nThreads);
+    for(size_t t = 0; t < nThreads; ++t) {
+      TreeBuildJob& job = jobs[t];
+      job.fs = &fs;
+      job.forest = &forest;
+      job.treeStates = &treeStates;
+      job.treeSizes = &treeSizes;
+      job.first = t;
+      job.step = nThreads;
+    }
+    runJobs(jobs, buildDecisionTreesJob);
+  }
+
+  struct CodeExporter {
+    int* codes;
+    float* values;
+    int& j;
+    CodeExporter(int* withCodes, float* withValues, int& withJ) : codes(withCodes), values(withValues), j(withJ) {
+    }
+    void operator()(int code, float value) {
+      if(codes)
+        codes[j] = code;
+      if(values)
+        values[j] = value;
+      ++j;
+    }
+  };
+
+  struct CodeLoader {
+    map<int, float>& xCodes;
+    CodeLoader(map<int, float>& withXCodes) : xCodes(withXCodes) {
+    }
+    void operator()(int code, float value) {
+      xCodes.insert(xCodes.end(), make_pair(code, value));
+    }
+  };
+
   class MapSampleWalker : public SampleWalker {
   private:
-    map<string, Sample*>::const_iterator itCurr;
-    map<string, Sample*>::const_iterator itEnd;
+    vector<Sample*> sorted;
+    size_t curr;
+    Sample loaded;
   public:
-    MapSampleWalker(const map<string, Sample*>& sm) :
-      itCurr(sm.begin()), itEnd(sm.end()) {
+    MapSampleWalker(const SampleIndex& samples) : curr(0) {
+      samples.sorted(sorted);
     }
     virtual bool stillSome(void) const {
-      return itCurr != itEnd;
+      return curr < sorted.size();
     }
     virtual Sample* get(void) {
-      Sample* ret = itCurr->second;
-      ++itCurr;
-      return ret;
+      Sample* ret = sorted[curr];
+      ++curr;
+      if(!ret->stored)
+        return ret;
+      // shared features are given back in a copy
+      loaded.suid = ret->suid;
+      loaded.uid = ret->uid;
+      loaded.y = ret->y;
+      loaded.xCodes.clear();
+      CodeLoader loader(loaded.xCodes);
+      visitSampleCodes(ret, loader);
+      return &loaded;
+    }
+  };
+
+  // operation log records, one per line:
+  //   a <suid> <y> <#codes> <code> <value> ...
+  //   A <timestamp> <suid> <y> <#codes> <code> <value> ...
+  //   r <suid>
+  //   l <suid> <y>
+  //   p <suid> <#codes> <code> <value> ... <#codes removed> <code> ...
+  //   c
+  // with u, U, x, L and P in place of a, A, r, l and p for samples with a uid
+
+  static const size_t streamChunkSize = 64 * 1024;
+
+  class SinkStreamBuf : public streambuf {
+  private:
+    Sink& sink;
+    char buffer[streamChunkSize];
+    bool failed;
+
+    bool flushBuffer(void) {
+      size_t n = pptr() - pbase();
+      if(n > 0 && !failed && !sink.write(pbase(), n))
+        failed = true;
+      setp(buffer, buffer + streamChunkSize);
+      return !failed;
+    }
+  public:
+    SinkStreamBuf(Sink& withSink) : sink(withSink), failed(false) {
+      setp(buffer, buffer + streamChunkSize);
+    }
+    bool finish(void) {
+      return flushBuffer();
+    }
+  protected:
+    virtual int_type overflow(int_type c) {
+      if(!flushBuffer())
+        return traits_type::eof();
+      if(!traits_type::eq_int_type(c, traits_type::eof()))
+        sputc(traits_type::to_char_type(c));
+      return traits_type::not_eof(c);
+    }
+    virtual int sync(void) {
+      // the savers flush with every endl, only full chunks are passed on
+      return failed ? -1 : 0;
+    }
+  };
+
+  class SourceStreamBuf : public streambuf {
+  private:
+    Source& source;
+    char buffer[streamChunkSize];
+  public:
+    SourceStreamBuf(Source& withSource) : source(withSource) {
+      setg(buffer, buffer, buffer);
+    }
+  protected:
+    virtual int_type underflow(void) {
+      if(gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+      size_t n = source.read(buffer, streamChunkSize);
+      if(n == 0)
+        return traits_type::eof();
+      setg(buffer, buffer, buffer + n);
+      return traits_type::to_int_type(*gptr());
+    }
+  };
+
+  static void logSample(ostream& logS, Sample* s) {
+    if(s->suid.empty())
+      logS << s->uid;
+    else
+      logS << s->suid;
+    logS << " " << setprecision(9) << s->y << " " << s->xCodes.size();
+    map<int, float>::const_iterator itCodes;
+    for(itCodes = s->xCodes.begin(); itCodes != s->xCodes.end(); ++itCodes)
+      logS << " " << itCodes->first << " " << itCodes->second;
+    logS << "\n";
+    logS.flush();
+  }
+
+  static void logAdd(ostream& logS, Sample* s) {
+    logS << (s->suid.empty() ? "u " : "a ");
+    logSample(logS, s);
+  }
+
+  // adds given a timestamp, for a sliding window
+  static void logTimedAdd(ostream& logS, Sample* s, double timestamp) {
+    logS << (s->suid.empty() ? "U " : "A ") << setprecision(17) << timestamp << " ";
+    logSample(logS, s);
+  }
+
+  static void logRemove(ostream& logS, const SampleId& id) {
+    if(id.suid.empty())
+      logS << "x " << id.uid << "\n";
+    else
+      logS << "r " << id.suid << "\n";
+    logS.flush();
+  }
+
+  static void logRelabel(ostream& logS, const SampleId& id, float y) {
+    if(id.suid.empty())
+      logS << "L " << id.uid;
+    else
+      logS << "l " << id.suid;
+    logS << " " << setprecision(9) << y << "\n";
+    logS.flush();
+  }
+
+  static void logPatch(ostream& logS, const SampleId& id, const map<int, float>& added, const vector<int>& removed) {
+    if(id.suid.empty())
+      logS << "P " << id.uid;
+    else
+      logS << "p " << id.suid;
+    logS << " " << setprecision(9) << added.size();
+    map<int, float>::const_iterator itCodes;
+    for(itCodes = added.begin(); itCodes != added.end(); ++itCodes)
+      logS << " " << itCodes->first << " " << itCodes->second;
+    logS << " " << removed.size();
+    vector<int>::const_iterator itRemoved;
+    for(itRemoved = removed.begin(); itRemoved != removed.end(); ++itRemoved)
+      logS << " " << *itRemoved;
+    logS << "\n";
+    logS.flush();
+  }
+
+  static bool parseLoggedPatch(istream& recordS, map<int, float>& added, vector<int>& removed) {
+    int countCodes;
+    if(!(recordS >> countCodes))
+      return false;
+    for(int i = 0; i < countCodes; ++i) {
+      int code;
+      float value;
+      if(!(recordS >> code >> value))
+        return false;
+      added[code] = value;
+    }
+    if(!(recordS >> countCodes))
+      return false;
+    for(int i = 0; i < countCodes; ++i) {
+      int code;
+      if(!(recordS >> code))
+        return false;
+      removed.push_back(code);
+    }
+    return true;
+  }
+
+  static void logCommit(ostream& logS) {
+    logS << "c\n";
+    logS.flush();
+  }
+
+  static Sample* parseLoggedAdd(istream& recordS, bool withUid) {
+    Sample* s = new Sample();
+    int countCodes;
+    if(!(withUid ? recordS >> s->uid : recordS >> s->suid) || !(recordS >> s->y >> countCodes)) {
+      delete s;
+      return 0;
+    }
+    for(int i = 0; i < countCodes; ++i) {
+      int code;
+      float value;
+      if(!(recordS >> code >> value)) {
+        delete s;
+        return 0;
+      }
+      s->xCodes[code] = value;
+    }
+    return s;
+  }
+
+  // libsvm text, one "<label> <code>:<value> ..." sample per line, parsed by hand
+  // (values are nearly always short decimals, strtod is only used for the rest)
+
+  static inline bool isLibsvmBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+  }
+
+  static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+  }
+
+  // feature indices only, which are never negative: -1 marks leaves and deleted keys
+  static const char* parseLibsvmIndex(const char* p, const char* end, int& v) {
+    if(p != end && *p == '+')
+      ++p;
+    if(p == end || !isDigit(*p))
+      return 0;
+    long long n = 0;
+    for(; p != end && isDigit(*p); ++p) {
+      n = n * 10 + (*p - '0');
+      if(n > numeric_limits<int>::max())
+        return 0;
+    }
+    v = n;
+    return p;
+  }
+
+  static const char* parseLibsvmFloat(const char* p, const char* end, float& v) {
+    static const double powersOf10[] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+      1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+    };
+    const char* start = p;
+    bool negative = p != end && *p == '-';
+    if(p != end && (*p == '-' || *p == '+'))
+      ++p;
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int decimals = 0;
+    for(; p != end && isDigit(*p); ++p, ++digits)
+      mantissa = mantissa * 10 + (*p - '0');
+    if(p != end && *p == '.') {
+      for(++p; p != end && isDigit(*p); ++p, ++digits, ++decimals)
+        mantissa = mantissa * 10 + (*p - '0');
+    }
+    if(digits > 0 && digits <= 18 && (p == end || isLibsvmBlank(*p))) {
+      double d = mantissa / powersOf10[decimals];
+      v = negative ? -d : d;
+      return p;
+    }
+
+    // exponents, long mantissas, nan, inf ...
+    char token[64];
+    const char* tokenEnd = start;
+    while(tokenEnd != end && !isLibsvmBlank(*tokenEnd))
+      ++tokenEnd;
+    size_t length = tokenEnd - start;
+    if(length == 0 || length >= sizeof(token))
+      return 0;
+    memcpy(token, start, length);
+    token[length] = '\0';
+    char* parsedEnd;
+    v = strtod(token, &parsedEnd);
+    return parsedEnd == token + length ? tokenEnd : 0;
+  }
+
+  // 1 for a sample, 0 for a blank line and -1 for a malformed one
+  static int parseLibsvmLine(const char* p, const char* end, Sample* s, float negativeLabel) {
+    while(p != end && isLibsvmBlank(*p))
+      ++p;
+    if(p == end)
+      return 0;
+    float label;
+    if(!(p = parseLibsvmFloat(p, end, label)))
+      return -1;
+    s->y = label == negativeLabel ? 0 : 1;
+    for(;;) {
+      while(p != end && isLibsvmBlank(*p))
+        ++p;
+      if(p == end)
+        return 1;
+      int code;
+      float value;
+      if(!(p = parseLibsvmIndex(p, end, code)) || p == end || *p != ':' ||
+         !(p = parseLibsvmFloat(p + 1, end, value)))
+        return -1;
+      s->xCodes[code] = value;
+    }
+  }
+
+  // samples are identified by idPrefix followed by their 0-based line number
+  struct LibsvmParseJob {
+    const char* begin;
+    const char* end;
+    long firstLine;
+    const char* idPrefix;
+    float negativeLabel;
+    vector<Sample*> samples;
+    bool ok;
+  };
+
+  static void* parseLibsvmJob(void* arg) {
+    LibsvmParseJob* job = (LibsvmParseJob*) arg;
+    job->ok = true;
+    long line = job->firstLine;
+    Sample* s = 0;
+    for(const char* p = job->begin; p < job->end; ++line) {
+      const char* eol = (const char*) memchr(p, '\n', job->end - p);
+      if(!eol)
+        eol = job->end;
+      if(!s)
+        s = new Sample();
+      int parsed = parseLibsvmLine(p, eol, s, job->negativeLabel);
+      if(parsed < 0) {
+        job->ok = false;
+        break;
+      }
+      if(parsed > 0) {
+        char lineId[24];
+        snprintf(lineId, sizeof(lineId), "%ld", line);
+        s->suid = job->idPrefix;
+        s->suid += lineId;
+        job->samples.push_back(s);
+        s = 0;
+      }
+      p = eol + 1;
+    }
+    delete s;
+    return 0;
+  }
+
+  static bool parseLibsvm(const char* begin, const char* end, const char* idPrefix, float negativeLabel,
+                          int nThreads, vector<Sample*>& samples) {
+    static const size_t minChunkSize = 1024 * 1024;
+    if(nThreads <= 0)
+      nThreads = countCPUs();
+    size_t size = end - begin;
+    if((size_t) nThreads > size / minChunkSize + 1)
+      nThreads = size / minChunkSize + 1;
+
+    // chunks end at line breaks, and need to know their first line number
+    vector<LibsvmParseJob> jobs(nThreads);
+    const char* chunkBegin = begin;
+    long line = 0;
+    for(int t = 0; t < nThreads; ++t) {
+      const char* chunkEnd = t == nThreads - 1 ? end : begin + size * (t + 1) / nThreads;
+      if(chunkEnd < chunkBegin)
+        chunkEnd = chunkBegin;
+      if(chunkEnd != end) {
+        const char* eol = (const char*) memchr(chunkEnd, '\n', end - chunkEnd);
+        chunkEnd = eol ? eol + 1 : end;
+      }
+      LibsvmParseJob& job = jobs[t];
+      job.begin = chunkBegin;
+      job.end = chunkEnd;
+      job.firstLine = line;
+      job.idPrefix = idPrefix;
+      job.negativeLabel = negativeLabel;
+      for(const char* p = chunkBegin; (p = (const char*) memchr(p, '\n', chunkEnd - p)); ++p)
+        ++line;
+      chunkBegin = chunkEnd;
+    }
+
+    runJobs(jobs, parseLibsvmJob);
+
+    bool ok = true;
+    for(int t = 0; t < nThreads; ++t)
+      ok = ok && jobs[t].ok;
+    for(int t = 0; t < nThreads; ++t) {
+      vector<Sample*>& chunkSamples = jobs[t].samples;
+      if(ok)
+        samples.insert(samples.end(), chunkSamples.begin(), chunkSamples.end());
+      else {
+        for(vector<Sample*>::iterator it = chunkSamples.begin(); it != chunkSamples.end(); ++it)
+          delete *it;
+      }
+    }
+    return ok;
+  }
+
+  static const uint32_t deletedRecordHash = 0xffffffff;
+
+  // an append-only file the features of committed samples are moved out to, mapped back in
+  // whole: address space for the largest file allowed is reserved up front, so that records
+  // never move and samples can point straight at them
+  // FIXME: the space of samples since removed is never reclaimed
+  class SampleFile {
+  private:
+    int fd;
+    char* base;
+    size_t reserved;
+    size_t size;
+  public:
+    SampleFile(void) : fd(-1), base(0), reserved(0), size(0) {
+    }
+
+    ~SampleFile(void) {
+      if(base)
+        munmap(base, reserved);
+      if(fd >= 0)
+        close(fd);
+    }
+
+    bool open(const char* fileName) {
+      fd = ::open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if(fd < 0)
+        return false;
+      reserved = sizeof(void*) >= 8 ? ((size_t) 1) << 40 : ((size_t) 1) << 30;
+      void* p = mmap(0, reserved, PROT_READ, MAP_SHARED | MAP_NORESERVE, fd, 0);
+      if(p == MAP_FAILED)
+        return false;
+      base = (char*) p;
+      return true;
+    }
+
+    // 0 if it could not be written
+    const StoredCodes* append(const vector<char>& record) {
+      if(size + record.size() > reserved ||
+         pwrite(fd, &record[0], record.size(), size) != (ssize_t) record.size())
+        return 0;
+      const StoredCodes* sc = (const StoredCodes*) (base + size);
+      size += record.size();
+      return sc;
+    }
+  };
+
+  // created anew, 0 if it could not be
+  static SampleFile* createSampleFile(const char* fileName) {
+    SampleFile* file = new SampleFile();
+    if(!file->open(fileName)) {
+      delete file;
+      return 0;
+    }
+    return file;
+  }
+
+  static void packCodes(const map<int, float>& xCodes, vector<char>& record) {
+    StoredCodes sc;
+    sc.count = xCodes.size();
+    record.resize(sc.size());
+    memcpy(&record[0], &sc, sizeof(sc));
+    int32_t* codes = (int32_t*) &record[sizeof(sc)];
+    float* values = (float*) (codes + sc.count);
+    for(map<int, float>::const_iterator itC = xCodes.begin(); itC != xCodes.end(); ++itC) {
+      *codes++ = itC->first;
+      *values++ = itC->second;
+    }
+  }
+
+  static uint32_t hashRecord(const void* record, size_t size) {
+    uint32_t h;
+    MurmurHash3_x86_32(record, size, 42, &h);
+    return h == deletedRecordHash ? h - 1 : h;
+  }
+
+  // committed samples with the same features share a single copy of them, counted by reference,
+  // kept in memory or in a sample file. Samples whose features could not be written to the file
+  // keep them in xCodes
+  class FeatureTable {
+  private:
+    struct Interned {
+      const StoredCodes* codes;
+      unsigned int refs;
+      bool inFile;
+      Interned* next; // with the same hash
+    };
+    sparse_hash_map<uint32_t, Interned*> buckets;
+    SampleFile* file;
+
+    void freeRecord(Interned* i) {
+      if(!i->inFile)
+        delete[] (const char*) i->codes;
+      delete i;
+    }
+
+  public:
+    FeatureTable(void) : file(0) {
+      buckets.set_deleted_key(deletedRecordHash);
+    }
+
+    ~FeatureTable(void) {
+      for(sparse_hash_map<uint32_t, Interned*>::iterator it = buckets.begin(); it != buckets.end(); ++it) {
+        for(Interned* i = it->second; i;) {
+          Interned* next = i->next;
+          freeRecord(i);
+          i = next;
+        }
+      }
+      delete file;
+    }
+
+    bool hasFile(void) const {
+      return file != 0;
+    }
+
+    bool intern(Sample* s) {
+      if(s->stored)
+        return true;
+      vector<char> record;
+      packCodes(s->xCodes, record);
+      uint32_t h = hashRecord(&record[0], record.size());
+      Interned*& chain = buckets[h];
+      for(Interned* i = chain; i; i = i->next) {
+        if(i->codes->size() == record.size() && memcmp(i->codes, &record[0], record.size()) == 0) {
+          ++i->refs;
+          s->stored = i->codes;
+          map<int, float>().swap(s->xCodes);
+          return true;
+        }
+      }
+
+      Interned* i = new Interned();
+      i->inFile = file != 0;
+      if(file) {
+        i->codes = file->append(record);
+        if(!i->codes) {
+          delete i;
+          if(!chain)
+            buckets.erase(h);
+          return false;
+        }
+      } else {
+        char* copy = new char[record.size()];
+        memcpy(copy, &record[0], record.size());
+        i->codes = (const StoredCodes*) copy;
+      }
+      i->refs = 1;
+      i->next = chain;
+      chain = i;
+      s->stored = i->codes;
+      map<int, float>().swap(s->xCodes);
+      return true;
+    }
+
+    // before the sample is deleted
+    void release(Sample* s) {
+      if(!s->stored)
+        return;
+      uint32_t h = hashRecord(s->stored, s->stored->size());
+      sparse_hash_map<uint32_t, Interned*>::iterator it = buckets.find(h);
+      Interned** link = &it->second;
+      while((*link)->codes != s->stored)
+        link = &(*link)->next;
+      Interned* i = *link;
+      s->stored = 0;
+      if(--i->refs > 0)
+        return;
+      *link = i->next;
+      if(!it->second)
+        buckets.erase(it);
+      freeRecord(i);
+    }
+
+    // features kept in memory are moved to the file, which the table then owns, and the samples
+    // sharing them pointed there
+    bool setFile(SampleFile* opened, const SampleIndex& samples) {
+      if(file) {
+        delete opened;
+        return false;
+      }
+      file = opened;
+      bool ok = true;
+      map<const StoredCodes*, const StoredCodes*> moved;
+      vector<char> record;
+      for(sparse_hash_map<uint32_t, Interned*>::iterator it = buckets.begin(); it != buckets.end(); ++it) {
+        for(Interned* i = it->second; i; i = i->next) {
+          record.assign((const char*) i->codes, (const char*) i->codes + i->codes->size());
+          const StoredCodes* sc = file->append(record);
+          if(!sc) {
+            ok = false;
+            continue;
+          }
+          moved[i->codes] = sc;
+          delete[] (const char*) i->codes;
+          i->codes = sc;
+          i->inFile = true;
+        }
+      }
+      vector<Sample*> all;
+      samples.all(all);
+      for(vector<Sample*>::const_iterator it = all.begin(); it != all.end(); ++it) {
+        Sample* s = *it;
+        map<const StoredCodes*, const StoredCodes*>::const_iterator itM = moved.find(s->stored);
+        if(itM != moved.end())
+          s->stored = itM->second;
+        else if(!s->stored)
+          ok = intern(s) && ok;
+      }
+      return ok;
+    }
+  };
+
+  // each sample is interned as soon as it is read, so that with a sample file its features go
+  // straight there and at most one sample's are in memory at a time
+  static void loadSamples(istream& forestS, int version, int nSamples, map<long, Sample*>& sampleMap,
+                          SampleIndex& samples, FeatureTable& features) {
+    for(int i = 0; i < nSamples; ++i) {
+      long sampleId;
+      forestS >> sampleId;
+      Sample* s = new Sample();
+      SampleId id;
+      readSampleId(forestS, version, id);
+      setSampleId(s, id);
+      forestS >> s->y;
+      int countSampleCodes;
+      forestS >> countSampleCodes;
+      for(int j = 0; j < countSampleCodes; ++j) {
+        int code;
+        float value;
+        forestS >> code >> value;
+        s->xCodes[code] = value;
+      }
+      sampleMap[sampleId] = s;
+      samples.insert(s);
+      features.intern(s);
+    }
+  }
+
+  static void patchCodes(map<int, float>& xCodes, const map<int, float>& added, const vector<int>& removed) {
+    for(vector<int>::const_iterator it = removed.begin(); it != removed.end(); ++it)
+      xCodes.erase(*it);
+    for(map<int, float>::const_iterator it = added.begin(); it != added.end(); ++it)
+      xCodes[it->first] = it->second;
+  }
+
+  // a delta as read, before anything in the forest is changed. whatever was not taken on
+  // success is freed with it
+  // just what a delta changes, so that parsing it costs as much as the delta rather than the forest
+  struct ParsedDelta {
+    map<SampleId, Sample*> staged; // new contents of the samples added or changed, 0 for those removed
+    vector<SampleId> removedIds;
+    vector<pair<size_t, pair<unsigned int, DecisionTreeNode*> > > trees; // id, seed and root
+    ~ParsedDelta(void) {
+      for(map<SampleId, Sample*>::iterator it = staged.begin(); it != staged.end(); ++it)
+        delete it->second;
+      for(size_t i = 0; i < trees.size(); ++i)
+        destroyDecisionTreeNode(trees[i].second.second);
+    }
+  };
+
+  struct WindowEntry {
+    SampleId id;
+    double timestamp;
+    unsigned long seq;
+  };
+
+  static const SampleId deletedWindowId;
+
+  // hashed like the sample index, on the suid or on the uid when that is empty
+  struct SampleIdHash {
+    size_t operator()(const SampleId* id) const {
+      return id->suid.empty() ? UidHash()(&id->uid) : SuidHash()(id->suid.c_str());
+    }
+  };
+
+  struct SampleIdEqual {
+    bool operator()(const SampleId* id1, const SampleId* id2) const {
+      if(id1 == id2)
+        return true;
+      if(id1 == &deletedWindowId || id2 == &deletedWindowId)
+        return false;
+      return id1->uid == id2->uid && id1->suid == id2->suid;
+    }
+  };
+
+  // the live window entry of each id. Keys point to the ids of the entries themselves, so that
+  // they are not kept twice, and must be erased before the entry is dropped. Entries not found
+  // through their own id are stale
+  class WindowIndex {
+  private:
+    typedef sparse_hash_map<const SampleId*, const WindowEntry*, SampleIdHash, SampleIdEqual> Index;
+    Index live;
+  public:
+    WindowIndex(void) {
+      live.set_deleted_key(&deletedWindowId);
+    }
+    size_t size(void) const {
+      return live.size();
+    }
+    void clear(void) {
+      live.clear();
+    }
+    // replacing any earlier entry for the same id, which becomes stale
+    void insert(const WindowEntry& e) {
+      live.erase(&e.id);
+      live.insert(make_pair(&e.id, &e));
+    }
+    void erase(const SampleId& id) {
+      live.erase(&id);
+    }
+    bool isLive(const WindowEntry& e) const {
+      Index::const_iterator it = live.find(&e.id);
+      return it != live.end() && it->second == &e;
+    }
+  };
+
+  class Forest {
+  private:
+    SampleIndex samples;
+    map<SampleId, Sample*> toAdd;
+    map<SampleId, Sample*> toRemove;
+    vector<DecisionTreeNode*> forest;
+    bool changesToCommit;
+    ForestConfig config;
+    vector<TreeState> treeStates;
+    ostream* logS;
+    // what changed since the last (full or delta) save
+    vector<bool> dirtyTrees;
+    set<SampleId> changedSamples;
+    // lazily loaded trees stay serialized until first used
+    vector<string> pendingTrees;
+    map<long, Sample*> pendingSampleMap;
+    size_t countPending;
+    // sliding window, when configured: ids in the order they were added, expired from the
+    // front. entries of ids since removed or added again are stale, and skipped when reached
+    deque<WindowEntry> window;
+    WindowIndex windowLive;
+    unsigned long windowSeq;
+    unsigned long windowSavedSeq; // entries from here on were added since the last save
+    double windowLatest;
+    unsigned long countExpired;
+    FeatureTable features;
+
+    bool windowed(void) const {
+      return config.windowSize > 0 || config.windowAge > 0;
+    }
+
+    void windowAdd(const SampleId& id, double timestamp) {
+      WindowEntry e;
+      e.id = id;
+      e.timestamp = timestamp;
+      e.seq = windowSeq++;
+      // entries at either end of a deque never move, so the index can point into it
+      window.push_back(e);
+      windowLive.insert(window.back());
+      windowLatest = max(windowLatest, timestamp);
+
+      // keep stale entries from piling up while nothing expires
+      if(window.size() > 2 * windowLive.size() + 16) {
+        deque<WindowEntry> live;
+        for(deque<WindowEntry>::const_iterator it = window.begin(); it != window.end(); ++it) {
+          if(!isStale(*it))
+            live.push_back(*it);
+        }
+        windowLive.clear();
+        window.swap(live);
+        for(deque<WindowEntry>::const_iterator it = window.begin(); it != window.end(); ++it)
+          windowLive.insert(*it);
+      }
+    }
+
+    bool isStale(const WindowEntry& e) const {
+      return !windowLive.isLive(e);
+    }
+
+    // through toRemove, or by dropping the add if not committed yet
+    void expireWindow(void) {
+      while(!window.empty()) {
+        const WindowEntry& e = window.front();
+        if(isStale(e)) {
+          window.pop_front();
+          continue;
+        }
+        bool tooMany = config.windowSize > 0 && windowLive.size() > config.windowSize;
+        bool tooOld = config.windowAge > 0 && e.timestamp < windowLatest - config.windowAge;
+        if(!tooMany && !tooOld)
+          break;
+
+        map<SampleId, Sample*>::iterator itAdd = toAdd.find(e.id);
+        if(itAdd != toAdd.end()) {
+          delete itAdd->second;
+          toAdd.erase(itAdd);
+        } else if(toRemove.find(e.id) == toRemove.end()) {
+          Sample* s = samples.find(e.id);
+          if(s)
+            toRemove[e.id] = s;
+        }
+        windowLive.erase(e.id);
+        window.pop_front();
+        ++countExpired;
+      }
+    }
+
+    void saveWindow(ostream& outS) {
+      outS << windowLive.size() << endl;
+      streamsize precision = outS.precision(17);
+      for(deque<WindowEntry>::const_iterator it = window.begin(); it != window.end(); ++it) {
+        if(!isStale(*it))
+          outS << it->id << " " << it->timestamp << endl;
+      }
+      outS.precision(precision);
+    }
+
+    // entries added since the last save, for a delta
+    void saveWindowAdded(ostream& outS) {
+      deque<WindowEntry>::const_iterator it;
+      size_t n = 0;
+      for(it = window.begin(); it != window.end(); ++it)
+        n += it->seq >= windowSavedSeq && !isStale(*it);
+      outS << n << endl;
+      streamsize precision = outS.precision(17);
+      for(it = window.begin(); it != window.end(); ++it) {
+        if(it->seq >= windowSavedSeq && !isStale(*it))
+          outS << it->id << " " << it->timestamp << endl;
+      }
+      outS.precision(precision);
+    }
+
+    static bool readWindow(istream& inS, int version, vector<pair<SampleId, double> >& entries) {
+      size_t n;
+      if(!(inS >> n))
+        return false;
+      for(size_t i = 0; i < n; ++i) {
+        SampleId id;
+        double timestamp;
+        if(!readSampleId(inS, version, id) || !(inS >> timestamp))
+          return false;
+        entries.push_back(make_pair(id, timestamp));
+      }
+      return true;
+    }
+
+    void loadWindow(istream& inS, int version) {
+      windowLive.clear();
+      window.clear();
+      windowLatest = 0;
+      vector<pair<SampleId, double> > entries;
+      readWindow(inS, version, entries);
+      for(vector<pair<SampleId, double> >::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        windowAdd(it->first, it->second);
+    }
+
+    void load(istream& forestS, LoadMode mode) {
+      int version = 1;
+      forestS >> ws;
+      if(forestS.peek() == 'i') {
+        string tag;
+        forestS >> tag >> version;
+      }
+      TreeState ts;
+      if(version < 3)
+        forestS >> ts.seed;
+      if(version >= 4)
+        loadConfig(forestS, version, config);
+      int nTrees;
+      forestS >> nTrees;
+      int nSamples;
+      forestS >> nSamples;
+      map<long, Sample*> sampleMap;
+      loadSamples(forestS, version, nSamples, sampleMap, samples, features);
+      if(version >= 6 && windowed())
+        loadWindow(forestS, version);
+      resizeTreeStates(nTrees);
+
+      if(version < 2) {
+        for(int i = 0; i < nTrees; ++i)
+          forest.push_back(checkLoadedTree(loadDecisionTreeNodeForForest<long>(ts, forestS, sampleMap)));
+        seedTrees(ts, treeStates);
+        return;
+      }
+
+      vector<string> records(nTrees);
+      unsigned long totalNodes = 0;
+      for(int i = 0; i < nTrees; ++i) {
+        unsigned long nodeCount;
+        if(mode == LOAD_EAGER) {
+          string record;
+          readDecisionTreeRecord(forestS, version, nodeCount, treeStates[i], record);
+          forest.push_back(loadDecisionTreeFromRecord(record, sampleMap));
+        } else
+          readDecisionTreeRecord(forestS, version, nodeCount, treeStates[i], records[i]);
+        totalNodes += nodeCount;
+      }
+      if(version < 3) {
+        advanceSeed(ts, totalNodes);
+        seedTrees(ts, treeStates);
+      }
+
+      if(mode == LOAD_PARALLEL) {
+        loadDecisionTreesInParallel(records, sampleMap, forest);
+      } else if(mode == LOAD_LAZY) {
+        forest.resize(nTrees, 0);
+        pendingTrees.swap(records);
+        pendingSampleMap.swap(sampleMap);
+        countPending = nTrees;
+      }
+    }
+
+    DecisionTreeNode* tree(size_t treeId) {
+      if(!forest[treeId]) {
+        forest[treeId] = loadDecisionTreeFromRecord(pendingTrees[treeId], pendingSampleMap);
+        string().swap(pendingTrees[treeId]);
+        if(--countPending == 0) {
+          pendingTrees.clear();
+          pendingSampleMap.clear();
+        }
+      }
+      return forest[treeId];
+    }
+
+    void resizeTreeStates(int nTrees) {
+      treeStates.resize(nTrees);
+      for(vector<TreeState>::iterator it = treeStates.begin(); it != treeStates.end(); ++it) {
+        it->config = &config;
+        if(config.maxCounts > 0)
+          it->counted = new CountedNodes();
+      }
+    }
+
+    void loadAllTrees(void) {
+      for(size_t i = 0; countPending > 0 && i < forest.size(); ++i)
+        tree(i);
     }
-  };
 
-  class Forest {
-  private:
-    map<string, Sample*> samples;
-    map<string, Sample*> toAdd;
-    map<string, Sample*> toRemove;
-    vector<DecisionTreeNode*> forest;
-    bool changesToCommit;
-    TreeState ts;
   public:
-    Forest(istream& forestS) {
-      map<long, Sample*> sampleMap;
-      loadRandomForest(ts, forestS, forest, samples);
+    // with a sample file, features are written there as they are read
+    Forest(istream& forestS, LoadMode mode, SampleFile* file) :
+      logS(0), countPending(0), windowSeq(0), windowSavedSeq(0), windowLatest(0), countExpired(0) {
+      if(file)
+        features.setFile(file, samples);
+      load(forestS, mode);
       changesToCommit = false;
+      dirtyTrees.resize(forest.size(), false);
+      windowSavedSeq = windowSeq;
     }
 
-    Forest(int nTrees) {
+    Forest(int nTrees, const ForestConfig& withConfig) :
+      config(withConfig), logS(0), countPending(0), windowSeq(0), windowSavedSeq(0), windowLatest(0), countExpired(0) {
+      TreeState ts;
+      resizeTreeStates(nTrees);
+      seedTrees(ts, treeStates);
       for(int i=0; i < nTrees; ++i)
-        forest.push_back(emptyDecisionTree(ts));
+        forest.push_back(emptyDecisionTree(treeStates[i]));
       changesToCommit = false;
+      dirtyTrees.resize(forest.size(), false);
     }
 
     ~Forest(void) {
       for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
           itTree != forest.end();
           ++itTree) {
-        destroyDecisionTreeNode(*itTree);
+        if(*itTree)
+          destroyDecisionTreeNode(*itTree);
       }
-      map<string, Sample*>::iterator itAdd;
+      for(vector<TreeState>::iterator it = treeStates.begin(); it != treeStates.end(); ++it)
+        delete it->counted;
+      map<SampleId, Sample*>::iterator itAdd;
       for(itAdd = toAdd.begin(); itAdd != toAdd.end(); ++itAdd) {
         delete itAdd->second;
       }
-      map<string, Sample*>::iterator itMap;
-      for(itMap = samples.begin(); itMap != samples.end(); ++itMap) {
-        delete itMap->second;
+      vector<Sample*> owned;
+      samples.all(owned);
+      for(vector<Sample*>::iterator itOwned = owned.begin(); itOwned != owned.end(); ++itOwned) {
+        delete *itOwned;
+      }
+    }
+
+    const ForestConfig& getConfig(void) const {
+      return config;
+    }
+
+    bool setSampleFile(const char* fileName) {
+      if(features.hasFile())
+        return false;
+      commit();
+      SampleFile* file = createSampleFile(fileName);
+      return file && features.setFile(file, samples);
+    }
+
+    void setLog(ostream* withLogS) {
+      logS = withLogS;
+    }
+
+    // applies logged operations through the normal add/remove/commit path
+    // a truncated last record (as left by a crash mid-append) is ignored: records are only
+    // complete with their newline, as a cut one could still parse, as a shorter id or value
+    bool replayLog(istream& inS) {
+      ostream* savedLogS = logS;
+      logS = 0;
+      bool ok = true;
+      string line;
+      while(getline(inS, line)) {
+        if(inS.eof())
+          break;
+        if(line.empty())
+          continue;
+        istringstream recordS(line);
+        char op;
+        recordS >> op;
+        if(op == 'a' || op == 'u') {
+          Sample* s = parseLoggedAdd(recordS, op == 'u');
+          if(!s) {
+            ok = inS.eof();
+            break;
+          }
+          add(s);
+        } else if(op == 'A' || op == 'U') {
+          double timestamp;
+          Sample* s = (recordS >> timestamp) ? parseLoggedAdd(recordS, op == 'U') : 0;
+          if(!s) {
+            ok = inS.eof();
+            break;
+          }
+          add(s, timestamp);
+        } else if(op == 'r') {
+          string sId;
+          if(!(recordS >> sId)) {
+            ok = inS.eof();
+            break;
+          }
+          remove(sId.c_str());
+        } else if(op == 'x') {
+          uint64_t uid;
+          if(!(recordS >> uid)) {
+            ok = inS.eof();
+            break;
+          }
+          removeUid(uid);
+        } else if(op == 'l' || op == 'L') {
+          SampleId id;
+          float y;
+          if(!(op == 'L' ? recordS >> id.uid : recordS >> id.suid) || !(recordS >> y)) {
+            ok = inS.eof();
+            break;
+          }
+          relabel(id, y);
+        } else if(op == 'p' || op == 'P') {
+          SampleId id;
+          map<int, float> added;
+          vector<int> removed;
+          if(!(op == 'P' ? recordS >> id.uid : recordS >> id.suid) || !parseLoggedPatch(recordS, added, removed)) {
+            ok = inS.eof();
+            break;
+          }
+          patch(id, added, removed);
+        } else if(op == 'c') {
+          commit();
+        } else {
+          ok = false;
+          break;
+        }
       }
+      logS = savedLogS;
+      return ok;
     }
 
     bool add(Sample* s) {
+      if(logS)
+        logAdd(*logS, s);
+      return addUnlogged(s, windowLatest);
+    }
+
+    bool add(Sample* s, double timestamp) {
+      if(logS)
+        logTimedAdd(*logS, s, timestamp);
+      return addUnlogged(s, timestamp);
+    }
+
+    bool addUnlogged(Sample* s, double timestamp) {
+      SampleId id(s);
+      if(windowed())
+        windowAdd(id, timestamp);
       changesToCommit = true;
-      map<string, Sample*>::iterator itAdd = toAdd.find(s->suid);
+      map<SampleId, Sample*>::iterator itAdd = toAdd.find(id);
 
       bool added = false;
       if(itAdd != toAdd.end()) {
         delete itAdd->second;
       } else {
         added = true;
-        map<string, Sample*>::iterator itRemove = toRemove.find(s->suid);
-        map<string, Sample*>::iterator itMap = samples.find(s->suid);
+        map<SampleId, Sample*>::iterator itRemove = toRemove.find(id);
+        Sample* committed = samples.find(id);
 
         if(itRemove == toRemove.end()) {
           // no remove record
-          if(itMap != samples.end()) {
-            toRemove[itMap->first] = itMap->second;
+          if(committed) {
+            toRemove[id] = committed;
           }
         }
       }
 
-      toAdd[s->suid] = s;
+      toAdd[id] = s;
       return added;
     }
 
     bool remove(const char* sId) {
-      map<string, Sample*>::iterator itAdd = toAdd.find(sId);
+      // an empty suid would stand for a uid
+      return *sId && remove(SampleId(sId));
+    }
+
+    bool removeUid(uint64_t uid) {
+      return remove(SampleId(uid));
+    }
+
+    bool remove(const SampleId& id) {
+      map<SampleId, Sample*>::iterator itAdd = toAdd.find(id);
       if(itAdd != toAdd.end()) {
+        if(logS)
+          logRemove(*logS, id);
         delete itAdd->second;
         toAdd.erase(itAdd);
+        windowLive.erase(id);
         changesToCommit = true;
         return true;
       }
 
-      map<string, Sample*>::iterator itRemove = toRemove.find(sId);
+      map<SampleId, Sample*>::iterator itRemove = toRemove.find(id);
       if(itRemove != toRemove.end())
         return false;
 
-      map<string, Sample*>::iterator itMap = samples.find(sId);
-      if(itMap == samples.end())
+      Sample* committed = samples.find(id);
+      if(!committed)
         return false;
 
+      if(logS)
+        logRemove(*logS, id);
       changesToCommit = true;
 
-      toRemove[sId] = itMap->second;
+      toRemove[id] = committed;
+      windowLive.erase(id);
+
+      return true;
+    }
+
+    bool relabel(const SampleId& id, float y) {
+      // not in the trees yet
+      map<SampleId, Sample*>::iterator itAdd = toAdd.find(id);
+      if(itAdd != toAdd.end()) {
+        if(logS)
+          logRelabel(*logS, id, y);
+        itAdd->second->y = y;
+        return true;
+      }
+
+      if(toRemove.find(id) != toRemove.end())
+        return false;
+      Sample* s = samples.find(id);
+      if(!s)
+        return false;
+
+      if(logS)
+        logRelabel(*logS, id, y);
+      float oldY = s->y;
+      s->y = y;
+      // deltas carry the label even when no tree changes, as applyDelta updates samples in
+      // place, where the trees it leaves alone find them
+      changedSamples.insert(id);
+      // nothing counted differently
+      if((y > 0.5) == (oldY > 0.5) && (y >= 0.5) == (oldY >= 0.5))
+        return true;
+
+      TreeMembership membership(s);
+      for(size_t t = 0; t < forest.size(); ++t) {
+        if(!membership.inTree(t))
+          continue;
+        forest[t] = relabelDecisionTree(treeStates[t], tree(t), s, oldY);
+        dirtyTrees[t] = true;
+        if(config.maxCounts > 0)
+          evictColdCounts(treeStates[t], forest[t], config.maxCounts / forest.size());
+      }
+      return true;
+    }
+
+    // removed codes are dropped first, so that a code in both ends up with its added value
+    bool patch(const SampleId& id, const map<int, float>& added, const vector<int>& removed) {
+      // not in the trees yet
+      map<SampleId, Sample*>::iterator itAdd = toAdd.find(id);
+      if(itAdd != toAdd.end()) {
+        if(logS)
+          logPatch(*logS, id, added, removed);
+        patchCodes(itAdd->second->xCodes, added, removed);
+        return true;
+      }
+
+      if(toRemove.find(id) != toRemove.end())
+        return false;
+      Sample* s = samples.find(id);
+      if(!s)
+        return false;
+
+      if(logS)
+        logPatch(*logS, id, added, removed);
+
+      Sample before;
+      swapFeatures(s, &before);
+      CodeLoader loader(s->xCodes);
+      visitSampleCodes(&before, loader);
+      patchCodes(s->xCodes, added, removed);
+
+      vector<int> patched;
+      vector<int>::const_iterator itRemoved;
+      for(itRemoved = removed.begin(); itRemoved != removed.end(); ++itRemoved) {
+        float value;
+        if(findCode(&before, *itRemoved, value) && !s->xCodes.count(*itRemoved))
+          patched.push_back(*itRemoved);
+      }
+      map<int, float>::const_iterator itAdded;
+      for(itAdded = added.begin(); itAdded != added.end(); ++itAdded) {
+        float value;
+        if(!findCode(&before, itAdded->first, value) || value != itAdded->second)
+          patched.push_back(itAdded->first);
+      }
+      if(patched.empty()) {
+        swapFeatures(s, &before);
+        return true;
+      }
+      sort(patched.begin(), patched.end());
+      patched.erase(unique(patched.begin(), patched.end()), patched.end());
+
+      features.intern(s);
+      changedSamples.insert(id);
+
+      TreeMembership membership(s);
+      for(size_t t = 0; t < forest.size(); ++t) {
+        if(!membership.inTree(t))
+          continue;
+        forest[t] = patchDecisionTree(treeStates[t], tree(t), s, &before, patched);
+        dirtyTrees[t] = true;
+        if(config.maxCounts > 0)
+          evictColdCounts(treeStates[t], forest[t], config.maxCounts / forest.size());
+      }
+      features.release(&before);
+      return true;
+    }
 
+    // a forest with no samples yet has all its trees grown at once, in parallel
+    bool canBuildInBulk(void) const {
+      if(!samples.empty() || !toRemove.empty() || toAdd.empty())
+        return false;
+      for(vector<DecisionTreeNode*>::const_iterator itTree = forest.begin(); itTree != forest.end(); ++itTree) {
+        if(!isEmptyDecisionTree(*itTree))
+          return false;
+      }
       return true;
     }
 
@@ -1414,30 +3881,61 @@ namespace IncrementalRandomForest {
       if(!changesToCommit)
         return;
 
-      map<string, Sample*>::iterator sIt;
+      if(logS)
+        logCommit(*logS);
 
-      int treeId = 0;
-      for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
-          itTree != forest.end();
-          ++itTree, ++treeId) {
-        vector<Sample*> treeAdd, treeRemove;
-        for(sIt = toRemove.begin(); sIt != toRemove.end(); ++sIt) {
-          if(sampleInTree(sIt->second, treeId))
-            treeRemove.push_back(sIt->second);
+      // not logged, as replaying the adds expires the same samples
+      if(windowed())
+        expireWindow();
+
+      map<SampleId, Sample*>::iterator sIt;
+
+      // before the trees see them, so that samples with the same features are counted together
+      for(sIt = toAdd.begin(); sIt != toAdd.end(); ++sIt)
+        features.intern(sIt->second);
+
+      if(canBuildInBulk()) {
+        vector<size_t> treeSizes;
+        buildDecisionTreesInParallel(toAdd, forest, treeStates, treeSizes);
+        for(size_t i = 0; i < forest.size(); ++i) {
+          if(treeSizes[i] > 0) {
+            dirtyTrees[i] = true;
+            if(config.maxCounts > 0)
+              evictColdCounts(treeStates[i], forest[i], config.maxCounts / forest.size());
+          }
         }
-        for(sIt = toAdd.begin(); sIt != toAdd.end(); ++sIt) {
-          if(sampleInTree(sIt->second, treeId))
-            treeAdd.push_back(sIt->second);
+      } else {
+        vector<vector<Sample*> > treeAdds, treeRemoves;
+        splitByTree(toAdd, forest.size(), treeAdds);
+        splitByTree(toRemove, forest.size(), treeRemoves);
+        int treeId = 0;
+        for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
+            itTree != forest.end();
+            ++itTree, ++treeId) {
+          const vector<Sample*>& treeAdd = treeAdds[treeId];
+          const vector<Sample*>& treeRemove = treeRemoves[treeId];
+          if(treeAdd.empty() && treeRemove.empty() && !*itTree)
+            continue; // not loaded yet and nothing would change
+          *itTree = updateDecisionTree(treeStates[treeId], tree(treeId), treeAdd, treeRemove);
+          if(!treeAdd.empty() || !treeRemove.empty()) {
+            dirtyTrees[treeId] = true;
+            if(config.maxCounts > 0)
+              evictColdCounts(treeStates[treeId], *itTree, config.maxCounts / forest.size());
+          }
         }
-        *itTree = updateDecisionTree(ts, *itTree, treeAdd, treeRemove);
       }
 
       for(sIt = toRemove.begin(); sIt != toRemove.end(); ++sIt) {
-        delete sIt->second;
+        // the index is keyed by the sample's own id
         samples.erase(sIt->first);
+        features.release(sIt->second);
+        delete sIt->second;
+        changedSamples.insert(sIt->first);
+      }
+      for(sIt = toAdd.begin(); sIt != toAdd.end(); ++sIt) {
+        samples.insert(sIt->second);
+        changedSamples.insert(sIt->first);
       }
-      for(sIt = toAdd.begin(); sIt != toAdd.end(); ++sIt)
-        samples[sIt->first] = sIt->second;
 
       toAdd.clear();
       toRemove.clear();
@@ -1446,63 +3944,301 @@ namespace IncrementalRandomForest {
 
     void asJSON(ostream& outS) {
       commit();
+      loadAllTrees();
       outS << "[";
       for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
           itTree != forest.end();
           ++itTree) {
         if(itTree != forest.begin())
           outS << ",";
-        outputDecisionTree(ts, *itTree, outS);
+        outputDecisionTree(treeStates[itTree - forest.begin()], *itTree, outS);
       }
       outS << "]";
     }
 
     void statsJSON(ostream& outS) {
       commit();
+      loadAllTrees();
       outS << "[";
       for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
           itTree != forest.end();
           ++itTree) {
         if(itTree != forest.begin())
           outS << ",";
-        outputDecisionTreeWithStats(ts, *itTree, outS);
+        outputDecisionTreeWithStats(treeStates[itTree - forest.begin()], *itTree, outS);
       }
       outS << "]";
     }
 
+    // summed over all trees, kept apart from statsJSON so that its array of trees stays as it was
+    void countersJSON(ostream& outS) {
+      commit();
+      TreeCounters counters;
+      for(vector<TreeState>::const_iterator itState = treeStates.begin(); itState != treeStates.end(); ++itState) {
+        const TreeState& ts = *itState;
+        counters.depthLimited += ts.counters.depthLimited;
+        counters.sizeLimited += ts.counters.sizeLimited;
+        counters.leafSizeLimited += ts.counters.leafSizeLimited;
+        counters.resplits += ts.counters.resplits;
+        counters.resplitSamples += ts.counters.resplitSamples;
+        counters.resplitsHeld += ts.counters.resplitsHeld;
+        counters.nodeUpdates += ts.counters.nodeUpdates;
+        counters.countsEvicted += ts.counters.countsEvicted;
+        counters.countsRebuilt += ts.counters.countsRebuilt;
+      }
+      outS << "{\"depthLimited\":" << counters.depthLimited;
+      outS << ",\"sizeLimited\":" << counters.sizeLimited;
+      outS << ",\"leafSizeLimited\":" << counters.leafSizeLimited;
+      outS << ",\"resplits\":" << counters.resplits;
+      outS << ",\"resplitSamples\":" << counters.resplitSamples;
+      outS << ",\"resplitsHeld\":" << counters.resplitsHeld;
+      outS << ",\"nodeUpdates\":" << counters.nodeUpdates;
+      outS << ",\"countsEvicted\":" << counters.countsEvicted;
+      outS << ",\"countsRebuilt\":" << counters.countsRebuilt;
+      outS << ",\"expired\":" << countExpired;
+      outS << "}";
+    }
+
     bool save(ostream& outS) {
       commit();
-      outS << ts.seed << endl;
+      loadAllTrees();
+      outS << "irf " << forestFormatVersion << endl;
+      saveConfig(config, outS);
       outS << forest.size() << endl;
 
       outS << samples.size() << endl;
-      map<string, Sample*>::const_iterator sIt;
-      for(sIt = samples.begin(); sIt != samples.end(); ++sIt) {
-        const Sample* s = sIt->second;
+      vector<Sample*> sorted;
+      samples.sorted(sorted);
+      for(vector<Sample*>::const_iterator sIt = sorted.begin(); sIt != sorted.end(); ++sIt) {
+        const Sample* s = *sIt;
         outS << (long)s << endl;
-        outS << s->suid << endl;
+        outS << SampleId(s) << endl;
         outS << s->y << endl;
-        map<int, float>::const_iterator codeIt;
-        outS << s->xCodes.size() << endl;
-        for(codeIt = s->xCodes.begin(); codeIt != s->xCodes.end(); ++codeIt)
-          outS << codeIt->first << " " << codeIt->second << endl;
+        outS << countCodes(s) << endl;
+        CodeWriter writer(outS, "", "\n");
+        visitSampleCodes(s, writer);
       }
+      if(windowed())
+        saveWindow(outS);
 
       for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
           itTree != forest.end();
           ++itTree) {
-        saveDecisionTreeInForest(ts, *itTree, outS);
+        saveDecisionTreeInForest(treeStates[itTree - forest.begin()], *itTree, outS);
+      }
+      clearChanges();
+      return true;
+    }
+
+    void clearChanges(void) {
+      dirtyTrees.assign(forest.size(), false);
+      changedSamples.clear();
+      windowSavedSeq = windowSeq;
+    }
+
+    // only the samples and trees that changed since the last save, starting with
+    //   irfdelta <version>
+    // older deltas start with just "delta" and a single seed, like version 2 snapshots
+    bool saveDelta(ostream& outS) {
+      commit();
+      loadAllTrees();
+      outS << "irfdelta " << forestFormatVersion << endl;
+      outS << forest.size() << endl;
+
+      outS << changedSamples.size() << endl;
+      for(set<SampleId>::const_iterator cIt = changedSamples.begin(); cIt != changedSamples.end(); ++cIt) {
+        const Sample* s = samples.find(*cIt);
+        if(!s) {
+          outS << "-" << endl;
+          outS << *cIt << endl;
+          continue;
+        }
+        outS << "+" << endl;
+        outS << *cIt << endl;
+        outS << s->y << endl;
+        outS << countCodes(s) << endl;
+        CodeWriter writer(outS, "", "\n");
+        visitSampleCodes(s, writer);
+      }
+      // the removed samples are out of the window too
+      if(windowed())
+        saveWindowAdded(outS);
+
+      outS << count(dirtyTrees.begin(), dirtyTrees.end(), true) << endl;
+      for(size_t i = 0; i < forest.size(); ++i) {
+        if(!dirtyTrees[i])
+          continue;
+        outS << i << " " << treeStates[i].seed << endl;
+        saveDecisionTreeNodeInForest<SampleId>(forest[i], outS);
+      }
+      clearChanges();
+      return true;
+    }
+
+    // nothing is changed until the whole delta has been read. samples already in the forest keep
+    // their objects, with the new contents moved in, as trees not in the delta point to them too
+    bool applyDelta(istream& inS) {
+      commit();
+      loadAllTrees();
+      string tag;
+      inS >> tag;
+      int version;
+      TreeState ts;
+      if(tag == "delta") {
+        version = 2;
+        inS >> ts.seed;
+      } else if(tag == "irfdelta")
+        inS >> version;
+      else
+        return false;
+      size_t nTrees;
+      inS >> nTrees;
+      if(!inS || nTrees != forest.size())
+        return false;
+
+      ParsedDelta delta;
+      int nChanged;
+      if(!(inS >> nChanged))
+        return false;
+      for(int i = 0; i < nChanged; ++i) {
+        string op;
+        SampleId id;
+        if(!(inS >> op) || !readSampleId(inS, version, id))
+          return false;
+        // the last change to an id wins
+        Sample*& staged = delta.staged[id];
+        delete staged;
+        staged = 0;
+        if(op == "-") {
+          delta.removedIds.push_back(id);
+          continue;
+        }
+        Sample* s = new Sample();
+        setSampleId(s, id);
+        staged = s;
+        int countSampleCodes;
+        if(!(inS >> s->y >> countSampleCodes))
+          return false;
+        for(int j = 0; j < countSampleCodes; ++j) {
+          int code;
+          float value;
+          if(!(inS >> code >> value))
+            return false;
+          s->xCodes[code] = value;
+        }
+      }
+      vector<pair<SampleId, double> > windowEntries;
+      if(version >= 6 && windowed() && !readWindow(inS, version, windowEntries))
+        return false;
+
+      int nDirty = 0;
+      if(!(inS >> nDirty))
+        return false;
+      for(int i = 0; i < nDirty; ++i) {
+        size_t treeId;
+        if(!(inS >> treeId) || treeId >= forest.size())
+          return false;
+        unsigned int seed = treeStates[treeId].seed;
+        if(version >= 3 && !(inS >> seed))
+          return false;
+        TreeState scratch;
+        DecisionTreeNode* dt = loadDecisionTreeNodeForForest<string>(scratch, inS, DeltaSamples(samples, delta.staged, version));
+        if(!dt)
+          return false;
+        delta.trees.push_back(make_pair(treeId, make_pair(seed, dt)));
+      }
+
+      for(size_t i = 0; i < delta.trees.size(); ++i) {
+        const size_t treeId = delta.trees[i].first;
+        treeStates[treeId].seed = delta.trees[i].second.first;
+        destroyDecisionTreeNode(forest[treeId]);
+        forest[treeId] = delta.trees[i].second.second;
+        if(treeStates[treeId].counted)
+          treeStates[treeId].counted->complete = false;
+      }
+      delta.trees.clear();
+      vector<Sample*> removed, changed;
+      for(map<SampleId, Sample*>::iterator sIt = delta.staged.begin(); sIt != delta.staged.end(); ++sIt) {
+        Sample* old = samples.find(sIt->first);
+        Sample* s = sIt->second;
+        sIt->second = 0;
+        if(!s) {
+          if(old) {
+            samples.erase(sIt->first);
+            removed.push_back(old);
+          }
+        } else if(old) {
+          features.release(old);
+          old->y = s->y;
+          old->xCodes.swap(s->xCodes);
+          delete s;
+          changed.push_back(old);
+        } else {
+          samples.insert(s);
+          changed.push_back(s);
+        }
+      }
+      for(vector<Sample*>::iterator rIt = removed.begin(); rIt != removed.end(); ++rIt) {
+        features.release(*rIt);
+        delete *rIt;
+      }
+      for(vector<Sample*>::iterator cIt = changed.begin(); cIt != changed.end(); ++cIt)
+        features.intern(*cIt);
+
+      if(version >= 6 && windowed()) {
+        if(version < 9) {
+          // the whole window
+          windowLive.clear();
+          window.clear();
+          windowLatest = 0;
+        } else {
+          for(vector<SampleId>::const_iterator rIt = delta.removedIds.begin(); rIt != delta.removedIds.end(); ++rIt)
+            windowLive.erase(*rIt);
+        }
+        for(vector<pair<SampleId, double> >::const_iterator wIt = windowEntries.begin(); wIt != windowEntries.end(); ++wIt)
+          windowAdd(wIt->first, wIt->second);
       }
+      if(version < 3)
+        seedTrees(ts, treeStates);
+      clearChanges();
       return true;
     }
 
+    bool saveModel(ostream& outS) {
+      commit();
+      loadAllTrees();
+      ModelHeader h;
+      memcpy(h.magic, modelMagic, sizeof(modelMagic));
+      h.version = modelVersion;
+      h.nTrees = forest.size();
+      h.nNodes = 0;
+      vector<uint32_t> roots;
+      for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
+          itTree != forest.end();
+          ++itTree) {
+        roots.push_back(h.nNodes);
+        h.nNodes += countDecisionTreeNodes(*itTree);
+      }
+      outS.write((const char*)&h, sizeof(h));
+      if(!roots.empty())
+        outS.write((const char*)&roots[0], roots.size() * sizeof(uint32_t));
+      uint32_t index = 0;
+      for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
+          itTree != forest.end();
+          ++itTree) {
+        index = saveDecisionTreeNodeInModel(*itTree, index, outS);
+      }
+      return outS.good();
+    }
+
     float classify(Sample* s) {
       commit();
+      loadAllTrees();
       double v = 0;
       for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
           itTree != forest.end();
           ++itTree) {
-        double dv = evaluateSampleAgainstDecisionTree(ts, s, *itTree);
+        double dv = evaluateSampleAgainstDecisionTree(treeStates[itTree - forest.begin()], s, *itTree);
         v += dv;
       }
       return v / forest.size();
@@ -1510,22 +4246,47 @@ namespace IncrementalRandomForest {
 
     float classifyPartial(Sample* s, int n) {
       commit();
+      n = min(n, (int) forest.size());
       double v = 0;
+      for(int i = 0; i < n; ++i)
+        tree(i);
       vector<DecisionTreeNode*>::iterator itStop = forest.begin() + n;
       for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
           itTree != itStop;
           ++itTree) {
-        double dv = evaluateSampleAgainstDecisionTree(ts, s, *itTree);
+        double dv = evaluateSampleAgainstDecisionTree(treeStates[itTree - forest.begin()], s, *itTree);
         v += dv;
       }
       return v / n;
     }
 
+    // tree by tree, so that each stays in cache for the whole batch
+    void classifyBatch(int n, const int* offsets, const int* codes, const float* values, float* out) {
+      commit();
+      loadAllTrees();
+      vector<double> v(n, 0);
+      vector<RowFeatures> rows(n);
+      for(int i = 0; i < n; ++i) {
+        rows[i].codes = codes + offsets[i];
+        rows[i].values = values + offsets[i];
+        rows[i].n = offsets[i + 1] - offsets[i];
+      }
+      for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
+          itTree != forest.end();
+          ++itTree) {
+        for(int i = 0; i < n; ++i)
+          v[i] += evaluateRowAgainstDecisionTree(rows[i], *itTree);
+      }
+      for(int i = 0; i < n; ++i)
+        out[i] = v[i] / forest.size();
+    }
+
     bool validate(void) {
+      loadAllTrees();
       for(vector<DecisionTreeNode*>::iterator itTree = forest.begin();
           itTree != forest.end();
           ++itTree) {
-        if(!validateDecisionTree(ts, *itTree))
+        if(!validateDecisionTree(treeStates[itTree - forest.begin()], *itTree))
           return false;
       }
       return true;
@@ -1535,12 +4296,53 @@ namespace IncrementalRandomForest {
       commit();
       return new MapSampleWalker(samples);
     }
+
+    void countSamples(int& nSamples, int& nCodes) {
+      commit();
+      nSamples = samples.size();
+      nCodes = 0;
+      vector<Sample*> all;
+      samples.all(all);
+      for(vector<Sample*>::const_iterator it = all.begin(); it != all.end(); ++it)
+        nCodes += countCodes(*it);
+    }
+
+    void exportSamples(const char** ids, uint64_t* uids, int* offsets, int* codes, float* values, float* ys) {
+      commit();
+      int i = 0;
+      int j = 0;
+      if(offsets)
+        offsets[0] = 0;
+      vector<Sample*> sorted;
+      samples.sorted(sorted);
+      for(vector<Sample*>::const_iterator it = sorted.begin(); it != sorted.end(); ++it, ++i) {
+        const Sample* s = *it;
+        if(ids)
+          ids[i] = s->suid.c_str();
+        if(uids)
+          uids[i] = s->suid.empty() ? s->uid : 0;
+        if(ys)
+          ys[i] = s->y;
+        CodeExporter exporter(codes, values, j);
+        visitSampleCodes(s, exporter);
+        if(offsets)
+          offsets[i + 1] = j;
+      }
+    }
   };
 
   /* visible outside module */
 
   Forest* create(int nTrees) {
-    return new Forest(nTrees);
+    return new Forest(nTrees, ForestConfig());
+  }
+
+  Forest* create(int nTrees, const ForestConfig& config) {
+    return new Forest(nTrees, config);
+  }
+
+  const ForestConfig& getConfig(Forest* rf) {
+    return rf->getConfig();
   }
 
   void destroy(Forest* rf) {
@@ -1548,13 +4350,82 @@ namespace IncrementalRandomForest {
   }
 
   Forest* load(istream& forestS) {
-    return new Forest(forestS);
+    return new Forest(forestS, LOAD_EAGER, 0);
+  }
+
+  Forest* load(istream& forestS, LoadMode mode) {
+    return new Forest(forestS, mode, 0);
+  }
+
+  Forest* load(istream& forestS, LoadMode mode, const char* sampleFileName) {
+    SampleFile* file = createSampleFile(sampleFileName);
+    if(!file)
+      return 0;
+    return new Forest(forestS, mode, file);
   }
 
   bool save(Forest* rf, ostream& outS) {
     return rf->save(outS);
   }
 
+  Forest* load(Source& in, LoadMode mode) {
+    SourceStreamBuf buf(in);
+    istream inS(&buf);
+    return new Forest(inS, mode, 0);
+  }
+
+  Forest* load(Source& in, LoadMode mode, const char* sampleFileName) {
+    SampleFile* file = createSampleFile(sampleFileName);
+    if(!file)
+      return 0;
+    SourceStreamBuf buf(in);
+    istream inS(&buf);
+    return new Forest(inS, mode, file);
+  }
+
+  bool save(Forest* rf, Sink& out) {
+    SinkStreamBuf buf(out);
+    ostream outS(&buf);
+    bool ok = rf->save(outS);
+    return buf.finish() && ok;
+  }
+
+  bool saveModel(Forest* rf, ostream& outS) {
+    return rf->saveModel(outS);
+  }
+
+  Model* loadModel(const char* fileName) {
+    int fd = open(fileName, O_RDONLY);
+    if(fd == -1)
+      return 0;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      return 0;
+    }
+    void* data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+      return 0;
+    if(!Model::check(data, st.st_size)) {
+      munmap(data, st.st_size);
+      return 0;
+    }
+    return new Model(data, st.st_size);
+  }
+
+  void destroy(Model* m) {
+    delete m;
+  }
+
+  float classify(Model* m, Sample* s) {
+    return m->classify(s);
+  }
+
+  float classifyPartial(Model* m, Sample* s, int n) {
+    return m->classifyPartial(s, n);
+  }
+
   void asJSON(Forest* rf, ostream& outS) {
     rf->asJSON(outS);
   }
@@ -1563,14 +4434,42 @@ namespace IncrementalRandomForest {
     rf->statsJSON(outS);
   }
 
+  void countersJSON(Forest* rf, ostream& outS) {
+    rf->countersJSON(outS);
+  }
+
   bool add(Forest* rf, Sample* s) {
     return rf->add(s);
   }
 
+  bool add(Forest* rf, Sample* s, double timestamp) {
+    return rf->add(s, timestamp);
+  }
+
   bool remove(Forest* rf, const char* sId) {
     return rf->remove(sId);
   }
 
+  bool removeUid(Forest* rf, uint64_t uid) {
+    return rf->removeUid(uid);
+  }
+
+  bool relabel(Forest* rf, const char* sId, float y) {
+    return *sId && rf->relabel(SampleId(sId), y);
+  }
+
+  bool relabelUid(Forest* rf, uint64_t uid, float y) {
+    return rf->relabel(SampleId(uid), y);
+  }
+
+  bool patch(Forest* rf, const char* sId, const map<int, float>& added, const vector<int>& removed) {
+    return *sId && rf->patch(SampleId(sId), added, removed);
+  }
+
+  bool patchUid(Forest* rf, uint64_t uid, const map<int, float>& added, const vector<int>& removed) {
+    return rf->patch(SampleId(uid), added, removed);
+  }
+
   void commit(Forest* rf) {
     rf->commit();
   }
@@ -1583,6 +4482,41 @@ namespace IncrementalRandomForest {
     return rf->classifyPartial(s, n);
   }
 
+  int addBatch(Forest* rf, int n, const char* const* ids, const int* offsets, const int* codes, const float* values, const float* ys) {
+    int added = 0;
+    for(int i = 0; i < n; ++i) {
+      // an empty suid would stand for a uid
+      if(!*ids[i])
+        continue;
+      Sample* s = new Sample();
+      s->suid = ids[i];
+      s->y = ys[i];
+      for(int j = offsets[i]; j < offsets[i + 1]; ++j)
+        s->xCodes[codes[j]] = values[j];
+      if(rf->add(s))
+        ++added;
+    }
+    return added;
+  }
+
+  int addBatch(Forest* rf, int n, const uint64_t* uids, const int* offsets, const int* codes, const float* values, const float* ys) {
+    int added = 0;
+    for(int i = 0; i < n; ++i) {
+      Sample* s = new Sample();
+      s->uid = uids[i];
+      s->y = ys[i];
+      for(int j = offsets[i]; j < offsets[i + 1]; ++j)
+        s->xCodes[codes[j]] = values[j];
+      if(rf->add(s))
+        ++added;
+    }
+    return added;
+  }
+
+  void classifyBatch(Forest* rf, int n, const int* offsets, const int* codes, const float* values, float* out) {
+    rf->classifyBatch(n, offsets, codes, values, out);
+  }
+
   bool validate(Forest* rf) {
     return rf->validate();
   }
@@ -1590,4 +4524,107 @@ namespace IncrementalRandomForest {
   SampleWalker* getSamples(Forest* rf) {
     return rf->getSamples();
   }
+
+  void countSamples(Forest* rf, int& nSamples, int& nCodes) {
+    rf->countSamples(nSamples, nCodes);
+  }
+
+  void exportSamples(Forest* rf, const char** ids, uint64_t* uids, int* offsets, int* codes, float* values, float* ys) {
+    rf->exportSamples(ids, uids, offsets, codes, values, ys);
+  }
+
+  bool readLibsvm(istream& inS, const char* idPrefix, float negativeLabel, vector<Sample*>& samples) {
+    string text((istreambuf_iterator<char>(inS)), istreambuf_iterator<char>());
+    return parseLibsvm(text.data(), text.data() + text.size(), idPrefix, negativeLabel, 1, samples);
+  }
+
+  static int addSamples(Forest* rf, const vector<Sample*>& samples) {
+    int added = 0;
+    for(vector<Sample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+      if(rf->add(*it))
+        ++added;
+    }
+    return added;
+  }
+
+  int addFromStream(Forest* rf, istream& inS, const char* idPrefix, float negativeLabel) {
+    vector<Sample*> samples;
+    if(!readLibsvm(inS, idPrefix, negativeLabel, samples))
+      return -1;
+    return addSamples(rf, samples);
+  }
+
+  int addFromFile(Forest* rf, const char* fileName, const char* idPrefix, float negativeLabel, int nThreads) {
+    int fd = open(fileName, O_RDONLY);
+    if(fd < 0)
+      return -1;
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+      close(fd);
+      return -1;
+    }
+
+    vector<Sample*> samples;
+    bool ok = true;
+    if(st.st_size > 0) {
+      void* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(data == MAP_FAILED) {
+        close(fd);
+        return -1;
+      }
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      const char* text = (const char*) data;
+      ok = parseLibsvm(text, text + st.st_size, idPrefix, negativeLabel, nThreads, samples);
+      munmap(data, st.st_size);
+    }
+    close(fd);
+
+    if(!ok)
+      return -1;
+    return addSamples(rf, samples);
+  }
+
+  bool saveDelta(Forest* rf, ostream& outS) {
+    return rf->saveDelta(outS);
+  }
+
+  bool applyDelta(Forest* rf, istream& inS) {
+    return rf->applyDelta(inS);
+  }
+
+  bool saveDelta(Forest* rf, Sink& out) {
+    SinkStreamBuf buf(out);
+    ostream outS(&buf);
+    bool ok = rf->saveDelta(outS);
+    return buf.finish() && ok;
+  }
+
+  bool applyDelta(Forest* rf, Source& in) {
+    SourceStreamBuf buf(in);
+    istream inS(&buf);
+    return rf->applyDelta(inS);
+  }
+
+  bool compact(istream& baseS, const vector<istream*>& deltas, ostream& outS) {
+    Forest* rf = load(baseS);
+    bool ok = true;
+    for(vector<istream*>::const_iterator dIt = deltas.begin(); ok && dIt != deltas.end(); ++dIt)
+      ok = rf->applyDelta(**dIt);
+    if(ok)
+      ok = rf->save(outS);
+    destroy(rf);
+    return ok;
+  }
+
+  void setLog(Forest* rf, ostream* logS) {
+    rf->setLog(logS);
+  }
+
+  bool replayLog(Forest* rf, istream& logS) {
+    return rf->replayLog(logS);
+  }
+
+  bool setSampleFile(Forest* rf, const char* fileName) {
+    return rf->setSampleFile(fileName);
+  }
 }
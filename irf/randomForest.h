@@ -4,6 +4,7 @@
 #ifndef PCONSTR_RANDOMFOREST_H
 #define PCONSTR_RANDOMFOREST_H
 
+#include <stdint.h>
 #include <map>
 #include <iostream>
 #include <vector>
@@ -11,17 +12,75 @@
 namespace IncrementalRandomForest {
 
   struct DecisionTreeNode;
+  struct StoredCodes;
 
   struct Sample {
     std::string suid;
+    uint64_t uid; // identifies the sample instead when suid is empty, for producers with numeric ids
     float y;
     std::map<int, float> xCodes;
+    // once committed, features are shared by all samples with the same ones, in memory or in a
+    // sample file, leaving xCodes empty
+    const StoredCodes* stored;
+    Sample(void) : uid(0), stored(0) {
+    }
+  };
+
+  // how trees are grown, fixed when the forest is created and saved with it
+  struct ForestConfig {
+    unsigned int maxCodesToConsider; // candidate codes for a split, by rank
+    unsigned int maxCodesToKeep;     // codes with counters kept in each node
+    unsigned int minEvidence;        // samples needed on each side of a split
+    float minEntropyGain;            // split only when entropy drops by more than this
+    // to bound the cost of rebuilding subtrees, 0 for no limit
+    unsigned int maxDepth;           // nodes this deep are not split, the root being at depth 0
+    unsigned int minSamplesLeaf;     // samples needed on each side of a split
+    unsigned int maxUnsplit;         // nodes with up to this many samples are not split
+    // hysteresis, so that nodes don't keep rebuilding their subtrees as near ties flip. a split node
+    // changes code when another beats it by splitMargin in entropy, or has been the best for
+    // splitPatience updates in a row. either rule is off at 0, with both 0 it changes as soon as
+    // another code is best
+    float splitMargin;
+    unsigned int splitPatience;
+    // sliding window: on commit the oldest samples are removed, in the order they were added, to keep
+    // at most windowSize and none older than windowAge before the latest timestamp. 0 for no limit
+    unsigned int windowSize;
+    double windowAge;
+    // memory budget, in counters kept by nodes across the forest (some 20 bytes each), 0 for no limit.
+    // beyond it, after each commit, trees drop the counters of the nodes updates reached longest ago,
+    // and compute them again from the samples below when an update next reaches them
+    unsigned long maxCounts;
+    ForestConfig(void) : maxCodesToConsider(30), maxCodesToKeep(40), minEvidence(2), minEntropyGain(0),
+                         maxDepth(0), minSamplesLeaf(0), maxUnsplit(0), splitMargin(0), splitPatience(0),
+                         windowSize(0), windowAge(0), maxCounts(0) {
+    }
+  };
+
+  // how often the limits in ForestConfig held trees back, and subtrees were rebuilt, since the forest was created or loaded
+  struct TreeCounters {
+    unsigned long depthLimited;    // splits not made because of maxDepth
+    unsigned long sizeLimited;     // splits not made because of maxUnsplit
+    unsigned long leafSizeLimited; // split candidates passed over because of minSamplesLeaf
+    unsigned long resplits;        // subtrees rebuilt as their root changed code
+    unsigned long resplitSamples;  // samples in those subtrees
+    unsigned long resplitsHeld;    // changes of code held back by splitMargin or splitPatience
+    unsigned long nodeUpdates;     // nodes reached by updates
+    unsigned long countsEvicted;   // nodes that had their counters dropped because of maxCounts
+    unsigned long countsRebuilt;   // nodes reached by updates with their counters dropped
+    TreeCounters(void) : depthLimited(0), sizeLimited(0), leafSizeLimited(0), resplits(0), resplitSamples(0), resplitsHeld(0),
+                         nodeUpdates(0), countsEvicted(0), countsRebuilt(0) {
+    }
   };
 
+  struct CountedNodes;
+
   // FIXME: should be opaque
   struct TreeState {
     unsigned int seed;
-    TreeState(void) : seed(1) {
+    const ForestConfig* config;
+    TreeCounters counters;
+    CountedNodes* counted; // nodes keeping counters, in the order updates reached them, owned by the forest. 0 if not kept
+    TreeState(void) : seed(1), config(0), counted(0) {
     }
   };
 
@@ -34,21 +93,109 @@ namespace IncrementalRandomForest {
     virtual Sample* get(void) = 0;
   };
 
+  // chunked output and input, so that a serialized forest need never be held in memory as a whole
+  class Sink {
+  public:
+    virtual ~Sink(void) {
+    }
+    virtual bool write(const char* data, size_t size) = 0;
+  };
+
+  class Source {
+  public:
+    virtual ~Source(void) {
+    }
+    virtual size_t read(char* data, size_t size) = 0; // 0 when there is no more
+  };
+
   class Forest;
 
+  enum LoadMode {
+    LOAD_EAGER,    // parse all trees as they are read
+    LOAD_PARALLEL, // parse trees concurrently, across all cores
+    LOAD_LAZY      // parse each tree only when first needed
+  };
+  class Model; // read-only, memory-mapped forest for classification
+
   Forest* create(int nTrees);
+  Forest* create(int nTrees, const ForestConfig& config);
+  const ForestConfig& getConfig(Forest* rf);
   void destroy(Forest* rf);
   Forest* load(std::istream& forestS);
+  Forest* load(std::istream& forestS, LoadMode mode);
   bool save(Forest* rf, std::ostream& outS);
+  Forest* load(Source& in, LoadMode mode);
+  // features go into a sample file created anew as samples are read, rather than into memory
+  // first, so that the file need not outlive the process. 0 if the file could not be created
+  Forest* load(std::istream& forestS, LoadMode mode, const char* sampleFileName);
+  Forest* load(Source& in, LoadMode mode, const char* sampleFileName);
+  bool save(Forest* rf, Sink& out);
   void asJSON(Forest* rf, std::ostream& outS);
   void statsJSON(Forest* rf, std::ostream& outS);
+  void countersJSON(Forest* rf, std::ostream& outS); // how often limits, hysteresis, budgets and the window acted
   bool add(Forest* rf, Sample* s);
+  bool add(Forest* rf, Sample* s, double timestamp); // samples added without one take the latest given
   bool remove(Forest* rf, const char* sId);
+  // samples identified by uid rather than suid, with no strings formatted, hashed or compared.
+  // They are added with add, leaving suid empty, and can be in the same forest as samples with suids
+  bool removeUid(Forest* rf, uint64_t uid);
+  // changes just the label of a sample, without removing and adding it again. Samples already in the
+  // trees are updated at once, only along their path in each tree, rather than on the next commit
+  bool relabel(Forest* rf, const char* sId, float y);
+  bool relabelUid(Forest* rf, uint64_t uid, float y);
+  // changes just some features of a sample: codes in added are set to their values, and codes in removed
+  // dropped. In each tree it is only moved from the first node that now sends it the other way, and the
+  // nodes above have just the counters for the changed codes updated, at once rather than on commit
+  bool patch(Forest* rf, const char* sId, const std::map<int, float>& added, const std::vector<int>& removed);
+  bool patchUid(Forest* rf, uint64_t uid, const std::map<int, float>& added, const std::vector<int>& removed);
   void commit(Forest* rf);
   float classify(Forest* rf, Sample* s);
   float classifyPartial(Forest* rf, Sample* s, int n);
+  // batches in compressed sparse row layout: sample i has the codes and values at
+  // [offsets[i], offsets[i + 1]), so offsets has n + 1 elements. samples with an empty id are skipped
+  int addBatch(Forest* rf, int n, const char* const* ids, const int* offsets, const int* codes, const float* values, const float* ys);
+  int addBatch(Forest* rf, int n, const uint64_t* uids, const int* offsets, const int* codes, const float* values, const float* ys);
+  void classifyBatch(Forest* rf, int n, const int* offsets, const int* codes, const float* values, float* out);
   bool validate(Forest* rf);
+  // samples in id order, with their features in xCodes. committed ones are given back in one copy that
+  // the next get() overwrites, so take what is needed from each before moving on. the walker is only
+  // good while the forest is not changed
   SampleWalker* getSamples(Forest* rf);
+  // all samples in the same layout, in id order: size the arrays with countSamples, then fill them
+  // ids point into the forest and stay valid until it is changed, and are empty for samples with a uid,
+  // which is in uids instead (0 for samples with a suid). any of the arrays may be 0 to skip it
+  void countSamples(Forest* rf, int& nSamples, int& nCodes);
+  void exportSamples(Forest* rf, const char** ids, uint64_t* uids, int* offsets, int* codes, float* values, float* ys);
+
+  // libsvm text, one "<label> <code>:<value> ..." sample per line: labels equal to negativeLabel become 0
+  // and any other 1, and samples are identified by idPrefix followed by their 0-based line number
+  // nothing is added from malformed input, and -1 is returned instead of the number of samples added
+  bool readLibsvm(std::istream& inS, const char* idPrefix, float negativeLabel, std::vector<Sample*>& samples);
+  int addFromStream(Forest* rf, std::istream& inS, const char* idPrefix, float negativeLabel);
+  int addFromFile(Forest* rf, const char* fileName, const char* idPrefix, float negativeLabel, int nThreads); // 0 for one per core
+
+  // trees and samples changed since the last save, applied on top of it
+  bool saveDelta(Forest* rf, std::ostream& outS);
+  bool applyDelta(Forest* rf, std::istream& inS);
+  bool saveDelta(Forest* rf, Sink& out);
+  bool applyDelta(Forest* rf, Source& in);
+  // merges a full snapshot and its deltas, in order, into a new full snapshot
+  bool compact(std::istream& baseS, const std::vector<std::istream*>& deltas, std::ostream& outS);
+
+  // append-only log of add/remove/commit, replayed on top of the last saved snapshot
+  void setLog(Forest* rf, std::ostream* logS); // 0 to stop logging
+  bool replayLog(Forest* rf, std::istream& logS);
+
+  // keeps the features of committed samples in an append-only file, created anew and memory-mapped,
+  // rather than in RAM. Trees and counters stay in memory. Snapshots still hold the features, so
+  // that they never depend on the file: after a restart, load with a sample file to stream them back
+  bool setSampleFile(Forest* rf, const char* fileName);
+
+  bool saveModel(Forest* rf, std::ostream& outS);
+  Model* loadModel(const char* fileName);
+  void destroy(Model* m);
+  float classify(Model* m, Sample* s);
+  float classifyPartial(Model* m, Sample* s, int n);
 }
 
 #endif
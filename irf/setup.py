@@ -1,7 +1,8 @@
 from distutils.core import setup, Extension
 
 module1 = Extension('irf',
-                    sources = ['irfmodule.cpp','randomForest.cpp','MurmurHash3.cpp'])
+                    sources = ['irfmodule.cpp','randomForest.cpp','MurmurHash3.cpp'],
+                    libraries = ['pthread'])
 
 setup (name = 'irf',
        version = '0.1',
@@ -3,6 +3,8 @@
 'use strict';
 
 var fs = require('fs');
+var assert = require('assert');
+var crypto = require('crypto');
 var irf = require('../index.js');
 var carrier = require('carrier');
 
@@ -15,6 +17,7 @@ var c = carrier.carry(fs.createReadStream('mushrooms'));
 
 var instanceID = 0;
 var testing = [];
+var training = [];
 
 function test(rf, testing) {
   var counts = [[0, 0], [0, 0]];
@@ -34,6 +37,23 @@ function printCounts(counts) {
   console.log("  false   positives: ", counts[0][1]);
 }
 
+function samplesOf(rf) {
+  var samples = [];
+  rf.each(function(suid, features, y) {
+    samples.push([suid, features, y]);
+  });
+  return samples;
+}
+
+function snapshot(rf) {
+  return JSON.stringify([rf.asJSON(), samplesOf(rf)]);
+}
+
+function removeIfThere(fileName) {
+  if(fs.existsSync(fileName))
+    fs.unlinkSync(fileName);
+}
+
 c.on('line', function(line) {
   var data = line.split(' ');
 
@@ -51,6 +71,7 @@ c.on('line', function(line) {
   if(instanceID % 5 <= 3) {
     testing.push([iid, features, y]);
   } else {
+    training.push([iid, features, y]);
     rf.add(iid, features, y);
   }
 
@@ -70,5 +91,527 @@ c.on('end', function() {
   console.log('classifying...');
   var counts = test(rf, testing);
   printCounts(counts);
-  console.log('.');
+  console.log('saving model...');
+  rf.saveModel('mushrooms.irfm');
+  console.log('mapping model...');
+  var m = new irf.Model('mushrooms.irfm');
+  console.log('classifying...');
+  counts = test(m, testing);
+  printCounts(counts);
+
+  console.log('refusing damaged models...');
+  var model = fs.readFileSync('mushrooms.irfm');
+  var nTrees = model.readUInt32LE(8);
+  var nNodes = model.readUInt32LE(12);
+  var nodesAt = 16 + 4 * nTrees;
+  assert.notEqual(model.readInt32LE(nodesAt), -1); // the first root splits
+  var loopsBack = new Buffer(model.length);
+  model.copy(loopsBack);
+  loopsBack.writeUInt32LE(0, nodesAt + 4);
+  var rootPastEnd = new Buffer(model.length);
+  model.copy(rootPastEnd);
+  rootPastEnd.writeUInt32LE(nNodes, 16);
+  [model.slice(0, model.length - 4), loopsBack, rootPastEnd].forEach(function(bad) {
+    fs.writeFileSync('mushrooms.bad.irfm', bad);
+    assert.throws(function() { new irf.Model('mushrooms.bad.irfm'); }, /could not map/);
+  });
+
+  console.log('replaying a torn log...');
+  rf = new irf.IRF(10);
+  training.slice(0, 200).forEach(function(instance) {
+    rf.add.apply(rf, instance);
+  });
+  rf.commit();
+  var base = rf.toBuffer();
+  removeIfThere('mushrooms.log');
+  rf.setLog('mushrooms.log');
+  training.slice(200, 300).forEach(function(instance) {
+    rf.add.apply(rf, instance);
+  });
+  training.slice(0, 20).forEach(function(instance) {
+    rf.remove(instance[0]);
+  });
+  rf.commit();
+  var committed = snapshot(rf);
+  assert.equal(training[249][0], '1249');
+  assert.equal(training[24][0], '124');
+  rf.remove(training[249][0]);
+  rf.setLog(null);
+  var log = fs.readFileSync('mushrooms.log');
+  fs.writeFileSync('mushrooms.log', log.slice(0, log.length - 2)); // as if the last append was cut short, leaving 'r 124'
+  rf = new irf.IRF(base);
+  assert.ok(rf.replayLog('mushrooms.log'));
+  rf.commit();
+  assert.equal(snapshot(rf), committed);
+
+  console.log('applying deltas...');
+  rf = new irf.IRF(10);
+  training.slice(0, 200).forEach(function(instance) {
+    rf.add.apply(rf, instance);
+  });
+  rf.commit();
+  base = rf.toBuffer();
+  training.slice(200, 300).forEach(function(instance) {
+    rf.add.apply(rf, instance);
+  });
+  training.slice(0, 20).forEach(function(instance) {
+    rf.remove(instance[0]);
+  });
+  var delta1 = rf.toDeltaBuffer();
+  training.slice(300, 350).forEach(function(instance) {
+    rf.add.apply(rf, instance);
+  });
+  var delta2 = rf.toDeltaBuffer();
+  var latest = snapshot(rf);
+  rf = new irf.IRF(base);
+  assert.ok(rf.applyDelta(delta1));
+  var applied = snapshot(rf);
+  [0.1, 0.5, 0.97].forEach(function(fraction) {
+    // a delta cut short changes nothing
+    assert.ok(!rf.applyDelta(delta2.slice(0, Math.floor(delta2.length * fraction))));
+    assert.equal(snapshot(rf), applied);
+  });
+  assert.ok(rf.applyDelta(delta2));
+  assert.equal(snapshot(rf), latest);
+
+  console.log('relabeling...');
+  rf = new irf.IRF(10);
+  training.slice(0, 200).forEach(function(instance) {
+    rf.add.apply(rf, instance);
+  });
+  rf.commit();
+  base = rf.toBuffer();
+  var relabeled = training.slice(0, 50).filter(function(instance) {
+    return instance[2] === 1;
+  }).map(function(instance) {
+    return instance[0];
+  });
+  relabeled.forEach(function(suid) {
+    assert.ok(rf.relabel(suid, 0.75)); // counted as 1 was, so no tree changes
+  });
+  var delta = rf.toDeltaBuffer();
+  latest = snapshot(rf);
+  rf = new irf.IRF(base);
+  assert.ok(rf.applyDelta(delta));
+  assert.equal(snapshot(rf), latest);
+  training.slice(200, 250).forEach(function(instance) {
+    rf.add.apply(rf, instance);
+  });
+  rf.remove(relabeled[0]);
+  rf.commit();
+
+  console.log('sliding a window...');
+  function ids(forest) {
+    var all = [];
+    forest.each(function(suid) {
+      all.push(suid);
+    });
+    return all;
+  }
+  function idsOf(instances) {
+    return instances.map(function(instance) { return instance[0]; }).sort();
+  }
+  rf = new irf.IRF(10, {windowSize: 100});
+  for(var i = 0; i < 3; ++i) {
+    training.slice(100 * i, 100 * i + 100).forEach(function(instance) {
+      rf.add.apply(rf, instance);
+    });
+    rf.commit();
+    // just the latest samples are kept
+    assert.deepEqual(ids(rf), idsOf(training.slice(100 * i, 100 * i + 100)));
+  }
+  assert.equal(JSON.parse(rf.countersJSON()).expired, 200);
+  assert.equal(JSON.parse(rf.statsJSON()).length, 10); // one entry per tree
+  rf = new irf.IRF(rf.toBuffer());
+  training.slice(300, 350).forEach(function(instance) {
+    rf.add.apply(rf, instance);
+  });
+  rf.commit();
+  assert.deepEqual(ids(rf), idsOf(training.slice(250, 350)));
+
+  console.log('identifying samples by integers...');
+  rf = new irf.IRF(10);
+  var uids = [1];
+  for(var i = 0; i < 50; ++i)
+    uids.push(Math.pow(2, 53) - 1 - i);
+  uids.forEach(function(uid, i) {
+    rf.addUid(uid, training[i][1], training[i][2]);
+  });
+  rf.commit();
+  rf = new irf.IRF(rf.toBuffer());
+  function byValue(a, b) {
+    return a - b;
+  }
+  assert.deepEqual(ids(rf).sort(byValue), uids.slice().sort(byValue));
+  assert.ok(rf.removeUid(Math.pow(2, 53) - 1));
+  assert.ok(!rf.removeUid(Math.pow(2, 53) - 100));
+  rf.commit();
+  assert.deepEqual(ids(rf).sort(byValue), uids.slice(2).concat([1]).sort(byValue));
+  // uid 0 is a uid like any other, and no suid stands for it
+  rf.addUid(0, training[60][1], training[60][2]);
+  rf.add('a', training[61][1], training[61][2]);
+  assert.throws(function() { rf.add('', training[62][1], training[62][2]); }, /non-empty/);
+  assert.ok(!rf.remove('') && !rf.relabel('', 1) && !rf.patch('', {1: 1}));
+  rf.commit();
+  var all = rf.exportSamples();
+  var exported = all.ids.map(function(id, i) {
+    return id ? id : all.uids[i];
+  });
+  assert.deepEqual(exported.filter(function(id) { return id !== 'a'; }).sort(byValue), uids.slice(2).concat([1, 0]).sort(byValue));
+  assert.ok(all.ids.indexOf('a') >= 0 && all.uids[all.ids.indexOf('a')] === 0);
+
+  console.log('patching...');
+  rf = new irf.IRF(10);
+  var readded = new irf.IRF(10);
+  [rf, readded].forEach(function(forest) {
+    training.slice(0, 200).forEach(function(instance) {
+      forest.add.apply(forest, instance);
+    });
+    forest.commit();
+  });
+  training.slice(0, 40).forEach(function(instance) {
+    var features = instance[1];
+    var first = Math.min.apply(null, Object.keys(features).map(Number));
+    var added = {};
+    if(!((first + 1) in features))
+      added[first + 1] = 1;
+    assert.ok(rf.patch(instance[0], added, [first]));
+    var patched = {};
+    Object.keys(features).forEach(function(code) {
+      if(Number(code) !== first)
+        patched[code] = features[code];
+    });
+    Object.keys(added).forEach(function(code) {
+      patched[code] = added[code];
+    });
+    readded.remove(instance[0]);
+    readded.commit();
+    readded.add(instance[0], patched, instance[2]);
+    readded.commit();
+  });
+  rf.commit();
+  // the same samples as taking them off and adding them back with their new features, and
+  // trees that may split in another order but classify alike
+  assert.deepEqual(samplesOf(rf), samplesOf(readded));
+  testing.forEach(function(instance) {
+    assert.equal(rf.classify(instance[1]) >= 0.5, readded.classify(instance[1]) >= 0.5);
+  });
+
+  console.log('evicting counters...');
+  rf = new irf.IRF(10);
+  var budgeted = new irf.IRF(10, {maxCounts: 300});
+  [rf, budgeted].forEach(function(forest) {
+    training.slice(0, 200).forEach(function(instance) {
+      forest.add.apply(forest, instance);
+    });
+    forest.commit();
+    for(var i = 0; i < 5; ++i) {
+      training.slice(200 + 50 * i, 250 + 50 * i).forEach(function(instance) {
+        forest.add.apply(forest, instance);
+      });
+      training.slice(10 * i, 10 * i + 10).forEach(function(instance) {
+        forest.remove(instance[0]);
+      });
+      forest.commit();
+    }
+  });
+  var counters = JSON.parse(budgeted.countersJSON());
+  assert.ok(counters.countsEvicted > 0 && counters.countsRebuilt > 0);
+  // counters dropped and rebuilt make the same trees
+  assert.equal(budgeted.asJSON(), rf.asJSON());
+
+  console.log('holding splits back...');
+  var resplits = {};
+  [0, 3].forEach(function(patience) {
+    var forest = new irf.IRF(10, {splitPatience: patience});
+    training.slice(0, 100).forEach(function(instance) {
+      forest.add.apply(forest, instance);
+    });
+    forest.commit();
+    for(var i = 0; i < 20; ++i) {
+      training.slice(100 + 20 * i, 120 + 20 * i).forEach(function(instance) {
+        forest.add.apply(forest, instance);
+      });
+      forest.commit();
+    }
+    var counters = JSON.parse(forest.countersJSON());
+    resplits[patience] = counters.resplits;
+    // patience alone, with no margin, keeps a split until another code has led 3 times
+    assert.equal(counters.resplitsHeld > 0, patience > 0);
+  });
+  assert.ok(resplits[3] < resplits[0]);
+
+  console.log('building in bulk...');
+  var bulk = new irf.IRF(10);
+  training.forEach(function(instance) {
+    bulk.add.apply(bulk, instance);
+  });
+  bulk.commit();
+  // the same trees as growing them one commit after another
+  var grown = new irf.IRF(10);
+  grown.add.apply(grown, training[0]);
+  grown.commit();
+  training.slice(1).forEach(function(instance) {
+    grown.add.apply(grown, instance);
+  });
+  grown.commit();
+  assert.equal(bulk.asJSON(), grown.asJSON());
+
+  console.log('splitting like the exact entropy kernel...');
+  // labels flipped on every 7th sample make deep trees with near ties. the digest is of the
+  // trees made when every candidate split was scored with the exact entropy
+  rf = new irf.IRF(30);
+  testing.concat(training).sort(function(a, b) { return a[0] - b[0]; }).forEach(function(instance) {
+    rf.add(instance[0], instance[1], instance[0] % 7 ? instance[2] : 1 - instance[2]);
+  });
+  rf.commit();
+  assert.equal(crypto.createHash('md5').update(rf.asJSON()).digest('hex'), '92089c5e4e66d8bfb0e8441a01afe733');
+
+  console.log('reading libsvm natively...');
+  var lines = new irf.IRF(10);
+  testing.concat(training).sort(function(a, b) { return a[0] - b[0]; }).forEach(function(instance) {
+    lines.add('m' + instance[0], instance[1], instance[2]);
+  });
+  rf = new irf.IRF(10);
+  assert.equal(rf.addFromFile('mushrooms', 1, 'm'), testing.length + training.length);
+  var fromBuffer = new irf.IRF(10);
+  assert.equal(fromBuffer.addFromBuffer(fs.readFileSync('mushrooms'), 1, 'm'), testing.length + training.length);
+  assert.equal(snapshot(rf), snapshot(lines));
+  assert.equal(snapshot(fromBuffer), snapshot(lines));
+  // -1 marks leaves and deleted features, so negative indices are malformed
+  assert.throws(function() { rf.addFromBuffer(new Buffer('1 3:1 9:1\n2 -1:1 4:1\n'), 1, 'bad'); }, /could not read/);
+  assert.equal(samplesOf(rf).length, testing.length + training.length);
+
+  console.log('keeping features in a sample file...');
+  rf = new irf.IRF(10);
+  training.slice(0, 300).forEach(function(instance) {
+    rf.add.apply(rf, instance);
+  });
+  rf.commit();
+  base = rf.toBuffer();
+  var kept = snapshot(rf);
+  assert.ok(rf.setSampleFile('mushrooms.samples'));
+  assert.ok(!rf.setSampleFile('mushrooms.samples')); // just one per forest
+  assert.equal(snapshot(rf), kept);
+  // after a restart, the snapshot's features stream straight into a new file
+  var loaded;
+  ['eager', 'parallel', 'lazy'].forEach(function(mode) {
+    loaded = new irf.IRF(base, mode, 'mushrooms.loaded.samples');
+    assert.equal(snapshot(loaded), kept);
+    assert.ok(fs.statSync('mushrooms.loaded.samples').size > 0);
+  });
+  [rf, loaded].forEach(function(forest) {
+    training.slice(300, 350).forEach(function(instance) {
+      forest.add.apply(forest, instance);
+    });
+    forest.remove(training[0][0]);
+    forest.commit();
+  });
+  assert.equal(snapshot(loaded), snapshot(rf));
+  assert.throws(function() { new irf.IRF(base, 'eager', 'no/such/dir/mushrooms.samples'); }, /could not create/);
+
+  console.log('loading in parallel and lazily...');
+  var eager = new irf.IRF(fs.readFileSync('mushrooms.rf'));
+  kept = snapshot(eager);
+  ['parallel', 'lazy'].forEach(function(mode) {
+    loaded = new irf.IRF(fs.readFileSync('mushrooms.rf'), mode);
+    // lazily loaded trees are parsed as classify first needs them
+    testing.slice(0, 100).forEach(function(instance) {
+      assert.equal(loaded.classify(instance[1]), eager.classify(instance[1]));
+    });
+    assert.equal(snapshot(loaded), kept);
+  });
+  [eager, loaded].forEach(function(forest) {
+    forest.remove(training[0][0]);
+    forest.add.apply(forest, testing[0]);
+    forest.commit();
+  });
+  assert.equal(snapshot(loaded), snapshot(eager));
+
+  console.log('adding and classifying in batches...');
+  function csr(instances) {
+    var nCodes = 0;
+    instances.forEach(function(instance) {
+      nCodes += Object.keys(instance[1]).length;
+    });
+    var offsets = new Int32Array(instances.length + 1);
+    var codes = new Int32Array(nCodes);
+    var values = new Float32Array(nCodes);
+    var j = 0;
+    instances.forEach(function(instance, i) {
+      Object.keys(instance[1]).forEach(function(code) {
+        codes[j] = Number(code);
+        values[j++] = Number(instance[1][code]);
+      });
+      offsets[i + 1] = j;
+    });
+    return [offsets, codes, values];
+  }
+  var batch = csr(training);
+  var labels = new Float32Array(training.map(function(instance) { return instance[2]; }));
+  var one = new irf.IRF(10);
+  training.forEach(function(instance) {
+    one.add.apply(one, instance);
+  });
+  one.commit();
+  // the same samples and trees as adding them one by one, with ids as strings or integers
+  [training.map(function(instance) { return instance[0]; }),
+   new Int32Array(training.map(function(instance) { return Number(instance[0]); }))].forEach(function(batchIds) {
+    rf = new irf.IRF(10);
+    assert.equal(rf.addBatch(batchIds, batch[0], batch[1], batch[2], labels), training.length);
+    rf.commit();
+    assert.equal(snapshot(rf), snapshot(one));
+  });
+  batch = csr(testing);
+  var filled = new Float32Array(testing.length);
+  assert.strictEqual(rf.classifyBatch(batch[0], batch[1], batch[2], filled), filled);
+  var returned = rf.classifyBatch(batch[0], batch[1], batch[2]);
+  testing.forEach(function(instance, i) {
+    assert.equal(returned[i], rf.classify(instance[1]));
+    assert.equal(filled[i], returned[i]);
+  });
+
+  console.log('limiting trees...');
+  function depth(tree) {
+    return Array.isArray(tree) ? 1 + Math.max(depth(tree[1]), depth(tree[2])) : 0;
+  }
+  function size(tree) {
+    return Array.isArray(tree) ? 1 + size(tree[1]) + size(tree[2]) : 1;
+  }
+  function sum(values) {
+    return values.reduce(function(a, b) { return a + b; }, 0);
+  }
+  function grow(forest) {
+    // grown in bulk, then incrementally, so both ways of splitting are limited
+    training.slice(0, 800).forEach(function(instance) {
+      forest.add.apply(forest, instance);
+    });
+    forest.commit();
+    training.slice(800).forEach(function(instance) {
+      forest.add.apply(forest, instance);
+    });
+    forest.commit();
+    return JSON.parse(forest.asJSON());
+  }
+  var unlimited = sum(grow(new irf.IRF(10)).map(size));
+  var counted = ['depthLimited', 'sizeLimited', 'leafSizeLimited'];
+  [['maxDepth', 3, 'depthLimited'], ['maxUnsplit', 20, 'sizeLimited'], ['minSamplesLeaf', 20, 'leafSizeLimited']].forEach(function(limit) {
+    var config = {};
+    config[limit[0]] = limit[1];
+    rf = new irf.IRF(10, config);
+    var trees = grow(rf);
+    // each limit held trees back, and only its own counter says so
+    var counters = JSON.parse(rf.countersJSON());
+    assert.deepEqual(counted.map(function(name) { return counters[name] > 0; }),
+                     counted.map(function(name) { return name === limit[2]; }));
+    assert.ok(sum(trees.map(size)) < unlimited);
+    if(limit[0] === 'maxDepth')
+      assert.equal(Math.max.apply(null, trees.map(depth)), limit[1]);
+  });
+
+  console.log('sharing identical features...');
+  function md5(forest) {
+    return crypto.createHash('md5').update(forest.asJSON()).digest('hex');
+  }
+  rf = new irf.IRF(30);
+  training.slice(0, 300).forEach(function(instance) {
+    ['', 'b', 'c'].forEach(function(copy) {
+      rf.add(instance[0] + copy, instance[1], instance[2]);
+    });
+  });
+  rf.commit();
+  // the digests are of the trees made when each sample had its own copy of its features
+  assert.equal(md5(rf), 'bb82e19dee7a2c6a0ee10be32abb39c4');
+  // exported in one pass and added back as a batch, they make the same forest
+  var exportedSamples = rf.exportSamples();
+  var copied = new irf.IRF(30);
+  assert.equal(copied.addBatch(exportedSamples.ids, exportedSamples.offsets, exportedSamples.codes,
+                               exportedSamples.values, exportedSamples.ys), exportedSamples.ids.length);
+  copied.commit();
+  assert.equal(snapshot(copied), snapshot(rf));
+  training.slice(0, 100).forEach(function(instance) {
+    rf.remove(instance[0] + 'b');
+  });
+  rf.add('x', training[0][1], 1 - training[0][2]);
+  rf.commit();
+  assert.equal(md5(rf), '85f303a7f8bae7411860451df1a7e0af');
+  // and every copy still has its features
+  var known = {x: training[0][1]};
+  training.slice(0, 300).forEach(function(instance) {
+    ['', 'b', 'c'].forEach(function(copy) {
+      known[instance[0] + copy] = instance[1];
+    });
+  });
+  samplesOf(rf).forEach(function(sample) {
+    assert.deepEqual(sample[1], known[sample[0]]);
+  });
+
+  console.log('looking samples up by id...');
+  // every other id is longer than any fixed buffer, and the ids are added out of order
+  var padded = training.slice(0, 400).map(function(instance, i) {
+    return [instance[0] + (i % 2 ? '-' + new Array(101).join('x') : ''), instance[1], instance[2]];
+  }).reverse();
+  rf = new irf.IRF(10);
+  padded.forEach(function(instance) {
+    rf.add.apply(rf, instance);
+  });
+  rf.commit();
+  assert.deepEqual(ids(rf), idsOf(padded));
+  padded.slice(0, 100).forEach(function(instance) {
+    assert.ok(rf.relabel(instance[0], 1 - instance[2]));
+    // ids that only share a prefix are other samples
+    assert.ok(!rf.remove(instance[0] + 'x') && !(instance[0].length > 100 && rf.remove(instance[0].slice(0, -1))));
+  });
+  padded.slice(100, 200).forEach(function(instance) {
+    assert.ok(rf.remove(instance[0]));
+  });
+  rf.commit();
+  var relabeledById = {};
+  samplesOf(rf).forEach(function(sample) {
+    relabeledById[sample[0]] = sample[2];
+  });
+  assert.deepEqual(Object.keys(relabeledById).sort(), idsOf(padded.slice(0, 100).concat(padded.slice(200))));
+  padded.slice(0, 100).forEach(function(instance) {
+    assert.equal(relabeledById[instance[0]], 1 - instance[2]);
+  });
+  assert.equal(snapshot(new irf.IRF(rf.toBuffer())), snapshot(rf));
+
+  console.log('running asynchronously...');
+  rf = new irf.IRF(10);
+  training.slice(0, 200).forEach(function(instance) {
+    rf.add.apply(rf, instance);
+  });
+  // nor can it be started on or changed from callbacks walking it, which swallow exceptions
+  var rejected = [];
+  rf.each(function(suid) {
+    try { rf.commitAsync(function() {}); } catch(e) { rejected.push(/busy/.test(e.message)); }
+    try { rf.remove(suid); } catch(e) { rejected.push(/busy/.test(e.message)); }
+    return false;
+  });
+  rf.saveTo(function(chunk) {
+    try { rf.add('x', testing[0][1], 1); } catch(e) { rejected.push(/busy/.test(e.message)); }
+    return false;
+  });
+  assert.deepEqual(rejected, [true, true, true]);
+  assert.equal(samplesOf(rf).length, 200);
+  rf.commitAsync(function(err) {
+    assert.ifError(err);
+    var batch = testing.slice(0, 100).map(function(instance) { return instance[1]; });
+    rf.classifyBatchAsync(batch, function(err, ys) {
+      assert.ifError(err);
+      assert.equal(ys.length, batch.length);
+      batch.forEach(function(features, i) {
+        assert.equal(ys[i], rf.classify(features));
+      });
+      rf.toBufferAsync(function(err, b) {
+        assert.ifError(err);
+        assert.equal(b.toString('base64'), rf.toBuffer().toString('base64'));
+        console.log('.');
+      });
+    });
+  });
+  // the forest is off limits until the callback runs
+  assert.throws(function() { rf.classify(testing[0][1]); }, /busy/);
+  assert.throws(function() { rf.add('x', testing[0][1], 1); }, /busy/);
+  assert.throws(function() { rf.commitAsync(function() {}); }, /busy/);
 });
@@ -1,5 +1,11 @@
 #!/usr/bin/python
 
+import os
+import json
+import ctypes
+import hashlib
+import struct
+import threading
 import irf
 
 def printCounts(counts):
@@ -17,6 +23,28 @@ def test(rf, testing):
         counts[c][instance[2]] = counts[c][instance[2]] + 1
     return counts
 
+def snapshot(rf):
+    return (rf.asJSON(), list(rf.samples()))
+
+# CSR buffers, as ctypes arrays since they have the buffer interface numpy arrays have
+def csr(instances):
+    nCodes = sum(len(instance[1]) for instance in instances)
+    indptr = (ctypes.c_int * (len(instances) + 1))()
+    indices = (ctypes.c_int * nCodes)()
+    data = (ctypes.c_float * nCodes)()
+    j = 0
+    for i, instance in enumerate(instances):
+        for code, value in sorted(instance[1].items()):
+            indices[j] = code
+            data[j] = value
+            j += 1
+        indptr[i + 1] = j
+    return indptr, indices, data
+
+def removeIfThere(fileName):
+    if os.path.exists(fileName):
+        os.remove(fileName)
+
 def main():
     rf = irf.IRF(99)
 
@@ -24,6 +52,7 @@ def main():
     f = open('mushrooms')
     instanceID = 0
     testing = []
+    training = []
     classValues = {'1':0, '2':1}
     for rawL in f.readlines():
         l = rawL.strip()
@@ -37,6 +66,7 @@ def main():
         if instanceID % 5 <= 3:
             testing.append(instance)
         else:
+            training.append(instance)
             rf.add(*instance)
         instanceID = instanceID + 1
 
@@ -57,6 +87,425 @@ def main():
     counts = test(rf, testing)
     printCounts(counts)
 
+    print 'saving model...'
+    rf.saveModel('mushrooms.irfm')
+
+    print 'mapping model...'
+    m = irf.loadModel('mushrooms.irfm')
+
+    print 'classifying...'
+    counts = test(m, testing)
+    printCounts(counts)
+
+    print 'refusing damaged models...'
+    model = open('mushrooms.irfm', 'rb').read()
+    nTrees, nNodes = struct.unpack_from('II', model, 8)
+    nodesAt = 16 + 4 * nTrees
+    assert struct.unpack_from('i', model, nodesAt)[0] != -1 # the first root splits
+    damaged = [model[:-4],
+               model[:nodesAt + 4] + struct.pack('I', 0) + model[nodesAt + 8:], # loops back to the root
+               model[:16] + struct.pack('I', nNodes) + model[20:]] # root past the end
+    for bad in damaged:
+        open('mushrooms.bad.irfm', 'wb').write(bad)
+        try:
+            irf.loadModel('mushrooms.bad.irfm')
+            assert False
+        except IOError:
+            pass
+
+    print 'replaying a torn log...'
+    rf = irf.IRF(10)
+    for instance in training[:200]:
+        rf.add(*instance)
+    rf.commit()
+    rf.save('mushrooms.base.rf')
+    removeIfThere('mushrooms.log')
+    rf.setLog('mushrooms.log')
+    for instance in training[200:300]:
+        rf.add(*instance)
+    for instance in training[:20]:
+        rf.remove(instance[0])
+    rf.commit()
+    committed = snapshot(rf)
+    assert training[249][0] == '1249' and training[24][0] == '124'
+    rf.remove(training[249][0])
+    rf.setLog(None)
+    log = open('mushrooms.log').read()
+    open('mushrooms.log', 'w').write(log[:-2]) # as if the last append was cut short, leaving 'r 124'
+    rf = irf.load('mushrooms.base.rf')
+    assert rf.replayLog('mushrooms.log')
+    rf.commit()
+    assert snapshot(rf) == committed
+
+    print 'applying deltas...'
+    rf = irf.IRF(10)
+    for instance in training[:200]:
+        rf.add(*instance)
+    rf.commit()
+    rf.save('mushrooms.base.rf')
+    for instance in training[200:300]:
+        rf.add(*instance)
+    for instance in training[:20]:
+        rf.remove(instance[0])
+    assert rf.saveDelta('mushrooms.1.delta')
+    for instance in training[300:350]:
+        rf.add(*instance)
+    assert rf.saveDelta('mushrooms.2.delta')
+    latest = snapshot(rf)
+    rf = irf.load('mushrooms.base.rf')
+    assert rf.applyDelta('mushrooms.1.delta')
+    applied = snapshot(rf)
+    delta = open('mushrooms.2.delta').read()
+    for cut in [len(delta) / 10, len(delta) / 2, len(delta) * 97 / 100]:
+        open('mushrooms.cut.delta', 'w').write(delta[:cut])
+        assert not rf.applyDelta('mushrooms.cut.delta') # a delta cut short changes nothing
+        assert snapshot(rf) == applied and rf.validate()
+    assert rf.applyDelta('mushrooms.2.delta')
+    assert snapshot(rf) == latest
+    assert irf.compact('mushrooms.base.rf', ['mushrooms.1.delta', 'mushrooms.2.delta'], 'mushrooms.compact.rf')
+    assert snapshot(irf.load('mushrooms.compact.rf')) == latest
+
+    print 'relabeling...'
+    rf = irf.IRF(10)
+    for instance in training[:200]:
+        rf.add(*instance)
+    rf.commit()
+    rf.save('mushrooms.base.rf')
+    relabeled = [instance[0] for instance in training[:50] if instance[2] == 1]
+    for sId in relabeled:
+        assert rf.relabel(sId, 0.75) # counted as 1 was, so no tree changes
+    assert rf.saveDelta('mushrooms.1.delta')
+    latest = snapshot(rf)
+    rf = irf.load('mushrooms.base.rf')
+    assert rf.applyDelta('mushrooms.1.delta')
+    assert snapshot(rf) == latest and rf.validate()
+    for instance in training[200:250]:
+        rf.add(*instance)
+    rf.remove(relabeled[0])
+    rf.commit()
+    assert rf.validate()
+
+    print 'sliding a window...'
+    rf = irf.IRF(10, windowSize=100)
+    for i in range(3):
+        for instance in training[100 * i:100 * i + 100]:
+            rf.add(*instance)
+        rf.commit()
+        # just the latest samples are kept
+        assert [s[0] for s in rf.samples()] == sorted(instance[0] for instance in training[100 * i:100 * i + 100])
+    assert json.loads(rf.countersJSON())['expired'] == 200
+    assert len(json.loads(rf.statsJSON())) == 10 # one entry per tree
+    rf.save('mushrooms.base.rf')
+    rf = irf.load('mushrooms.base.rf')
+    for instance in training[300:350]:
+        rf.add(*instance)
+    rf.commit()
+    assert [s[0] for s in rf.samples()] == sorted(instance[0] for instance in training[250:350])
+    assert rf.validate()
+
+    print 'identifying samples by integers...'
+    rf = irf.IRF(10)
+    uids = [2 ** 64 - 1 - i for i in range(50)] + [2 ** 53 + 1, 1]
+    for uid, instance in zip(uids, training):
+        rf.addUid(uid, instance[1], instance[2])
+    rf.commit()
+    rf.save('mushrooms.base.rf')
+    rf = irf.load('mushrooms.base.rf')
+    assert sorted(s[0] for s in rf.samples()) == sorted(uids)
+    assert rf.removeUid(2 ** 64 - 1) and rf.removeUid(2 ** 53 + 1)
+    assert not rf.removeUid(2 ** 53)
+    rf.commit()
+    assert sorted(s[0] for s in rf.samples()) == sorted(uids[1:-2] + [1])
+    assert rf.validate()
+    # uid 0 is a uid like any other, and no suid stands for it
+    rf.addUid(0, training[60][1], training[60][2])
+    rf.add('a', training[61][1], training[61][2])
+    try:
+        rf.add('', training[62][1], training[62][2])
+        assert False
+    except ValueError:
+        pass
+    assert not rf.remove('') and not rf.relabel('', 1) and not rf.patch('', {1: 1}, [])
+    rf.commit()
+    ids, uidBytes = rf.exportSamples()[:2]
+    exported = struct.unpack('=%dQ' % len(ids), str(uidBytes))
+    assert sorted(zip(ids, exported)) == [('', uid) for uid in sorted(uids[1:-2] + [1, 0])] + [('a', 0)]
+
+    print 'patching...'
+    rf = irf.IRF(10)
+    readded = irf.IRF(10)
+    for forest in [rf, readded]:
+        for instance in training[:200]:
+            forest.add(*instance)
+        forest.commit()
+    for sId, features, y in training[:40]:
+        first = min(features)
+        added = {} if first + 1 in features else {first + 1: 1}
+        assert rf.patch(sId, added, [first])
+        patched = dict(features)
+        del patched[first]
+        patched.update(added)
+        readded.remove(sId)
+        readded.commit()
+        readded.add(sId, patched, y)
+        readded.commit()
+    rf.commit()
+    # the same samples as taking them off and adding them back with their new features, and
+    # trees that may split in another order but classify alike
+    assert list(rf.samples()) == list(readded.samples())
+    assert rf.validate() and readded.validate()
+    for instance in testing:
+        assert (rf.classify(instance[1]) >= 0.5) == (readded.classify(instance[1]) >= 0.5)
+
+    print 'evicting counters...'
+    rf = irf.IRF(10)
+    budgeted = irf.IRF(10, maxCounts=300)
+    for forest in [rf, budgeted]:
+        for instance in training[:200]:
+            forest.add(*instance)
+        forest.commit()
+        for i in range(5):
+            for instance in training[200 + 50 * i:250 + 50 * i]:
+                forest.add(*instance)
+            for instance in training[10 * i:10 * i + 10]:
+                forest.remove(instance[0])
+            forest.commit()
+    counters = json.loads(budgeted.countersJSON())
+    assert counters['countsEvicted'] > 0 and counters['countsRebuilt'] > 0
+    # counters dropped and rebuilt make the same trees
+    assert budgeted.asJSON() == rf.asJSON() and budgeted.validate()
+
+    print 'holding splits back...'
+    resplits = {}
+    for patience in [0, 3]:
+        rf = irf.IRF(10, splitPatience=patience)
+        for instance in training[:100]:
+            rf.add(*instance)
+        rf.commit()
+        for i in range(20):
+            for instance in training[100 + 20 * i:120 + 20 * i]:
+                rf.add(*instance)
+            rf.commit()
+        counters = json.loads(rf.countersJSON())
+        resplits[patience] = counters['resplits']
+        # patience alone, with no margin, keeps a split until another code has led 3 times
+        assert (counters['resplitsHeld'] > 0) == (patience > 0)
+        assert rf.validate()
+    assert resplits[3] < resplits[0]
+
+    print 'building in bulk...'
+    bulk = irf.IRF(10)
+    for instance in training:
+        bulk.add(*instance)
+    bulk.commit()
+    # the same trees as growing them one commit after another
+    grown = irf.IRF(10)
+    grown.add(*training[0])
+    grown.commit()
+    for instance in training[1:]:
+        grown.add(*instance)
+    grown.commit()
+    assert bulk.asJSON() == grown.asJSON()
+
+    print 'splitting like the exact entropy kernel...'
+    # labels flipped on every 7th sample make deep trees with near ties. the digest is of the
+    # trees made when every candidate split was scored with the exact entropy
+    rf = irf.IRF(30)
+    for sId, features, y in sorted(testing + training, key=lambda instance: int(instance[0])):
+        rf.add(sId, features, y if int(sId) % 7 else 1 - y)
+    rf.commit()
+    assert hashlib.md5(rf.asJSON()).hexdigest() == '92089c5e4e66d8bfb0e8441a01afe733'
+
+    print 'reading libsvm natively...'
+    rf = irf.IRF(10)
+    lines = irf.IRF(10)
+    for instance in sorted(testing + training, key=lambda instance: int(instance[0])):
+        lines.add('m' + instance[0], instance[1], instance[2])
+    assert rf.addFromFile('mushrooms', 1, 'm') == len(testing) + len(training)
+    assert list(rf.samples()) == list(lines.samples())
+    assert rf.asJSON() == lines.asJSON()
+    # -1 marks leaves and deleted features, so negative indices are malformed
+    out = open('mushrooms.bad.libsvm', 'w')
+    out.write('1 3:1 9:1\n2 -1:1 4:1\n')
+    out.close()
+    try:
+        rf.addFromFile('mushrooms.bad.libsvm', 1, 'bad')
+        assert False
+    except IOError:
+        pass
+    assert len(list(rf.samples())) == len(testing) + len(training)
+    os.remove('mushrooms.bad.libsvm')
+
+    print 'keeping features in a sample file...'
+    rf = irf.IRF(10)
+    for instance in training[:300]:
+        rf.add(*instance)
+    rf.commit()
+    rf.save('mushrooms.base.rf')
+    kept = snapshot(rf)
+    assert rf.setSampleFile('mushrooms.samples')
+    assert not rf.setSampleFile('mushrooms.samples') # just one per forest
+    assert snapshot(rf) == kept
+    # after a restart, the snapshot's features stream straight into a new file
+    for mode in ['eager', 'parallel', 'lazy']:
+        loaded = irf.load('mushrooms.base.rf', mode, 'mushrooms.loaded.samples')
+        assert snapshot(loaded) == kept and os.path.getsize('mushrooms.loaded.samples') > 0
+    for forest in [rf, loaded]:
+        for instance in training[300:350]:
+            forest.add(*instance)
+        forest.remove(training[0][0])
+        forest.commit()
+    assert snapshot(loaded) == snapshot(rf)
+    for instance in testing[:100]:
+        assert loaded.classify(instance[1]) == rf.classify(instance[1])
+    try:
+        irf.load('mushrooms.base.rf', None, 'no/such/dir/mushrooms.samples')
+        assert False
+    except IOError:
+        pass
+
+    print 'loading in parallel and lazily...'
+    eager = irf.load('mushrooms.rf')
+    kept = snapshot(eager)
+    for mode in ['parallel', 'lazy']:
+        loaded = irf.load('mushrooms.rf', mode)
+        # lazily loaded trees are parsed as classify first needs them
+        for instance in testing[:100]:
+            assert loaded.classify(instance[1]) == eager.classify(instance[1])
+        assert snapshot(loaded) == kept
+    for forest in [eager, loaded]:
+        forest.remove(training[0][0])
+        forest.add(*testing[0])
+        forest.commit()
+    assert snapshot(loaded) == snapshot(eager)
+
+    print 'adding and classifying in batches...'
+    indptr, indices, data = csr(training)
+    y = (ctypes.c_float * len(training))(*[instance[2] for instance in training])
+    one = irf.IRF(10)
+    for instance in training:
+        one.add(*instance)
+    one.commit()
+    # the same samples and trees as adding them one by one
+    rf = irf.IRF(10)
+    assert rf.addBatch([instance[0] for instance in training], indptr, indices, data, y) == len(training)
+    rf.commit()
+    assert snapshot(rf) == snapshot(one)
+    uids = (ctypes.c_uint64 * len(training))(*[2 ** 64 - 1 - i for i in range(len(training))])
+    byUid = irf.IRF(10)
+    assert byUid.addBatchUids(uids, indptr, indices, data, y) == len(training)
+    assert sorted(s[0] for s in byUid.samples()) == sorted(uids)
+    indptr, indices, data = csr(testing)
+    out = (ctypes.c_float * len(testing))()
+    rf.classifyBatch(indptr, indices, data, out)
+    assert list(out) == [rf.classify(instance[1]) for instance in testing]
+
+    print 'limiting trees...'
+    def depth(tree):
+        return 1 + max(depth(tree[1]), depth(tree[2])) if isinstance(tree, list) else 0
+    def size(tree):
+        return 1 + size(tree[1]) + size(tree[2]) if isinstance(tree, list) else 1
+    def grow(forest):
+        # grown in bulk, then incrementally, so both ways of splitting are limited
+        for instance in training[:800]:
+            forest.add(*instance)
+        forest.commit()
+        for instance in training[800:]:
+            forest.add(*instance)
+        forest.commit()
+        return json.loads(forest.asJSON())
+    unlimited = sum(size(tree) for tree in grow(irf.IRF(10)))
+    counted = ['depthLimited', 'sizeLimited', 'leafSizeLimited']
+    for limit, value, counter in [('maxDepth', 3, 'depthLimited'), ('maxUnsplit', 20, 'sizeLimited'),
+                                  ('minSamplesLeaf', 20, 'leafSizeLimited')]:
+        rf = irf.IRF(10, **{limit: value})
+        trees = grow(rf)
+        # each limit held trees back, and only its own counter says so
+        counters = json.loads(rf.countersJSON())
+        assert [counters[name] > 0 for name in counted] == [name == counter for name in counted]
+        assert sum(size(tree) for tree in trees) < unlimited
+        assert rf.validate()
+        if limit == 'maxDepth':
+            assert max(depth(tree) for tree in trees) == value
+
+    print 'sharing identical features...'
+    rf = irf.IRF(30)
+    for sId, features, y in training[:300]:
+        for copy in ['', 'b', 'c']:
+            rf.add(sId + copy, features, y)
+    rf.commit()
+    # the digests are of the trees made when each sample had its own copy of its features
+    assert hashlib.md5(rf.asJSON()).hexdigest() == 'bb82e19dee7a2c6a0ee10be32abb39c4'
+    # exported in one pass and added back as a batch, they make the same forest
+    ids, uids, indptr, indices, data, y = rf.exportSamples()
+    n = len(ids)
+    copied = irf.IRF(30)
+    assert copied.addBatch(ids, (ctypes.c_int * (n + 1)).from_buffer(indptr),
+                           (ctypes.c_int * (len(indices) / 4)).from_buffer(indices),
+                           (ctypes.c_float * (len(data) / 4)).from_buffer(data), (ctypes.c_float * n).from_buffer(y)) == n
+    copied.commit()
+    assert snapshot(copied) == snapshot(rf)
+    for sId, features, y in training[:100]:
+        rf.remove(sId + 'b')
+    rf.add('x', training[0][1], 1 - training[0][2])
+    rf.commit()
+    assert hashlib.md5(rf.asJSON()).hexdigest() == '85f303a7f8bae7411860451df1a7e0af'
+    # and every copy still has its features
+    known = dict((sId + copy, features) for sId, features, y in training[:300] for copy in ['', 'b', 'c'])
+    known['x'] = training[0][1]
+    for sId, features, y in rf.samples():
+        assert features == known[sId]
+    assert rf.validate()
+
+    print 'looking samples up by id...'
+    # every other id is longer than any fixed buffer, and the ids are added out of order
+    padded = [(sId + ('-' + 'x' * 100 if i % 2 else ''), features, y) for i, (sId, features, y) in enumerate(training[:400])]
+    padded.reverse()
+    rf = irf.IRF(10)
+    for instance in padded:
+        rf.add(*instance)
+    rf.commit()
+    assert [s[0] for s in rf.samples()] == sorted(instance[0] for instance in padded)
+    for sId, features, y in padded[:100]:
+        assert rf.relabel(sId, 1 - y)
+        # ids that only share a prefix are other samples
+        assert not rf.remove(sId + 'x') and not (len(sId) > 100 and rf.remove(sId[:-1]))
+    for sId, features, y in padded[100:200]:
+        assert rf.remove(sId)
+    rf.commit()
+    kept = [(sId, features, 1 - y) for sId, features, y in padded[:100]] + padded[200:]
+    assert list(rf.samples()) == sorted(kept)
+    rf.save('mushrooms.base.rf')
+    assert snapshot(irf.load('mushrooms.base.rf')) == snapshot(rf)
+    assert rf.validate()
+
+    print 'walking while another thread commits...'
+    rf = irf.IRF(10)
+    for instance in training[:500]:
+        rf.add(*instance)
+    rf.commit()
+    def churn():
+        for i in range(10):
+            for instance in training[50 * i:50 * i + 50]:
+                rf.remove(instance[0])
+            rf.commit()
+            for instance in training[50 * i:50 * i + 50]:
+                rf.add(*instance)
+            rf.commit()
+    churner = threading.Thread(target=churn)
+    churner.start()
+    walked = []
+    while churner.is_alive():
+        walked.append(list(rf.samples()))
+    churner.join()
+    # each walk is of the forest at one point, never of samples freed under it
+    known = dict((instance[0], instance) for instance in training[:500])
+    for samples in walked:
+        assert 450 <= len(samples) <= 500
+        for sId, features, y in samples:
+            assert (sId, features, y) == known[sId]
+    assert rf.validate()
+
     print '.'
 
 if __name__ == "__main__":